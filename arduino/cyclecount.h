@@ -1,4 +1,7 @@
 
+#ifdef FLOPPY8_SIM
+#define CPU_CYCLES	sim_cycles()	// the simulated clock, see sim/Arduino.h
+#else
 // Core Debug registers
 #define DEMCR		(*((volatile uint32_t *)0xE000EDFC))
 #define DEMCR_TRCENA	0x01000000
@@ -6,9 +9,10 @@
 #define CYCCNTENA	(1u<<0)
 #define DWT_CYCCNT	((volatile uint32_t *)0xE0001004)
 #define CPU_CYCLES	(*DWT_CYCCNT)
+#endif
 
 // get current 32-bit cpu cycle counter
-static inline volatile uint32_t
+static inline uint32_t
 cycle_count ()
 {
 	return CPU_CYCLES;
@@ -35,7 +39,9 @@ cycle_since (const uint32_t prev)
 static inline void
 cycle_init (void)
 {
+#ifndef FLOPPY8_SIM
 	DEMCR |= DEMCR_TRCENA;	// Enable DWT
 	*DWT_CYCCNT = 0;
 	DWT_CTRL |= CYCCNTENA;	// Enable CPU cycle counter
+#endif
 }
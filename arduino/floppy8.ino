@@ -1,28 +1,40 @@
+#include <inttypes.h>
 #include "cyclecount.h"
 #include "sa800.h"
 #include "fat.h"
+#include "pack.h"
 
 //
 //	floppy8 --- read contents of ancient 8" floppy from Shugart SA-800 disk drive
 //
 //	Captures all data bits coming from the drive and
-//	write the deltas between each bit in one file per track
+//	write the deltas between each bit in one file per track (per side of a double sided disk)
 //
 //	Uses a Teensy 4.1 and uses its SD card to save captures
 
 #define	ONE_US		600				// Teensy 4.1 clock is 600Mhz
-#define	CAPTURE_TIMEOUT	(3*SA800_ONE_REV*ONE_US)	// max time to capture pulses (in cpu cycle counts)
+#define	CAPTURE_REVS	5				// revolutions captured per track, for the host to vote over; as many as PACKED_SIZE holds
+#define	CAPTURE_TIMEOUT	(CAPTURE_REVS*SA800_ONE_REV*ONE_US)	// max time to capture pulses (in cpu cycle counts)
 #define	INDEX_TIMEOUT	(4*SA800_ONE_REV*ONE_US)	// max time to wait for index pulse
+#define	READING_WINDOW	(100*ONE_US)	// time to look for read data pulses, a formatted track gives 25 or more
+#define	READING_PULSES	8		// fewest pulses in READING_WINDOW that show the head is reading
 
-#define	DISK_FMT	"Disk%03lu"	// directory name format
-#define	TRACK_FMT	"Track%02lu.raw"	// track name format
+#define	DISK_FMT	"Disk%03" PRIu32	// directory name format
+#define	TRACK_FMT	"Track%02" PRIu32 ".raw"	// track name format
+#define	TRACK1_FMT	"Track%02" PRIu32 "_%" PRIu32 ".raw"	// and of the other side of a double sided disk
 #define	USER_DELAY	1000		// waiting for user to do something (in ms)
 
-#define SAMPLE_SIZE	200000		// theoretically there can be no more than SA800_ONE_REV/2 pulses per track (roughly 84000)
-#define	SAMPLE_SHIFT	0		// if desired, shift raw capture delta right by this much if low bits are not very important
-#define	SAMPLE_MAX	0xFFFF		// differences are clamped to this so it fits within a sample_t
-typedef uint16_t sample_t;		// a sample is the CPU cyclecounter difference between 2 falling edges of data, shifted by SAMPLE_SHIFT, capped at SAMPLE_MAX
-sample_t Samples[SAMPLE_SIZE];		// sample buffer (cannot be PSRAM, unfortunately)
+#define PACKED_SIZE	400000		// bytes of packed samples, about one per pulse; an FM track gives about 70000 pulses per revolution, and can give no more than SA800_ONE_REV/2 (roughly 84000)
+#define	SAMPLE_SHIFT	4		// shift raw capture delta right by this much, low bits are not very important and the rest packs into a byte
+// a sample is the CPU cyclecounter difference between 2 falling edges of data, shifted by SAMPLE_SHIFT,
+// kept packed (see pack.h) so long gaps need not be clamped
+uint8_t Packed[PACKED_SIZE];		// sample buffer (cannot be PSRAM, unfortunately)
+
+#define	MAX_INDEX	8		// index pulses noted per capture, the first is where capture starts
+uint32_t Index_sample[MAX_INDEX];	// sample number following each index pulse
+uint32_t Index_cycles[MAX_INDEX];	// cpu cycles from the start of capture to each index pulse
+uint32_t Index_count;
+boolean Index_level;			// INDEX pin as last seen during capture
 
 uint32_t Disk = 0;	// counts the number of disks scanned
 uint32_t Last_capture;	// how long (in cycles) did the last capture take?
@@ -58,21 +70,36 @@ setup ()
 }
 
 // write all collected sample to a file, one sample per line
+// Capture details come first as '#' lines: the cpu clock and sample shift, then
+// the sample number and cycle count of every index pulse seen
 boolean
-save_data (uint32_t disk, uint32_t track, sample_t * buf, uint32_t count)
+save_data (uint32_t disk, uint32_t track, uint32_t side, const uint8_t * buf, uint32_t count)
 {
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + PACKED_SIZE;
 	uint32_t i;
+	uint32_t v;
 	File fp;
 	char path[128];
 	char item[32];
 
-	sprintf (path, "/" DISK_FMT "/" TRACK_FMT, disk, track);
+	if (side)
+		sprintf (path, "/" DISK_FMT "/" TRACK1_FMT, disk, track, side);
+	else
+		sprintf (path, "/" DISK_FMT "/" TRACK_FMT, disk, track);
+	SD.remove (path);	// from an earlier pass over a disk being captured again
 	fp = SD.open (path, FILE_WRITE_BEGIN);
 	if (!fp)
 		return false;
 
-	for (i = 0; i < count; i++) {
-		sprintf (item, "%u\n", buf[i]);
+	sprintf (item, "# clock %u %u\n", One_us, SAMPLE_SHIFT);
+	fp.write (item, strlen (item));
+	for (i = 0; i < Index_count; i++) {
+		sprintf (item, "# index %u %u\n", Index_sample[i], Index_cycles[i]);
+		fp.write (item, strlen (item));
+	}
+	for (i = 0; i < count && (p = pack_get (p, end, &v)) != NULL; i++) {
+		sprintf (item, "%u\n", v);
 		fp.write (item, strlen (item));	// TODO: check that write worked
 	}
 	fp.close ();
@@ -117,48 +144,91 @@ wait_for_edge (const int pin, const uint32_t start, const uint32_t timeout)
 	return true;
 }
 
-// convert the difference between 2 cpu cycle counts to a sample_t
-inline sample_t
-sample_cvt(const uint32_t curr, const uint32_t prev)
+// Note a falling INDEX edge against the sample about to be captured
+inline void
+index_check (const uint32_t start, const uint32_t sample)
+{
+	boolean level = digitalReadFast (INDEX);
+
+	if (level == LOW && Index_level == HIGH && Index_count < MAX_INDEX) {
+		Index_sample[Index_count] = sample;
+		Index_cycles[Index_count] = cycle_since (start);
+		Index_count++;
+	}
+	Index_level = level;
+}
+
+// Same as wait_for_edge(READ_DATA,...), but watch for index pulses while waiting
+inline boolean
+wait_for_data (const uint32_t start, const uint32_t timeout, const uint32_t sample)
 {
-	uint32_t	delta = curr-prev;
+	while (digitalReadFast (READ_DATA) == LOW) {
+		index_check (start, sample);
+		if (cycle_since (start) >= timeout)
+			return false;
+	}
+	while (digitalReadFast (READ_DATA) == HIGH) {
+		index_check (start, sample);
+		if (cycle_since (start) >= timeout)
+			return false;
+	}
+	return true;
+}
 
-	delta >>= SAMPLE_SHIFT;	// low bits are not so useful?
-	if (delta > SAMPLE_MAX)
-		delta = SAMPLE_MAX;
-	return (sample_t)delta;
+// convert the difference between 2 cpu cycle counts to a sample
+inline uint32_t
+sample_cvt(const uint32_t curr, const uint32_t prev)
+{
+	return (curr-prev) >> SAMPLE_SHIFT;	// low bits are not so useful?
 }
 
-// Wait for INDEX pulse, then capture cpu cycle difference between falling READ_DATA edges
+// Capture cpu cycle difference between falling READ_DATA edges
+// With FAST_TIMING capture starts at once, wherever the head is on the track: CAPTURE_REVS
+// revolutions still hold CAPTURE_REVS-1 whole ones, and the host decodes the pieces before the
+// first index pulse and after the last as well, which together make up one more.  Otherwise
+// it waits for an INDEX pulse and starts there
+// Five FM revolutions are about 350000 bytes packed, so they fit in PACKED_SIZE; a sixth would not
+// Index pulses are noted in Index_sample/Index_cycles so the host can split revolutions
+// Samples are packed into 'buf' as they come, a byte for most of them (see pack.h)
 // Stop when the buffer fills up or the timeout (in cpu cycles) is reached
 // Disable interrupts to prevent clock ticks and/or other activity from
 // disturbing the capture so that the timing is as accurate as possible.
 // Cannot use delay() since interrupts are disabled
 // Return the number of samples collected
 uint32_t
-capture (volatile sample_t * buf, const uint32_t count)
+capture (uint8_t * buf, const uint32_t size)
 {
-	volatile sample_t *s = buf;
-	volatile sample_t *send = buf + count;
+	uint8_t *p = buf;
+	uint8_t *pend = buf + size - PACK_MAX;	// room for one more sample, however long
+	uint32_t n = 0;
 	volatile uint32_t start, curr, prev;
 
+	Index_count = 0;
 	noInterrupts ();
-	if (!wait_for_edge (INDEX, cycle_count(), INDEX_TIMEOUT)){
+	if (!FAST_TIMING && !wait_for_edge (INDEX, cycle_count(), INDEX_TIMEOUT)){
 		interrupts();
 		Last_capture = 0;
 		return 0;
 		}
 	start = prev = cycle_count ();	// remember start of capture, establish 'prev'
-	for (; s < send; s++) {
-		if (!wait_for_edge (READ_DATA, start, CAPTURE_TIMEOUT))
+	if (FAST_TIMING)
+		Index_level = digitalReadFast (INDEX);	// a pulse already under way is not a new one
+	else {
+		Index_sample[0] = 0;
+		Index_cycles[0] = 0;
+		Index_count = 1;
+		Index_level = LOW;		// still in the pulse that started the capture
+	}
+	for (; p <= pend; n++) {
+		if (!wait_for_data (start, CAPTURE_TIMEOUT, n))
 			break;	// timed out
 		curr = cycle_count ();
-		*s = sample_cvt(curr,prev);
+		p = pack_put (p, sample_cvt(curr,prev));
 		prev = curr;
 	}
 	Last_capture = cycle_count()-start;
 	interrupts ();
-	return s - buf;
+	return n;
 }
 
 // return number of cpu cycles for one disk revolution, or zero if not spinning
@@ -177,12 +247,81 @@ spinning()
 	return cycle_count()-start;
 }
 
-void
-loop ()
+// read data pulses are coming in, so the head is loaded on a formatted track
+boolean
+head_reading ()
+{
+	uint32_t start = cycle_count ();
+	uint32_t pulses = 0;
+
+	while (pulses < READING_PULSES && wait_for_edge (READ_DATA, start, READING_WINDOW))
+		pulses++;
+	return pulses >= READING_PULSES;
+}
+
+// capture every track of the disk in the drive, keeping the head loaded throughout.
+// Both heads of a cylinder are read before stepping, so a double sided disk takes no more seeks.
+// Return false if a seek did not check out, leaving the head unloaded
+boolean
+capture_disk (uint32_t sides)
 {
 	uint32_t track;
+	uint32_t side;
 	uint32_t actual;
+	uint32_t steps;
+
+	if (!sa800_seek_track00 ()) {
+		Serial.printf ("Cannot find track 0\r\n");
+		return false;
+	}
+	sa800_head_load ();
+	while (!head_reading () && sa800_back_off ()) {	// may be an unformatted disk, but give it longer
+		sa800_head_unload ();
+		sa800_head_load ();
+	}
+	for (track = 0; track < SA800_NTRACKS; track++) {
+		for (side = 0; side < sides; side++) {
+			sa800_side_select (side);
+			if (side)
+				Serial.printf ("    " TRACK1_FMT " Capture...", track, side);
+			else
+				Serial.printf ("    " TRACK_FMT " Capture...", track);
+			actual = capture (Packed, PACKED_SIZE);
+			Serial.printf(" Took %u cycles (%u/us), %u index... ",Last_capture,Last_capture/One_us,Index_count);
+			Serial.printf ("Save %u samples...", actual);
+			if (save_data (Disk, track, side, Packed, actual))
+				Serial.printf ("OK\r\n");
+			else
+				Serial.printf ("FAILED\r\n");
+		}
+		if (track + 1 == SA800_NTRACKS)
+			break;
+		sa800_step_in ();
+		if (sa800_track00 ()) {		// still there: the step was lost
+			sa800_head_unload ();
+			Serial.printf ("Seek error: still on track 0\r\n");
+			return false;
+		}
+		sa800_settle ();
+	}
+	sa800_side_select (0);
+	sa800_head_unload ();
+
+	// stepping back out checks that no steps were lost on the way in (or out)
+	steps = sa800_steps_to_track00 ();
+	if (steps != SA800_NTRACKS - 1) {
+		Serial.printf ("Seek error: %u steps back to track 0, expected %u\r\n", steps, SA800_NTRACKS - 1);
+		return false;
+	}
+	return true;
+}
+
+void
+loop ()
+{
+	uint32_t sides;
 	uint32_t one_rev;
+	uint32_t took;
 
 	sa800_drive_select ();
 	if (!sa800_drive_ready ()) {
@@ -201,24 +340,19 @@ loop ()
 		}
 	Serial.printf("Ready. Spinning at %u us/rev\r\n",one_rev/One_us);	// expecting roughly SA800_ONE_REV
 
+	sides = sa800_two_sided () ? SA800_NSIDES : 1;
 	Disk = next_disk_slot (Disk);	// find and create next directory to save captures
-	Serial.printf ("Capture to " DISK_FMT "\r\n", Disk);
+	Serial.printf ("Capture %u side(s) to " DISK_FMT "\r\n", sides, Disk);
 
-	sa800_seek_track00 ();
-	sa800_head_load ();
-	for (track = 0; track < SA800_NTRACKS; track++) {
-		Serial.printf ("    " TRACK_FMT " Capture...", track);
-		actual = capture (Samples, SAMPLE_SIZE);
-		Serial.printf(" Took %u cycles (%u/us)... ",Last_capture,Last_capture/One_us);
-		Serial.printf ("Save %u samples...", actual);
-		if (save_data (Disk, track, Samples, actual))
-			Serial.printf ("OK\r\n");
-		else
-			Serial.printf ("FAILED\r\n");
-		sa800_step_in ();
+	took = millis ();
+	while (!capture_disk (sides)) {
+		if (!sa800_back_off ()) {
+			Serial.printf ("Seek errors at the slowest timing too, tracks may be misplaced\r\n");
+			break;
+		}
+		Serial.printf ("Capture " DISK_FMT " again\r\n", Disk);
 	}
-	sa800_head_unload ();
-	sa800_seek_track00 ();
+	Serial.printf ("Disk took %u ms\r\n", millis () - took);
 
 	// wait for user to remove disk
 	while (sa800_drive_ready ()) {
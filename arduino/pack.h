@@ -0,0 +1,72 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+//	pack --- compact sample encoding, shared by the capture device and the host
+//
+// Samples are packed into a variable number of bytes, most of them one:
+//	0x00-0xDF		a sample of 0 to PACK_SHORT-1
+//	0xE0-0xFE, low byte	a sample of PACK_SHORT to PACK_LONG-1: PACK_SHORT plus the first
+//				byte's low 5 bits times 256 plus the low byte
+//	0xFF, 4 bytes		any 32 bit sample, little endian
+// At a 600:4 capture clock the 2, 3, 4 and 5us cells are about 75, 112, 150 and 187, so a
+// capture takes about a byte a pulse, and long gaps are kept whole rather than clamped.
+// Plain C with no dependencies, so the capture device and the host use the same code.
+
+#define	PACK_SHORT	0xE0				// samples below this take 1 byte
+#define	PACK_ESCAPE	0xFF				// a full 32 bit sample follows
+#define	PACK_LONG	(PACK_SHORT+((PACK_ESCAPE-PACK_SHORT)<<8))	// samples below this take 2 bytes
+#define	PACK_MAX	5				// most bytes one sample takes
+
+// Append sample 'v' at 'p', return where the next one goes
+static inline uint8_t *
+pack_put(uint8_t *p, const uint32_t v)
+{
+	if( v<PACK_SHORT )
+		*p++ = v;
+	else if( v<PACK_LONG ){
+		*p++ = PACK_SHORT + ((v-PACK_SHORT)>>8);
+		*p++ = (v-PACK_SHORT) & 0xFF;
+		}
+	else{
+		*p++ = PACK_ESCAPE;
+		*p++ = v;
+		*p++ = v>>8;
+		*p++ = v>>16;
+		*p++ = v>>24;
+		}
+	return p;
+}
+
+// Bytes sample 'v' packs into
+static inline unsigned int
+pack_size(const uint32_t v)
+{
+	return (v<PACK_SHORT) ? 1 : (v<PACK_LONG) ? 2 : PACK_MAX;
+}
+
+// Read the sample at 'p' into '*v', return where the next one starts.
+// NULL if it runs past 'end'
+static inline const uint8_t *
+pack_get(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+	if( p>=end )
+		return (const uint8_t *)0;
+	if( *p<PACK_SHORT ){
+		*v = *p;
+		return p+1;
+		}
+	if( *p<PACK_ESCAPE ){
+		if( end-p<2 )
+			return (const uint8_t *)0;
+		*v = PACK_SHORT + ((uint32_t)(p[0]-PACK_SHORT)<<8) + p[1];
+		return p+2;
+		}
+	if( end-p<PACK_MAX )
+		return (const uint8_t *)0;
+	*v = p[1] | (p[2]<<8) | ((uint32_t)p[3]<<16) | ((uint32_t)p[4]<<24);
+	return p+PACK_MAX;
+}
+
+#endif
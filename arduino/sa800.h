@@ -10,11 +10,15 @@
 #define READ_DATA	16	// 46 - Read Data       (Status)
 #define TRACK_00	15	// 42 - Track 00        (Status)
 #define INDEX		14	// 20 - Index           (Status)
+// and two more on a double sided drive (SA-850); unconnected, the drive reads as single sided
+#define SIDE_SELECT	22	// 14 - Side Select     (Control)
+#define TWO_SIDED	23	// 10 - Two Sided       (Status)
 
 // SA800 parameters
 #define SA800_RPM	360	// disk rotatation speed in revolutions/minute
 #define	SA800_ONE_REV	166667	// one revolution in us
 #define SA800_NTRACKS	77	// total tracks, numbered 0-76
+#define SA800_NSIDES	2	// heads on a double sided drive, numbered 0-1
 
 #define STEP_IN		LOW	// direction to step in
 #define STEP_OUT	HIGH	// direction to step out
@@ -24,8 +28,26 @@
 #define DRIVE_SELECT_DELAY	100
 #define HEAD_LOAD_DELAY	700	// spec doesn't say how long this should be?
 #define STEP_DELAY	25	// spec says 8ms min
+#define SETTLE_DELAY	0	// STEP_DELAY leaves time enough for the head to settle
 #define STEP_PULSE	1	// spec says 1us
 #define STEP_SETTLE	1	// spec says 12us from step to track00 valid
+#define SIDE_DELAY	1	// spec says 100us from side select to read data valid
+
+// With FAST_TIMING the step, settle and head load delays start at the minimums below and
+// are raised by sa800_back_off() only when a seek or head load does not check out, doubling
+// up to the conservative values above
+#ifndef FAST_TIMING
+#define FAST_TIMING	1
+#endif
+#define HEAD_LOAD_MIN	50	// head down and reading, checked by sa800_reading()
+#define STEP_MIN	8	// spec says 8ms min
+#define SETTLE_MIN	8	// spec says 8ms from the last step to read data valid
+
+// delays in use (in ms)
+static uint32_t Head_load_delay = FAST_TIMING ? HEAD_LOAD_MIN : HEAD_LOAD_DELAY;
+static uint32_t Step_delay = FAST_TIMING ? STEP_MIN : STEP_DELAY;
+static uint32_t Settle_delay = FAST_TIMING ? SETTLE_MIN : SETTLE_DELAY;
+static boolean Head_loaded = false;
 
 // Set Control pin to level, with optional delay
 // All inputs to the SA-800 have +5V pullups so to set HIGH, set pinMode() as an input with no pullup
@@ -55,16 +77,28 @@ sa800_drive_unselect ()
 	set_pin_delay (DRIVE_SELECT, HIGH, DRIVE_SELECT_DELAY);
 }
 
+// the head stays loaded for the whole disk, so this is paid once per disk
 static inline void
 sa800_head_load ()
 {
-	set_pin_delay (HEAD_LOAD, LOW, HEAD_LOAD_DELAY);
+	set_pin_delay (HEAD_LOAD, LOW, Head_load_delay);
+	Head_loaded = true;
 }
 
 static inline void
 sa800_head_unload ()
 {
-	set_pin_delay (HEAD_LOAD, HIGH, HEAD_LOAD_DELAY);
+	if (!Head_loaded)
+		return;
+	set_pin_delay (HEAD_LOAD, HIGH, Head_load_delay);
+	Head_loaded = false;
+}
+
+// select the head to read.  Side 0 is the lower head, side 1 is selected by a LOW level
+static inline void
+sa800_side_select (const uint32_t side)
+{
+	set_pin_delay (SIDE_SELECT, side ? LOW : HIGH, SIDE_DELAY);
 }
 
 static inline void
@@ -72,7 +106,29 @@ sa800_step (const int dir)
 {
 	set_pin_delay (STEP_DIR, dir, 0);
 	set_pin_delay (STEP, LOW, STEP_PULSE);
-	set_pin_delay (STEP, HIGH, STEP_DELAY);
+	set_pin_delay (STEP, HIGH, Step_delay);
+}
+
+// wait for the head to settle after the last step of a seek, before reading
+static inline void
+sa800_settle ()
+{
+	if (Settle_delay)
+		delay (Settle_delay);
+}
+
+// raise the delays after a seek or head load error.  False if they are already at the
+// conservative values, so there is nothing left to try
+static inline boolean
+sa800_back_off ()
+{
+	if (Step_delay >= STEP_DELAY && Head_load_delay >= HEAD_LOAD_DELAY)
+		return false;
+	Step_delay = (2 * Step_delay < STEP_DELAY) ? 2 * Step_delay : STEP_DELAY;
+	Settle_delay = (2 * Settle_delay < STEP_DELAY) ? 2 * Settle_delay : STEP_DELAY;
+	Head_load_delay = (2 * Head_load_delay < HEAD_LOAD_DELAY) ? 2 * Head_load_delay : HEAD_LOAD_DELAY;
+	Serial.printf ("Backing off: step %u ms, settle %u ms, head load %u ms\r\n", Step_delay, Settle_delay, Head_load_delay);
+	return true;
 }
 
 static inline void
@@ -112,6 +168,25 @@ sa800_read_data ()
 	return digitalReadFast (READ_DATA) == LOW;
 }
 
+// the disk in the drive is double sided
+static inline boolean
+sa800_two_sided ()
+{
+	return digitalReadFast (TWO_SIDED) == LOW;
+}
+
+// step out until TRACK_00 is asserted, returning the steps taken (more than SA800_NTRACKS
+// if it never is).  From the last track that should be SA800_NTRACKS-1, or steps were lost
+static inline uint32_t
+sa800_steps_to_track00 ()
+{
+	uint32_t i;
+
+	for (i = 0; i <= SA800_NTRACKS + EXTRA && !sa800_track00 (); i++)
+		sa800_step_out ();
+	return i;
+}
+
 // move to the outermost track
 static inline boolean
 sa800_seek_track00 ()
@@ -149,15 +224,17 @@ sa800_seek_track00 ()
 static inline void
 sa800_status(const char *tag)
 {
-	Serial.printf("\r\nDriveSelect:%d HeadLoad:%d StepDir:%d Step:%d | Index:%d Ready:%d Track00:%d ReadData:%d  %s",
+	Serial.printf("\r\nDriveSelect:%d HeadLoad:%d StepDir:%d Step:%d SideSelect:%d | Index:%d Ready:%d Track00:%d ReadData:%d TwoSided:%d  %s",
 		digitalReadFast(DRIVE_SELECT),
 		digitalReadFast(HEAD_LOAD),
 		digitalReadFast(STEP_DIR),
 		digitalReadFast(STEP),
+		digitalReadFast(SIDE_SELECT),
 		sa800_index(),
 		sa800_drive_ready(),
 		sa800_track00(),
 		sa800_read_data(),
+		sa800_two_sided(),
 		tag);
 }
 
@@ -174,12 +251,14 @@ sa800_debug()
 	case 'S':	Serial.printf("Select");	sa800_drive_select();	break;
 	case 'h':	Serial.printf("Unload");	sa800_head_unload();	break;
 	case 'H':	Serial.printf("Load");		sa800_head_load();	break;
+	case 'u':	Serial.printf("Side0");		sa800_side_select(0);	break;
+	case 'U':	Serial.printf("Side1");		sa800_side_select(1);	break;
 	case '\r':
 	case '\n':
 	case ' ':
 		break;
         default:
-                Serial.printf("Expected 0 + - s S h H");
+                Serial.printf("Expected 0 + - s S h H u U");
                 break;
         }
 	sa800_status("");
@@ -192,8 +271,10 @@ sa800_init ()
 	set_pin_delay(HEAD_LOAD,HIGH,0);
 	set_pin_delay(STEP_DIR,HIGH,0);
 	set_pin_delay(STEP,HIGH,0);
+	set_pin_delay(SIDE_SELECT,HIGH,0);
 	pinMode (INDEX, INPUT_PULLUP);
 	pinMode (READY, INPUT_PULLUP);
 	pinMode (TRACK_00, INPUT_PULLUP);
 	pinMode (READ_DATA, INPUT_PULLUP);
+	pinMode (TWO_SIDED, INPUT_PULLUP);
 }
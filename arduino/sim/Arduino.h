@@ -0,0 +1,60 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+//	Arduino --- just enough of the Teensy core to run floppy8.ino on Linux
+//
+// Time is simulated: every pin read and cycle count costs a few cpu cycles, delay() moves
+// the clock on, and the pins are those of the simulated SA-800 in sim.cpp.
+
+#define	FLOPPY8_SIM	1
+
+#define	LOW		0
+#define	HIGH		1
+#define	INPUT		0
+#define	OUTPUT		1
+#define	INPUT_PULLUP	2
+
+typedef bool boolean;
+
+uint32_t	sim_cycles();
+int		digitalReadFast(int pin);
+void		digitalWrite(int pin, int level);
+void		pinMode(int pin, int mode);
+void		delay(uint32_t ms);
+uint32_t	millis();
+
+static inline void
+noInterrupts()
+{
+}
+
+static inline void
+interrupts()
+{
+}
+
+class SimSerial {
+public:
+	void	begin(unsigned long baud) { (void)baud; }
+	int	available() { return 0; }
+	int	read() { return -1; }
+	void	print(const char *s) { fputs(s,stdout); }
+	void	printf(const char *fmt, ...) __attribute__((format(printf,2,3)))
+	{
+		va_list ap;
+
+		va_start(ap,fmt);
+		vprintf(fmt,ap);
+		va_end(ap);
+	}
+	operator bool() { return true; }
+};
+
+extern SimSerial Serial;
+
+#endif
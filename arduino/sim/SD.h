@@ -0,0 +1,64 @@
+#ifndef SD_H
+#define SD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+
+//	SD --- the SD card library, as a directory on the host
+//
+// Paths on the card are taken relative to the directory given to the simulator.  Only what
+// floppy8.ino and fat.h use is here, and a File lists no directory entries.
+
+#define	FILE_WRITE_BEGIN	1
+#define	BUILTIN_SDCARD		254
+#define	SPI_HALF_SPEED		1
+#define	SD_CARD_TYPE_SD1	1
+#define	SD_CARD_TYPE_SD2	2
+#define	SD_CARD_TYPE_SDHC	3
+
+typedef struct {
+	int	year,mon,mday,hour,min;
+} DateTimeFields;
+
+class File {
+public:
+	File(FILE *fp = NULL) : fp(fp) {}
+	size_t	write(const void *buf, size_t len) { return fp ? fwrite(buf,1,len,fp) : 0; }
+	void	close() { if( fp ) fclose(fp); fp = NULL; }
+	File	openNextFile() { return File(); }
+	bool	isDirectory() { return false; }
+	const char *name() { return ""; }
+	bool	getModifyTime(DateTimeFields &tm) { (void)tm; return false; }
+	unsigned long long size() { return 0; }
+	operator bool() { return fp!=NULL; }
+private:
+	FILE	*fp;
+};
+
+class SDClass {
+public:
+	std::string root;
+	File	open(const char *path, int mode = 0);
+	bool	exists(const char *path);
+	bool	mkdir(const char *path);
+	bool	remove(const char *path);
+};
+
+extern SDClass SD;
+
+class Sd2Card {
+public:
+	bool	init(int speed, int cs) { (void)speed; (void)cs; return true; }
+	int	type() { return SD_CARD_TYPE_SDHC; }
+};
+
+class SdVolume {
+public:
+	bool	init(Sd2Card &card) { (void)card; return true; }
+	int	fatType() { return 32; }
+	uint32_t blocksPerCluster() { return 64; }
+	uint32_t clusterCount() { return 1000000; }
+};
+
+#endif
@@ -0,0 +1 @@
+// nothing of SPI is needed, the simulated SD card is a directory (see SD.h)
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "../floppy8.ino"
+
+extern "C" {
+#include "../../floppy8.h"
+}
+
+//	sim --- run the capture firmware on Linux against a simulated SA-800
+//
+// floppy8.ino is built unchanged into this file, with sim/Arduino.h and sim/SD.h standing in
+// for the Teensy core and SD card.  Time is a count of simulated cpu cycles.  The drive turns
+// at SA800_RPM with a freshly made track (floppy8_synth) under each head, its index pulse at
+// the start of the revolution.  It misses steps that come too close together, and gives no
+// read data until the head has loaded and settled, so the firmware's timing and its checks
+// can be tried against a drive slower than the spec.  One disk is captured into DIR/DiskNNN,
+// then the simulated operator takes it out and the run ends with the time it took.
+//
+// While read data is idle a pin read moves the clock straight on to the next pulse or index
+// edge, so a capture costs a few reads per pulse rather than one per few cycles.
+
+#define	NTRACKS		FLOPPY8_NTRACKS
+#define	NSIDES		FLOPPY8_NSIDES
+#define	NPINS		64
+
+#define	SIM_READ	8			// cpu cycles a pin read or cycle count takes
+#define	SIM_REV		((uint64_t)SA800_ONE_REV*ONE_US)	// cycles in one revolution
+#define	SIM_INDEX	(400*ONE_US)		// index pulse
+#define	SIM_PULSE	(200*ONE_US/1000)	// read data pulse
+#define	SIM_MS		((uint64_t)1000*ONE_US)	// cycles in one ms
+#define	SIM_CYLINDERS	(SA800_NTRACKS+3)	// the head stops past the last track
+
+// a track as the head sees it: when each pulse starts, in cycles from the index
+typedef struct track {
+	uint32_t	*at;
+	unsigned int	n;
+	bool		made;
+} track_t;
+
+typedef struct drive {
+	uint64_t	now;			// cpu cycles since power on
+	int		mode[NPINS];		// control pins as the firmware set them
+	int		level[NPINS];
+	unsigned int	cylinder;
+	uint64_t	stepped;		// when the head last moved
+	uint64_t	loaded;			// when the head was loaded
+	bool		load;			// head loaded
+	bool		inserted;
+	bool		used;			// the head has been loaded on this disk
+	bool		done;			// the disk has been taken out
+
+	// how the drive behaves
+	uint64_t	step;			// fewest cycles between steps, closer ones are missed
+	uint64_t	settle;			// cycles from a step to read data
+	uint64_t	head;			// cycles from head load to read data
+	unsigned int	sides;
+	int		format;
+	double		jitter;
+
+	unsigned int	steps,lost;
+	uint64_t	inserted_at;
+	track_t		track[SIM_CYLINDERS][NSIDES];
+} drive_t;
+
+drive_t		Drive;
+SimSerial	Serial;
+SDClass		SD;
+
+// level of a control pin: driven low as an output, pulled up otherwise
+static inline int
+pin_level(const int pin)
+{
+	return (Drive.mode[pin]==OUTPUT) ? Drive.level[pin] : HIGH;
+}
+
+// the drive acts on a control pin changing
+static inline void
+pin_changed(const int pin, const int was)
+{
+	drive_t *d = &Drive;
+	int now = pin_level(pin);
+
+	if( now==was )
+		return;
+	switch(pin){
+	case STEP:	// the head moves on the trailing edge of the step pulse
+		if( now!=HIGH )
+			break;
+		if( d->steps && d->now-d->stepped<d->step ){
+			d->lost++;
+			break;
+			}
+		d->steps++;
+		d->stepped = d->now;
+		if( pin_level(STEP_DIR)==STEP_IN && d->cylinder+1<SIM_CYLINDERS )
+			d->cylinder++;
+		else if( pin_level(STEP_DIR)==STEP_OUT && d->cylinder>0 )
+			d->cylinder--;
+		break;
+	case HEAD_LOAD:
+		d->load = (now==LOW);
+		d->loaded = d->now;
+		if( d->load )
+			d->used = true;
+		break;
+	}
+}
+
+void
+pinMode(int pin, int mode)
+{
+	int was = pin_level(pin);
+
+	Drive.mode[pin] = mode;
+	pin_changed(pin,was);
+}
+
+void
+digitalWrite(int pin, int level)
+{
+	int was = pin_level(pin);
+
+	Drive.level[pin] = level;
+	pin_changed(pin,was);
+}
+
+// pulses of the track under the head, made the first time it is read
+static inline const track_t *
+track_under(const unsigned int cylinder, const unsigned int side)
+{
+	static sample_t samples[FLOPPY8_MAX_SAMPLES];
+	track_t *t = &Drive.track[cylinder][side];
+	floppy8_synth_t s;
+	floppy8_capture_t cap;
+	unsigned int i,n;
+	uint64_t at = 0;
+
+	if( t->made )
+		return t;
+	t->made = true;
+	if( cylinder>=SA800_NTRACKS || side>=Drive.sides )
+		return t;	// nothing recorded there
+	memset(&s,0,sizeof(s));
+	s.format = Drive.format;
+	s.track  = cylinder;
+	s.side   = side;
+	s.spt    = (s.format==FLOPPY8_M2FM) ? 52 : 26;
+	s.size   = (s.format==FLOPPY8_MFM) ? 1 : 0;
+	s.clock  = ONE_US;
+	s.shift  = 0;
+	s.revolutions = 1;
+	s.jitter = Drive.jitter;
+	s.seed   = 1;
+	n = floppy8_synth(&s,NULL,samples,FLOPPY8_MAX_SAMPLES,&cap);
+	t->at = (uint32_t *)malloc(sizeof(uint32_t)*(n+1));
+	if( t->at==NULL )
+		return t;
+	for(i=0;i<n && (at+=samples[i])<SIM_REV;i++)
+		t->at[i] = at;
+	t->n = i;
+	return t;
+}
+
+// read data: a short low pulse for each flux reversal under a loaded, settled head
+static inline int
+read_data()
+{
+	drive_t *d = &Drive;
+	const track_t *t;
+	uint64_t phase,next;
+	unsigned int lo,hi,mid;
+
+	if( !d->inserted || !d->load || d->now-d->loaded<d->head || d->now-d->stepped<d->settle )
+		return HIGH;
+	t = track_under(d->cylinder,pin_level(SIDE_SELECT)==LOW);
+	if( t->n==0 )
+		return HIGH;
+	phase = d->now % SIM_REV;
+	for(lo=0,hi=t->n;lo<hi;){	// first pulse starting after 'phase'
+		mid = (lo+hi)/2;
+		if( t->at[mid]<=phase )
+			lo = mid+1;
+		else
+			hi = mid;
+		}
+	if( lo>0 && phase-t->at[lo-1]<SIM_PULSE )
+		return LOW;
+
+	// idle until just before the next pulse, but stop at an index edge so it is seen
+	next = (lo<t->n) ? t->at[lo] : SIM_REV+t->at[0];
+	if( phase<SIM_INDEX && next>SIM_INDEX )
+		next = SIM_INDEX;
+	if( next>SIM_REV )
+		next = SIM_REV;
+	if( next-phase>SIM_READ )
+		d->now += next-phase-SIM_READ;
+	return HIGH;
+}
+
+int
+digitalReadFast(int pin)
+{
+	drive_t *d = &Drive;
+
+	d->now += SIM_READ;
+	switch(pin){
+	case INDEX:
+		return (d->inserted && d->now%SIM_REV<SIM_INDEX) ? LOW : HIGH;
+	case READY:
+		return d->inserted ? LOW : HIGH;
+	case TRACK_00:
+		return (d->cylinder==0) ? LOW : HIGH;
+	case TWO_SIDED:
+		return (d->inserted && d->sides==2) ? LOW : HIGH;
+	case READ_DATA:
+		return read_data();
+	}
+	return pin_level(pin);
+}
+
+uint32_t
+sim_cycles()
+{
+	Drive.now += SIM_READ;
+	return (uint32_t)Drive.now;
+}
+
+uint32_t
+millis()
+{
+	return Drive.now/SIM_MS;
+}
+
+// the operator takes the disk out once the drive has finished with it
+void
+delay(uint32_t ms)
+{
+	drive_t *d = &Drive;
+
+	d->now += ms*SIM_MS;
+	if( ms>=USER_DELAY && d->inserted && d->used && !d->load ){
+		d->inserted = false;
+		d->done = true;
+		}
+}
+
+static inline std::string
+sd_path(const char *path)
+{
+	return SD.root + path;
+}
+
+File
+SDClass::open(const char *path, int mode)
+{
+	return File(fopen(sd_path(path).c_str(),(mode==FILE_WRITE_BEGIN) ? "w" : "r"));
+}
+
+bool
+SDClass::exists(const char *path)
+{
+	return access(sd_path(path).c_str(),F_OK)==0;
+}
+
+bool
+SDClass::mkdir(const char *path)
+{
+	return ::mkdir(sd_path(path).c_str(),0777)==0;
+}
+
+bool
+SDClass::remove(const char *path)
+{
+	return unlink(sd_path(path).c_str())==0;
+}
+
+static inline void
+usage()
+{
+	printf("Usage: floppy8_sim [--mfm|--m2fm] [--sides N] [--step MS] [--settle MS] [--head MS] [--jitter NS] DIR\n");
+	printf("  --mfm         MFM tracks (default FM), --m2fm for M2FM\n");
+	printf("  --sides N     1 or 2 sided disk (default 1)\n");
+	printf("  --step MS     the drive misses steps closer together than this (default 8)\n");
+	printf("  --settle MS   read data from this long after a step (default 8)\n");
+	printf("  --head MS     read data from this long after the head loads (default 35)\n");
+	printf("  --jitter NS   pulse timing noise (default 50)\n");
+	printf("  DIR           the SD card, captures go into DIR/DiskNNN\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	drive_t *d = &Drive;
+	double step = 8.0, settle = 8.0, head = 35.0;
+	char *arg;
+
+	d->format = FLOPPY8_FM;
+	d->sides  = 1;
+	d->jitter = 50.0;
+	while(--argc){
+		arg = *++argv;
+		if( strcmp(arg,"--mfm")==0 )
+			d->format = FLOPPY8_MFM;
+		else if( strcmp(arg,"--m2fm")==0 )
+			d->format = FLOPPY8_M2FM;
+		else if( argc>=2 && strcmp(arg,"--sides")==0 ){
+			if( sscanf(argv[1],"%u",&d->sides)!=1 || d->sides<1 || d->sides>NSIDES )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( argc>=2 && strcmp(arg,"--step")==0 ){
+			if( sscanf(argv[1],"%lf",&step)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( argc>=2 && strcmp(arg,"--settle")==0 ){
+			if( sscanf(argv[1],"%lf",&settle)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( argc>=2 && strcmp(arg,"--head")==0 ){
+			if( sscanf(argv[1],"%lf",&head)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( argc>=2 && strcmp(arg,"--jitter")==0 ){
+			if( sscanf(argv[1],"%lf",&d->jitter)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( arg[0]=='-' || !SD.root.empty() )
+			usage();
+		else
+			SD.root = arg;
+		}
+	if( SD.root.empty() )
+		usage();
+	d->step   = (uint64_t)(step*SIM_MS);
+	d->settle = (uint64_t)(settle*SIM_MS);
+	d->head   = (uint64_t)(head*SIM_MS);
+	d->cylinder = 40;		// wherever the last user left it
+	d->inserted = true;
+
+	setup();
+	d->inserted_at = d->now;
+	while( !d->done )
+		loop();
+	printf("# Simulated %.3f s from setup to the disk coming out, %u steps, %u missed\n",
+		(double)(d->now-d->inserted_at)/SIM_MS/1000,d->steps,d->lost);
+	return 0;
+}
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "floppy8.h"
+#include "cpm.h"
+
+//	cpm --- extract files from a CP/M volume, decoding only the tracks that hold them
+//
+// The standard 8" single density CP/M disk is IBM 3740 format: 77 tracks of 26 128-byte sectors.
+// The first 2 tracks hold the boot loader and system, the directory starts at track 2.
+// Allocation blocks are 1K, so an 8-bit block number is enough and each directory
+// entry (extent) holds 16 of them.  Logical sectors are skewed by 6 on the disk.
+
+typedef struct dpb {
+	unsigned int	spt;		// sectors per track
+	unsigned int	ssize;		// sector size
+	unsigned int	bls;		// allocation block size
+	unsigned int	dsm;		// highest block number
+	unsigned int	drm;		// highest directory entry
+	unsigned int	off;		// reserved (system) tracks
+	const uint8_t	*skew;		// logical to physical sector
+} dpb_t;
+
+static const uint8_t Skew_3740[26] = {
+	1,7,13,19,25,5,11,17,23,3,9,15,21,2,8,14,20,26,6,12,18,24,4,10,16,22
+};
+
+static const dpb_t Dpb_3740 = { 26, 128, 1024, 242, 63, 2, Skew_3740 };
+
+#define	DIR_SIZE	32	// bytes per directory entry
+#define	DIR_UNUSED	0xE5	// user number of an unused entry
+#define	DIR_BLOCKS	16	// block numbers per entry
+#define	RECORD		128	// CP/M record size
+#define	EXTENT_RECS	128	// records per 16K extent
+
+// one directory entry
+typedef struct dirent {
+	uint8_t		user;
+	char		name[13];	// NAME.EXT
+	unsigned int	extent;		// extent number
+	unsigned int	records;	// records used in this extent
+	uint8_t		blocks[DIR_BLOCKS];
+} dirent_t;
+
+typedef struct cpm {
+	floppy8_t	*f;
+	const dpb_t	*dpb;
+	cpm_load_t	load;
+	void		*arg;
+	bool		loaded[FLOPPY8_NTRACKS];
+	bool		failed[FLOPPY8_NTRACKS];
+} cpm_t;
+
+// make sure a track has been decoded
+static inline void
+cpm_track(cpm_t *c, const unsigned int track)
+{
+	if( track>=FLOPPY8_NTRACKS || c->loaded[track] || c->failed[track] )
+		return;
+	if( c->load(c->arg,track) )
+		c->loaded[track] = true;
+	else{
+		printf("# ERROR: Track %u not available\n",track);
+		c->failed[track] = true;
+		}
+}
+
+// read one 128-byte record, counting from the start of the data area.  Return false if missing
+static inline bool
+cpm_record(cpm_t *c, const unsigned int record, uint8_t *buf)
+{
+	const dpb_t *d = c->dpb;
+	unsigned int per_sector = d->ssize/RECORD;
+	unsigned int logical = record/per_sector;
+	unsigned int track = d->off + logical/d->spt;
+	unsigned int sector = d->skew[logical%d->spt];
+	const floppy8_sector_t *s;
+
+	cpm_track(c,track);
+	s = floppy8_sector(c->f,track,0,sector);
+	if( s==NULL || s->data==NULL || s->size!=d->ssize ){
+		memset(buf,DIR_UNUSED,RECORD);
+		return false;
+		}
+	memcpy(buf,&s->data[(record%per_sector)*RECORD],RECORD);
+	return true;
+}
+
+// decode a raw directory entry, return false if unused or implausible
+static inline bool
+cpm_dirent(const cpm_t *c, const uint8_t *raw, dirent_t *e)
+{
+	unsigned int i,j;
+	char ch;
+
+	if( raw[0]==DIR_UNUSED || raw[0]>15 )
+		return false;
+	e->user = raw[0];
+	j = 0;
+	for(i=1;i<12;i++){
+		if( i==9 )
+			e->name[j++] = '.';
+		ch = raw[i] & 0x7F;		// high bits are attributes
+		if( ch==' ' )
+			continue;
+		e->name[j++] = (isprint((unsigned char)ch) && ch!='/') ? ch : '_';
+		}
+	if( j>0 && e->name[j-1]=='.' )
+		j--;
+	e->name[j] = '\0';
+	if( e->name[0]=='\0' || e->name[0]=='.' )
+		return false;
+	e->extent  = (raw[12] & 0x1F) + 32*(raw[14] & 0x3F);
+	e->records = (raw[15] <= EXTENT_RECS) ? raw[15] : EXTENT_RECS;
+	memcpy(e->blocks,&raw[16],DIR_BLOCKS);
+	for(i=0;i<DIR_BLOCKS;i++)
+		if( e->blocks[i] > c->dpb->dsm )
+			return false;
+	return true;
+}
+
+static int
+dirent_cmp(const void *a, const void *b)
+{
+	const dirent_t *x = (const dirent_t *)a;
+	const dirent_t *y = (const dirent_t *)b;
+	int r;
+
+	if( x->user != y->user )
+		return x->user - y->user;
+	r = strcmp(x->name,y->name);
+	if( r )
+		return r;
+	return (int)x->extent - (int)y->extent;
+}
+
+// write one file made of entries e[0..n-1], all extents of the same file in order
+static inline void
+cpm_file(cpm_t *c, const dirent_t *e, const unsigned int n, const char *dir)
+{
+	const dpb_t *d = c->dpb;
+	unsigned int recs_per_block = d->bls/RECORD;
+	unsigned int i,r,records,missing = 0,total = 0;
+	uint8_t buf[RECORD];
+	char path[FILENAME_MAX];
+	FILE *fp;
+
+	if( e->user )
+		snprintf(path,sizeof(path),"%s/%u_%s",dir,e->user,e->name);
+	else
+		snprintf(path,sizeof(path),"%s/%s",dir,e->name);
+	fp = fopen(path,"wb");
+	if( fp==NULL ){
+		printf("# ERROR: cannot create %s\n",path);
+		return;
+		}
+	for(i=0;i<n;i++){
+		// all but the last extent are full
+		records = (i+1<n) ? EXTENT_RECS : e[i].records;
+		for(r=0;r<records;r++){
+			if( e[i].blocks[r/recs_per_block]==0 )
+				break;	// sparse, or RC is lying
+			if( !cpm_record(c,e[i].blocks[r/recs_per_block]*recs_per_block + r%recs_per_block,buf) )
+				missing++;
+			fwrite(buf,RECORD,1,fp);
+			total++;
+			}
+		}
+	fclose(fp);
+	printf("# File: %-16s %6u bytes",path,total*RECORD);
+	if( missing )
+		printf(" MISSING %u records",missing);
+	printf("\n");
+}
+
+// Decode the directory tracks, then only the tracks holding allocated blocks, and write
+// every file into 'dir'.  Return the number of files written, or a negative error
+int
+cpm_extract(floppy8_t *f, cpm_load_t load, void *arg, const char *dir)
+{
+	cpm_t c;
+	const dpb_t *d = &Dpb_3740;
+	unsigned int dir_records = ((d->drm+1)*DIR_SIZE)/RECORD;
+	unsigned int nent = 0, files = 0, missing = 0;
+	unsigned int i,j,r;
+	uint8_t buf[RECORD];
+	dirent_t *ents;
+
+	memset(&c,0,sizeof(c));
+	c.f    = f;
+	c.dpb  = d;
+	c.load = load;
+	c.arg  = arg;
+
+	ents = (dirent_t *)malloc(sizeof(dirent_t)*(d->drm+1));
+	if( ents==NULL )
+		return FLOPPY8_ENOMEM;
+	for(r=0;r<dir_records;r++){
+		if( !cpm_record(&c,r,buf) )
+			missing++;
+		for(i=0;i<RECORD;i+=DIR_SIZE)
+			if( cpm_dirent(&c,&buf[i],&ents[nent]) )
+				nent++;
+		}
+	if( missing )
+		printf("# ERROR: %u directory records missing\n",missing);
+	qsort(ents,nent,sizeof(dirent_t),dirent_cmp);
+
+	for(i=0;i<nent;i=j){
+		for(j=i+1;j<nent;j++)
+			if( ents[j].user!=ents[i].user || strcmp(ents[j].name,ents[i].name)!=0 )
+				break;
+		cpm_file(&c,&ents[i],j-i,dir);
+		files++;
+		}
+	for(i=0,r=0;i<FLOPPY8_NTRACKS;i++)
+		r += c.loaded[i];
+	printf("# %u files, decoded %u of %u tracks\n",files,r,FLOPPY8_NTRACKS);
+	free(ents);
+	return files;
+}
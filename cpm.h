@@ -0,0 +1,13 @@
+#ifndef CPM_H
+#define CPM_H
+
+#include "floppy8.h"
+
+//	cpm --- extract files from a CP/M volume, decoding only the tracks that hold them
+
+// decode one track into the context, return false if it is not available
+typedef bool (*cpm_load_t)(void *arg, unsigned int track);
+
+int	cpm_extract(floppy8_t *f, cpm_load_t load, void *arg, const char *dir);
+
+#endif
@@ -4,198 +4,56 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
-#include <libgen.h>
-
-//	ext --- extract sector data from floppy given timestamp files for each track
-
-// Data was collected from the floppy as pulses separated by 2-4us, with some variation.
-// FM data pulses are either 2us or 4us.  MFM data pulses arrive with deltas of 2, 3 or 4us.
-// On the disk, locations where the recording started or stopped may have very large or
-// very smal deltas.  Drive speed rotation may also affect the samples pulse width values.
-
-// The capture device (Teensy 4.1) runs at 600Mhz and samples are divided by 16 so 1 us equals 37.5 counts
-
-#define TWO_US		75
-#define ONE_US		(TWO_US/2)
-#define	THREE_US	(TWO_US+ONE_US)
-#define	FOUR_US		(TWO_US*2)
-#define	FIVE_US		((TWO_US*2)+ONE_US)
-
-#define	HALF_US		(ONE_US/2)
-#define	ONEP5_US	(ONE_US+HALF_US)
-#define	TWOP5_US	(TWO_US+HALF_US)
-#define	THREEP5_US	(THREE_US+HALF_US)
-#define	FOURP5_US	(FOUR_US+HALF_US)
-
-#define	FM_SPLIT	THREE_US	// FM has 2 ranges: 2 and 4 us
-#define	MFM_SPLIT_LO	TWOP5_US	// MFM has 3 ranges: 2, 3 and 4 us
-#define	MFM_SPLIT_HI	THREEP5_US
-
-#define  MAX_US    6		// samples are classified into 1us buckets.   +/- 0.5us
-
-// For FM disks, track layout is:
-//
-// Once at beginning of track:
-//      40      FF
-//      6       00
-//      1       FC      Index mark (clock D7)
-//      26      FF
-//
-// For each sector:
-//      6       00
-//      1       FE      Address ID Mark (clock C7)
-//      1       TT      Track (00-4C)
-//      1       SD      Side (00)
-//      1       ST      Sector (01-1A)
-//      1       SS      Sector Size (00=128, 01=256, 02=512, 03=1024)
-//      2       CRC
-//      11      FF
-//      6       00
-//      1       FB      Data Mark (Clock C7) (Or F8 if 'deleted data')
-//      ???     ??      Data
-//      2       CRC
-//      27      FF
+#include <pthread.h>
+#include <unistd.h>
+
+#include "floppy8.h"
+#include "cpm.h"
+#include "f8file.h"
+#include "flux.h"
+#include "serve.h"
+#include "store.h"
+#include "watch.h"
+
+//	extract --- extract sector data from floppy given timestamp files for each track
 //
-// Once at end of data:
-//      247     FF      count is approximate
+//	Front end for libfloppy8: loads TrackNN.raw captures (and TrackNN_1.raw, side 1 of a
+//	double sided disk), or a whole disk in a .f8 file, decodes them and shows the disk image
 
-// For MFM disks, track layout is:
-//
-// Once at beginning of track:
-//      80      4E
-//      12      00
-//      3       C2
-//      1       FC      Index Mark
-//      50      4E
-//
-// For each sector:
-//      12      00
-//      3       A1
-//      1       FE      Address ID Mark
-//      1       TT      Track (00-4C)
-//      1       SD      Side (00)
-//      1       ST      Sector (01-1A)
-//      1       SS      Sector Size (as above)
-//      2       CRC
-//      22      4E
-//      12      00
-//      3       A1
-//      1       FB      Data Mark (Or F8 if 'deleted data')
-//      ???     ??      Data
-//      2       CRC
-//      54      4E
-//
-// Once at end of data:
-//      598     4E      count is approximate
+#define	NTRACKS		FLOPPY8_NTRACKS
+#define	NSIDES		FLOPPY8_NSIDES
+#define NSECTORS	FLOPPY8_NSECTORS
+#define MAX_SAMPLES	FLOPPY8_MAX_SAMPLES
 
-// CRC bytes are 16-bits, polynomial is X**16 + X**12 + X**5 + 1.  CRC is calculated
-// so that Address/Data mark + data + CRC == 0x0000
+typedef floppy8_sector_t sector_t;
 
-#define	NTRACKS		77
-#define	NSIDES		1
-#define NSECTORS	33	// sectors range from 0 to NSECTORS-1
-#define NSIZES		4	// sector size is 128 << size
-#define MAX_SSIZE	1024	// sector size can be 128/256/512/1024
+// track file being decoded, passed to the sector callback
+typedef struct track_file {
+	const sample_t	*samples;
+	unsigned int	n;
+	unsigned int	sample;		// cursor for converting sample numbers to file offsets
+	unsigned long	byte;
+	FILE		*index;		// sidecar index, if being written
+} track_file_t;
 
 bool		Verbose = false;
 bool		Json_show = false;
-unsigned int	Last_track = NTRACKS;
-unsigned int	Last_side;
-unsigned int	Last_sector;
-unsigned int	Last_size;
-
-// Raw track data is classified into types before deltas are categorized
-#define TT_FM	1
-#define TT_MFM	2
-
-#define MAX_SAMPLES 200000
-typedef unsigned int sample_t;
-
-// Special FM marks
-uint8_t FM_indx_mark[] = { 1,1,1,0,1,1,0,1,1,1,0,0 };	// Data 0xFC,Clock 0xD7
-uint8_t FM_addr_mark[] = { 1,1,1,0,0,0,1,1,1,1,1,0 };	// Data 0xFE,Clock 0xC7
-uint8_t FM_data_mark[] = { 1,1,1,0,0,0,1,0,1,1,1,1 };	// Data 0xFB,Clock 0xC7
-uint8_t FM_deld_mark[] = { 1,1,1,0,0,0,1,0,0,0,1 };	// Data 0xF8,Clock 0xC7
-
-// Special MFM marks
-uint8_t MFM_indx_mark[] = { 0xC2, 0xC2, 0xC2, 0xFC };
-uint8_t MFM_addr_mark[] = { 0xA1, 0xA1, 0xA1, 0xFE };
-uint8_t MFM_data_mark[] = { 0xA1, 0xA1, 0xA1, 0xFB };
-uint8_t MFM_deld_mark[] = { 0xA1, 0xA1, 0xA1, 0xF8 };
-
-// Pad decode buffers by this much in case the sample buffer ends with a valid 'mark'
-// This MIGHT fail if the padded area happens to have a correct CRC
-#define	DECODE_PAD	(2*8*(MAX_SSIZE))
-
-typedef struct sector {
-	unsigned int size;
-	uint8_t	*data;
-} sector_t;
-sector_t Disk[NTRACKS][NSECTORS];
-
-static inline void
-fatal(const char *s)
-{
-	printf("# FATAL: %s\n",s);
-	exit(1);
-}
-
-static inline void
-error(const char *s)
-{
-	printf("# ERROR: %s\n",s);
-}
-
-// invalidate last known sector info
-static inline void
-sector_none()
-{
-	Last_track  = NTRACKS;
-	Last_sector = NSECTORS;
-	Last_side   = NSIDES;
-	Last_size   = 0;
-}
-
-static inline bool
-valid_size(const unsigned int size)
-{
-	unsigned int i;
-
-	for(i=0;i<NSIZES;i++){
-		if( size == (128u<<i) )
-			return true;
-		}
-	return false;
-}
-
-// add one sectors worth of data to the overall disk image
-static inline void
-disk_add(const unsigned int track, const unsigned int side, const unsigned int sector, const unsigned int size, const uint8_t *data)
-{
-	sector_t *s;
-
-	if(track>=NTRACKS || side>=NSIDES || sector>=NSECTORS || !valid_size(size) ){
-		printf("# ERROR: invalid params Track:%u Side:%u Sector:%u Size:%u\n",track,side,sector,size);
-		return;
-		}
-	if(data==NULL){
-		error("missing data");
-		return;
-		}
-	s = &Disk[track][sector];
-	if( s->size==0 && s->data == NULL ){	// first time seen
-		s->data = (uint8_t *)malloc(size);
-		memcpy(s->data,data,size);
-		s->size = size;
-		}
-
-	if( s->size != size )
-		error("Inconsistent sector size");
-	if( memcmp(s->data,data,s->size) != 0 )
-		error("Inconsistent sector data");
-	if(Verbose)
-		printf("OK\n");
-}
+bool		Index_write = false;	// write a sidecar index of mark positions during decode
+int		Correct = 0;		// fix small CRC errors: 1=single bit, 2=also double bit
+bool		Soft = false;		// retry bad fields with uncertain samples reclassified
+bool		Quality = false;	// report signal quality per track
+bool		Verify = false;		// decode every revolution, even once all sectors are held
+unsigned int	Spt = 0;		// sectors per track, 0 to learn from the capture
+unsigned int	Threads = 0;		// decode long tracks on this many threads
+unsigned int	Clock = 0;		// capture clock in MHz for files without a '# clock' line, 0 for the default
+unsigned int	Shift = 0;
+int		Read_ahead = 4;		// track files loaded ahead of the decoder
+const char	*Drive = NULL;		// drive description for --pack
+unsigned int	Cache_mb = 64;		// --serve cache size
+unsigned int	Workers = 0;		// --watch decoding threads, 0 for one per CPU
+floppy8_t	*Floppy;		// decoder context
+sample_t	*Samples;		// track being decoded, reused for every track
+track_file_t	Track;			// current track file
 
 // is the sector all the same value?
 static inline bool
@@ -211,22 +69,22 @@ sector_filled(const uint8_t *buf, const unsigned int count)
 
 #define	DSTEP	32
 static inline void
-sector_dump(const uint8_t *buf, const unsigned int count)
+sector_dump(FILE *out, const uint8_t *buf, const unsigned int count)
 {
 	unsigned int i,j;
 
 	for(i=0;i<count;i+=DSTEP){
-		printf("# ");
+		fprintf(out,"# ");
 		for(j=0;j<DSTEP;j++){
 			if( buf[i+j] )
-				printf("%02X ",buf[i+j]);
+				fprintf(out,"%02X ",buf[i+j]);
 			else
-				printf("__ ");
+				fprintf(out,"__ ");
 			}
-		printf("| ");
+		fprintf(out,"| ");
 		for(j=0;j<DSTEP;j++)
-			printf("%c",isprint(buf[i+j]) ? buf[i+j] : '_');
-		printf("\n");
+			fprintf(out,"%c",isprint(buf[i+j]) ? buf[i+j] : '_');
+		fprintf(out,"\n");
 		}
 }
 
@@ -241,58 +99,76 @@ size_to_let(unsigned int size)
 	return '?';
 }
 
-// show one sector in human readable form
+// show one sector in human readable form.  The side is shown only for double sided disks
 static inline void
-human_show(sector_t *s, unsigned int track, unsigned int sector)
+human_show(FILE *out, const sector_t *s, unsigned int track, unsigned int side, unsigned int sector, unsigned int sides)
 {
-	printf("# Track:%-2u Sector:%-2u Size:%-4u Status:",track,sector,s->size);
+	char fixed[32] = "";
+
+	if( s->corrected )
+		snprintf(fixed,sizeof(fixed)," CORRECTED=%u",s->corrected);
+	else if( s->reclassified )
+		snprintf(fixed,sizeof(fixed)," RECLASSIFIED=%u",s->reclassified);
+	fprintf(out,"# Track:%-2u ",track);
+	if( sides>1 )
+		fprintf(out,"Side:%u ",side);
+	fprintf(out,"Sector:%-2u Size:%-4u Status:",sector,s->size);
 	if( s->size==0 || s->data==NULL )
-		printf("MISSING\n");
+		fprintf(out,"MISSING\n");
 	else if( sector_filled(s->data,s->size) ){
 		if( s->data[0]==0 )
-			printf("ZERO\n");
+			fprintf(out,"ZERO%s\n",fixed);
 		else
-			printf("FILL=0x%02X\n",s->data[0]);
+			fprintf(out,"FILL=0x%02X%s\n",s->data[0],fixed);
 		}
 	else{
-		printf("DATA\n");
-		sector_dump(s->data,s->size);
+		fprintf(out,"DATA%s\n",fixed);
+		sector_dump(out,s->data,s->size);
 		}
 }
 
 // show one sector in JSON format
 static inline void
-json_show(sector_t *s, unsigned int track, unsigned int sector)
+json_show(FILE *out, const sector_t *s, unsigned int track, unsigned int side, unsigned int sector, unsigned int sides)
 {
 	unsigned int i;
 
-	printf("{\n");
-	printf(" \"track\": %u,",track);
-	printf(" \"sector\": %u,",sector);
-	printf(" \"size\": %u,",s->size);
-	printf(" \"data\":[\n");
+	fprintf(out,"{\n");
+	fprintf(out," \"track\": %u,",track);
+	if( sides>1 )
+		fprintf(out," \"side\": %u,",side);
+	fprintf(out," \"sector\": %u,",sector);
+	fprintf(out," \"size\": %u,",s->size);
+	if( s->corrected )
+		fprintf(out," \"corrected\": %u,",s->corrected);
+	if( s->reclassified )
+		fprintf(out," \"reclassified\": %u,",s->reclassified);
+	fprintf(out," \"data\":[\n");
 	for(i=0;s->data && i<s->size;i++){
-		printf("0x%X,",s->data[i]);
+		fprintf(out,"0x%X,",s->data[i]);
 		if( (i%32)==31 )
-			printf("\n");
+			fprintf(out,"\n");
 		}
-	printf(" ],\n");
-	printf("}\n");
+	fprintf(out," ],\n");
+	fprintf(out,"}\n");
 }
 
 static inline void
-disk_show()
+disk_show(FILE *out, const floppy8_t *f)
 {
 	unsigned int sector_min = NSECTORS;
 	unsigned int sector_max = 0;
+	unsigned int sides = floppy8_sides(f);
 	unsigned int track;
+	unsigned int side;
 	unsigned int sector;
-	sector_t *s;
+	const sector_t *s;
 
 	// establish sector min/max
 	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<sides;side++)
 	for(sector=0;sector<NSECTORS;sector++){
-		s = &Disk[track][sector];
+		s = floppy8_sector(f,track,side,sector);
 		if( s->size ){
 			if(sector<sector_min)
 				sector_min = sector;
@@ -304,624 +180,1209 @@ disk_show()
 	if(sector_min > 1)
 		sector_min=1;
 
-	printf("# Track/Sector map: .=Missing, 1=128, 2=256, 3=512, 4=1014\n");
+	// a double sided disk has the side 1 map to the right of side 0's
+	fprintf(out,"# Track/Sector map: .=Missing, 1=128, 2=256, 3=512, 4=1014\n");
 	for(sector=sector_min;sector<=sector_max;sector++){
-		printf("#\t%2u: ",sector);
-		for(track=0;track<NTRACKS;track++)
-			printf("%c",size_to_let(Disk[track][sector].size));
-		printf("\n");
+		fprintf(out,"#\t%2u: ",sector);
+		for(side=0;side<sides;side++){
+			if( side )
+				fprintf(out," ");
+			for(track=0;track<NTRACKS;track++)
+				fprintf(out,"%c",size_to_let(floppy8_sector(f,track,side,sector)->size));
+			}
+		fprintf(out,"\n");
 		}
 
 	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<sides;side++)
 	for(sector=sector_min;sector<=sector_max;sector++){
-		s = &Disk[track][sector];
+		s = floppy8_sector(f,track,side,sector);
 		if(Json_show)
-			json_show(s,track,sector);
+			json_show(out,s,track,side,sector,sides);
 		else
-			human_show(s,track,sector);
+			human_show(out,s,track,side,sector,sides);
 		}
 }
 
-// Does a piece of decoded data match one of the special mark patterns?
-static inline bool
-mark_match (const uint8_t *s, const uint8_t *pat, const unsigned int len)
+// number of characters save_data() writes for one sample, including the newline
+static inline unsigned int
+sample_chars(sample_t s)
 {
-	unsigned int i;
+	unsigned int n = 2;
 
-	for(i=0;i<len;i++)
-		if (s[i] != pat[i])
-			return false;
-	return true;
+	while( s>=10 ){
+		s /= 10;
+		n++;
+		}
+	return n;
 }
 
-static inline unsigned short
-crc16 (const uint8_t *buf, const unsigned int count)
+// .raw file offset of a sample.  Records mostly arrive in increasing sample order, so the cursor
+// moves on from the last one; the piece before a capture's first index pulse is decoded last,
+// so it can also move back
+static inline unsigned long
+sample_offset(track_file_t *t, const unsigned int sample)
 {
-	unsigned int i;
-	uint8_t x;
-	unsigned short crc = 0xffff;
-
-	for(i=0; i<count; i++){
-		x = crc >> 8 ^ buf[i];
-		x ^= x >> 4;
-		crc = (crc << 8) ^ ((unsigned short) (x << 12)) ^ ((unsigned short) (x << 5)) ^ ((unsigned short) x);
-	}
-	return crc;
+	while( t->sample>sample ){
+		t->sample--;
+		t->byte -= sample_chars(t->samples[t->sample]);
+		}
+	while( t->sample<sample && t->sample<t->n ){
+		t->byte += sample_chars(t->samples[t->sample]);
+		t->sample++;
+		}
+	return t->byte;
 }
 
-// Given a sample value in ticks, return which microsecond bucket it falls into
-static unsigned int
-sample_to_us (sample_t s)
+static const char *Record_tags[] = { "?", "INDX", "ADDR", "DATA", "DELD" };
+
+// called by the decoder for each mark it finds.  Record ADDR/DATA marks in the sidecar index
+static void
+sector_found(void *arg, const floppy8_record_t *r)
 {
-	unsigned int us = (s + (ONE_US / 2)) / ONE_US;
+	track_file_t *t = (track_file_t *)arg;
 
-	return (us < MAX_US) ? us : MAX_US - 1;
+	if( t->index==NULL || r->type==FLOPPY8_INDX )
+		return;
+	fprintf(t->index,"%s %u %lu %u %u %u %u %s %u\n",Record_tags[r->type],r->sample,sample_offset(t,r->sample),
+		r->track,r->side,r->sector,r->size,floppy8_format_name(r->format),r->cell);
 }
 
-// Look at samples and decide if it looks like FM or MFM encoding
-// FM has 2 peaks at 2us and 4us.  MFM has peaks at 2, 3 and 4us.
-// If there are more than about 5% of the samples at 3us, its probably MFM.
-static inline int
-determine_format (const sample_t *samples, const unsigned int n)
+static void
+diag_show(void *arg, int level, const char *msg)
+{
+	(void)arg;
+	if( level==FLOPPY8_ERROR )
+		printf("# ERROR: %s\n",msg);
+	else
+		printf("# %s\n",msg);
+}
+
+// load track data from file into sample array, return actual number of samples
+// Loading starts 'offset' bytes into the file, which must be the start of a line
+// Capture details ahead of the samples go to 'cap' if it is not NULL
+static inline unsigned int
+track_load(const char *s, const unsigned long offset, sample_t *samples, const unsigned int n, floppy8_capture_t *cap)
 {
+	FILE *fp = fopen(s,"r");
 	unsigned int i;
-	unsigned int fmt;
-	unsigned int histogram[MAX_US];
-	unsigned int s;
 
-	for (i = 0; i < MAX_US; i++)
-		histogram[i] = 0;
-	for (i = 0; i < n; i++){
-		s = sample_to_us(samples[i]);
-		histogram[s]++;
+	if( cap )
+		memset(cap,0,sizeof(*cap));
+	if(fp==NULL)
+		return 0;
+	if( offset && (fseek(fp,(long)offset-1,SEEK_SET)!=0 || fgetc(fp)!='\n') ){
+		fclose(fp);
+		return 0;
 		}
-	fmt = (((histogram[3] * 100) / n) > 5) ? TT_MFM : TT_FM;
+	i = floppy8_load(fp,samples,n,cap);
+	fclose(fp);
+	return i;
+}
 
-	if(Verbose){
-		printf("# Histogram:\n");
-		for(i=0;i<MAX_US;i++)
-			printf("# %2u: %u\n",i,histogram[i]);
-		printf("# Track Format: %s\n", (fmt==TT_FM) ? "FM":"MFM");
-		}
+// decode samples of a known (or unknown, if zero) format
+// With index pulses in 'cap', later revolutions are only decoded if needed
+static inline void
+track_decode(const sample_t *samples, const unsigned int n, const int format, const floppy8_capture_t *cap, FILE *index)
+{
+	Track.samples = samples;
+	Track.n       = n;
+	Track.sample  = 0;
+	Track.byte    = cap ? cap->header : 0;
+	Track.index   = index;
+	(void)floppy8_revolutions(Floppy,samples,n,format,cap);
+	Track.index   = NULL;
+}
 
-	return fmt;
+// name of the sidecar index for a track file: TrackNN.raw -> TrackNN.idx
+static inline void
+index_name(const char *s, char *name, const unsigned int size)
+{
+	unsigned int len = strlen(s);
+
+	if( len>4 && strcmp(&s[len-4],".raw")==0 )
+		len -= 4;
+	snprintf(name,size,"%.*s.idx",(int)len,s);
 }
 
+// One line of signal quality for a track: space separated name=value, times in ns
 static inline void
-mark_used(uint8_t *buf, unsigned int count, char tag)
+quality_show(const char *s, const floppy8_quality_t *q)
 {
-	unsigned int i;
+	static const char *us[3] = { "2us", "3us", "4us" };
+	unsigned int k;
+
+	printf("# Quality: file=%s format=%s samples=%u",s,floppy8_format_name(q->format),q->samples);
+	if( q->rpm>0.0 )
+		printf(" rpm=%.2f rpm_min=%.2f rpm_max=%.2f",q->rpm,q->rpm_min,q->rpm_max);
+	for(k=0;k<3;k++)
+		if( q->peak_count[k] )
+			printf(" peak_%s=%u/%.0f/%.1f",us[k],q->peak_count[k],q->peak_mean[k],q->peak_sd[k]);
+	printf(" jitter_p50=%.0f jitter_p95=%.0f jitter_p99=%.0f",q->jitter_p50,q->jitter_p95,q->jitter_p99);
+	printf(" ambiguous=%.4f outliers=%u clamped=%u\n",q->ambiguous,q->outliers,q->clamped);
+}
 
-	for(i=0;i<count;i++)
-		buf[i] = tag;
+// decode a track file already loaded into 'samples'
+static inline void
+process_loaded(const char *s, const sample_t *samples, const unsigned int n, const floppy8_capture_t *cap)
+{
+	unsigned int	i;
+	char		name[FILENAME_MAX];
+	FILE		*index = NULL;
+
+	if(Verbose){
+		printf("# Load %s, %u samples",s,n);
+		if( cap->nindex>1 )
+			printf(", %u revolutions at %.1f RPM",cap->nindex-1,floppy8_rpm(cap,samples,n));
+		printf("\n");
+		}
+	for(i=0;i<cap->bad && i<FLOPPY8_MAX_BAD;i++)
+		printf("# ERROR: %s:%u: malformed sample\n",s,cap->bad_line[i]);
+	if( cap->bad>FLOPPY8_MAX_BAD )
+		printf("# ERROR: %s: %u more malformed samples\n",s,cap->bad-FLOPPY8_MAX_BAD);
+	if( n==0 )
+		return;
+	if(Index_write){
+		index_name(s,name,sizeof(name));
+		index = fopen(name,"w");
+		if( index==NULL )
+			printf("# ERROR: cannot create %s\n",name);
+		else
+			fprintf(index,"# type sample offset track side sector size encoding cell\n");
+		}
+	track_decode(samples,n,0,cap,index);
+	if(index)
+		fclose(index);
+	if(Quality)
+		quality_show(s,floppy8_quality(Floppy));
 }
 
-#if 0
-static inline unsigned int
-count_repeat(const uint8_t *buf, const unsigned int count)
+static inline void
+process(char *s)
 {
-	unsigned int i;
+	unsigned int n;
+	floppy8_capture_t cap;
 
-	for(i=1;i<count;i++)
-		if( buf[i] != buf[0] )
-			break;
-	return i;
+	n = track_load(s,0,Samples,MAX_SAMPLES,&cap);
+	process_loaded(s,Samples,n,&cap);
+}
+
+// Read-ahead: a reader thread keeps the next few track files loaded while the current one
+// is decoded, so file latency (on network storage, mostly) overlaps with decoding.
+// Loaded tracks pass through a small ring, in order.
+#define	MAX_READ_AHEAD	16
+
+typedef struct loaded {
+	sample_t		*samples;
+	unsigned int		n;
+	floppy8_capture_t	cap;
+} loaded_t;
+
+typedef struct readahead {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	char		**files;
+	int		nfiles;
+	int		loaded;		// files the reader has loaded
+	int		decoded;	// files the decoder is done with
+	int		depth;		// ring slots
+	loaded_t	ring[MAX_READ_AHEAD];
+} readahead_t;
+
+sample_t	*Ring[MAX_READ_AHEAD];	// ring slot buffers, allocated on first use and kept for every disk
+int		Ring_slots = 0;
+
+static void *
+reader(void *arg)
+{
+	readahead_t *r = (readahead_t *)arg;
+	loaded_t *l;
+	int i;
+
+	for(i=0;i<r->nfiles;i++){
+		pthread_mutex_lock(&r->lock);
+		while( i-r->decoded>=r->depth )
+			pthread_cond_wait(&r->cond,&r->lock);
+		pthread_mutex_unlock(&r->lock);
+
+		l = &r->ring[i%r->depth];
+		l->n = track_load(r->files[i],0,l->samples,MAX_SAMPLES,&l->cap);
+
+		pthread_mutex_lock(&r->lock);
+		r->loaded++;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		}
+	return NULL;
 }
 
-// show used/unused areas in decoded track
-// bytes are either 0/1 or marked with a printable letter
+// decode track files in order, loading up to 'depth' of them ahead
 static inline void
-track_map(uint8_t *buf, unsigned int count)
+process_all(char **files, const int nfiles, int depth)
 {
-	unsigned int i,j;
-	unsigned int repeat;
-
-	printf("Track use map\n");
-	for(i=0;i<count;i+=repeat){
-		repeat = count_repeat(&buf[i],count-i);
-		if(buf[i]==0){
-			if( repeat>=100 )
-				printf(" 0:%u",repeat);
-			else{
-				printf(" ");
-				for(j=0;j<repeat;j++)
-					printf("0");
+	readahead_t r;
+	pthread_t thread;
+	int i;
+
+	if( depth>MAX_READ_AHEAD )
+		depth = MAX_READ_AHEAD;
+	if( depth<1 || nfiles<2 ){
+		for(i=0;i<nfiles;i++)
+			process(files[i]);
+		return;
+		}
+	memset(&r,0,sizeof(r));
+	r.files  = files;
+	r.nfiles = nfiles;
+	r.depth  = depth;
+	for(i=0;i<depth;i++){
+		if( i==Ring_slots ){
+			Ring[i] = (sample_t *)malloc(sizeof(sample_t)*MAX_SAMPLES);
+			if( Ring[i]==NULL ){
+				r.depth = i;
+				break;
 				}
+			Ring_slots++;
 			}
-		else if(buf[i]==1){
-			if( repeat>=100 )
-				printf(" 1:%u",repeat);
-			else{
-				printf(" ");
-				for(j=0;j<repeat;j++)
-					printf("1");
-				}
+		r.ring[i].samples = Ring[i];
+		}
+	pthread_mutex_init(&r.lock,NULL);
+	pthread_cond_init(&r.cond,NULL);
+	if( r.depth==0 || pthread_create(&thread,NULL,reader,&r)!=0 ){
+		for(i=0;i<nfiles;i++)
+			process(files[i]);
+		}
+	else{
+		for(i=0;i<nfiles;i++){
+			pthread_mutex_lock(&r.lock);
+			while( r.loaded<=i )
+				pthread_cond_wait(&r.cond,&r.lock);
+			pthread_mutex_unlock(&r.lock);
+
+			process_loaded(files[i],r.ring[i%r.depth].samples,r.ring[i%r.depth].n,&r.ring[i%r.depth].cap);
+
+			pthread_mutex_lock(&r.lock);
+			r.decoded++;
+			pthread_cond_broadcast(&r.cond);
+			pthread_mutex_unlock(&r.lock);
 			}
-		else if(isprint(buf[i]))
-			printf("\n%c:%u",buf[i],repeat);
-		else
-			printf("_:%u",repeat);
+		pthread_join(thread,NULL);
 		}
-	printf("\n");
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.cond);
 }
-#endif
 
-// fetch an FM encoded byte, return value, update buf pointer
-static inline uint8_t
-fm_fetch_byte (uint8_t ** buf)
-{
-	unsigned int i;
-	unsigned int byte = 0;
-	uint8_t *p = *buf;
-
-	for (i = 0; i < 8; i++) {
-		byte <<= 1;
-		byte |= *p;
-		if( p[0]==1 && p[1]==1 )
-			p += 2;
-		else
-			p += 1;
-	}
-	*buf = p;
-	return byte;
-}
+// one line of a sidecar index
+typedef struct index_entry {
+	char		tag[8];
+	unsigned int	sample;
+	unsigned long	offset;
+	unsigned int	track;
+	unsigned int	side;
+	unsigned int	sector;
+	unsigned int	size;
+	char		encoding[8];
+	unsigned int	cell;
+} index_entry_t;
 
-// fetch bytes from in, save to out, return updated in ptr
-static inline uint8_t *
-fm_fetch_bytes (uint8_t * in, uint8_t *out, unsigned int count)
+static inline bool
+index_read(FILE *fp, index_entry_t *e)
 {
-	unsigned int i;
+	char line[128];
 
-	for(i=0;i<count;i++)
-		out[i] = fm_fetch_byte(&in);
-	return in;
+	while( fgets(line,sizeof(line),fp) ){
+		if( line[0]=='#' )
+			continue;
+		if( sscanf(line,"%7s %u %lu %u %u %u %u %7s %u",e->tag,&e->sample,&e->offset,
+			&e->track,&e->side,&e->sector,&e->size,e->encoding,&e->cell)==9 )
+			return true;
+		}
+	return false;
 }
 
-// Examine an address mark and see if it is valid.  Return the number of input bytes consumed
-// and fill in track,sector,side,ssize if true
-static inline unsigned int
-fm_valid_addr (uint8_t *buf, unsigned int *track, unsigned int *side, unsigned int *sector, unsigned int *size)
+// format of an index encoding name, zero to survey the samples if it is not known
+static inline int
+format_of(const char *name)
 {
-	uint8_t *bufend;
-	uint8_t addr[1+4+2];	// Address mark, Track, Side, Sector, Size, 2 CRC
+	int format;
 
-	addr[0] = 0xFE;
-	bufend = fm_fetch_bytes (buf, &addr[1], 6);
-	if (crc16 (addr, sizeof (addr)) != 0)
-		return 0;
-	if( addr[1] >= NTRACKS )
-		return 0;
-	if( addr[2] >= NSIDES )
-		return 0;
-	if( addr[3] >= NSECTORS )
-		return 0;
-	if (addr[4] >= NSIZES)
-		return 0;	// invalid ssize code
+	for(format=FLOPPY8_FM;format<=FLOPPY8_M2FM;format++)
+		if( strcmp(name,floppy8_format_name(format))==0 )
+			return format;
+	return 0;
+}
+
+// Extra samples read after the end of a data field
+#define	QUERY_MARGIN	64
 
-	*track  = addr[1];
-	*side   = addr[2]; // always 0 for SA-800
-	*sector = addr[3];
-	*size   = 128 << addr[4];
-	return bufend-buf;
+// Decode one sector from a track file using its sidecar index.  Only the samples from the ADDR
+// mark through the end of the following data field are read and decoded.
+// Return true if the index has an entry for the sector (whether or not it decoded).
+static inline bool
+sector_query(const char *s, const unsigned int track, const unsigned int side, const unsigned int sector)
+{
+	FILE *fp;
+	char name[FILENAME_MAX];
+	index_entry_t addr,e;
+	floppy8_capture_t cap;
+	sample_t *samples;
+	unsigned int n,want;
+	bool found = false;
+	bool save = Index_write;
+
+	index_name(s,name,sizeof(name));
+	fp = fopen(name,"r");
+	if( fp==NULL ){
+		// no index yet, so do it the slow way (and build the index for next time)
+		Index_write = true;
+		process((char *)s);
+		Index_write = save;
+		return floppy8_sector(Floppy,track,side,sector)->size!=0;
+		}
+	samples = Samples;
+	// the capture's clock, from the header ahead of its first sample
+	(void)track_load(s,0,samples,1,&cap);
+	cap.header = 0;
+	cap.nindex = 0;
+	addr.tag[0] = '\0';
+	while( floppy8_sector(Floppy,track,side,sector)->size==0 && index_read(fp,&e) ){
+		if( strcmp(e.tag,"ADDR")==0 ){
+			addr = e;
+			continue;
+			}
+		if( strcmp(addr.tag,"ADDR")!=0 || addr.track!=track || addr.side!=side || addr.sector!=sector )
+			continue;
+		addr.tag[0] = '\0';
+		found = true;
+
+		// an FM byte is at most 16 samples, MFM and M2FM at most 8
+		want = (e.sample-addr.sample) + (4+e.size+2)*16 + QUERY_MARGIN;
+		if( want>MAX_SAMPLES )
+			want = MAX_SAMPLES;
+		n = track_load(s,addr.offset,samples,want,NULL);
+		if(Verbose)
+			printf("# Query %s, %u samples at offset %lu\n",s,n,addr.offset);
+		if( n )
+			track_decode(samples,n,format_of(e.encoding),&cap,NULL);
+		}
+	fclose(fp);
+	return found;
 }
 
+// Track number from a capture file name (.../TrackNN.raw or .../TrackNN_S.raw), or NTRACKS if it has none
 static inline unsigned int
-fm_valid_data (uint8_t *buf, unsigned int sector_size, uint8_t *sector_data)
+track_number(const char *s, unsigned int *side)
 {
-	uint8_t *bufend;
-	uint8_t data[1 + MAX_SSIZE + 2];	// Data mark, data bytes, 2 CRC
-
-	if(sector_size>MAX_SSIZE)
-		return 0;
-	data[0] = 0xFB;
+	unsigned int track;
 
-	bufend = fm_fetch_bytes (buf, &data[1], sector_size+2);
-	if (crc16 (data, 1 + sector_size + 2) != 0)
-		return 0;
-	memcpy(sector_data,&data[1],sector_size);
-	return bufend-buf;
+	if( !floppy8_track_of(s,&track,side) )
+		return NTRACKS;
+	return track;
 }
 
-static inline unsigned int
-fm_valid_deld (uint8_t *buf, unsigned int sector_size, uint8_t *sector_data)
-{
-	uint8_t *bufend;
-	uint8_t data[1 + MAX_SSIZE + 2];	// Data mark, data bytes, 2 CRC
+// .f8 disk file being decoded, if any
+f8file_t	*Disk;
+const char	*Disk_name;
 
-	if(sector_size>MAX_SSIZE)
-		return 0;
-	data[0] = 0xF8;	// deleted data
+static inline bool
+disk_file(const char *s)
+{
+	unsigned int len = strlen(s);
 
-	bufend = fm_fetch_bytes (buf, &data[1], sector_size+2);
-	if (crc16 (data, 1 + sector_size + 2) != 0)
-		return 0;
-	memcpy(sector_data,&data[1],sector_size);
-	return bufend-buf;
+	return len>3 && strcmp(&s[len-3],".f8")==0;
 }
 
-static inline unsigned int
-fm_indx(uint8_t *buf, unsigned int i)
+// .scp or .hfe flux image being decoded, if any
+flux_t		*Flux;
+
+// name a track of the disk file or flux image in messages
+static inline void
+disk_label(char *name, const unsigned int size, const unsigned int track, const unsigned int side)
 {
-	(void)buf;
-	if(Verbose)
-		printf("# %06u: INDX\n",i);
-	sector_none();
-	return 0;
+	if( side )
+		snprintf(name,size,"%s:Track%02u_%u",Disk_name,track,side);
+	else
+		snprintf(name,size,"%s:Track%02u",Disk_name,track);
 }
 
-static inline unsigned int
-fm_addr(uint8_t *buf, unsigned int i)
+// decode directory entry 'i' of the .f8 file
+static inline bool
+disk_track(const unsigned int i)
 {
-	unsigned int consumed = fm_valid_addr(&buf[i],&Last_track,&Last_side,&Last_sector,&Last_size);
-
-	if( consumed ){
-		if(Verbose)
-			printf("# %06u: ADDR Track:%02u Side:%u Sector:%02u Size:%u\n",i,Last_track,Last_side,Last_sector,Last_size);
+	floppy8_capture_t cap;
+	const sample_t *samples;
+	unsigned int n,track,side;
+	char name[FILENAME_MAX];
+	bool save = Index_write;
+
+	if( !f8file_entry(Disk,i,&track,&side) )
+		return false;
+	disk_label(name,sizeof(name),track,side);
+	samples = f8file_track(Disk,i,Samples,&n,&cap);
+	if( samples==NULL ){
+		printf("# ERROR: %s: bad checksum or unknown encoding\n",name);
+		return false;
 		}
-	else
-		sector_none();
-	return consumed;
+	Index_write = false;	// sidecar indexes are for .raw files
+	process_loaded(name,samples,n,&cap);
+	Index_write = save;
+	return true;
 }
 
-static inline unsigned int
-fm_data(uint8_t *buf, unsigned int i)
+// decode a track of the flux image, false if it has none
+static inline bool
+flux_decode(const unsigned int track, const unsigned int side)
 {
-	uint8_t	sector_data[MAX_SSIZE];
-	unsigned int consumed = fm_valid_data(&buf[i],Last_size,sector_data);
+	floppy8_capture_t cap;
+	const sample_t *samples;
+	unsigned int n;
+	char name[FILENAME_MAX];
+	bool save = Index_write;
+
+	samples = flux_track(Flux,track,side,Samples,&n,&cap);
+	if( samples==NULL )
+		return false;
+	disk_label(name,sizeof(name),track,side);
+	Index_write = false;
+	process_loaded(name,samples,n,&cap);
+	Index_write = save;
+	return true;
+}
 
-	if( consumed ){
-		if(Verbose)
-			printf("# %06u: DATA ",i);
-		disk_add(Last_track,Last_side,Last_sector,Last_size,sector_data);
-		sector_none();
-		}
-	return consumed;
+// decode every track of the flux image
+static inline void
+flux_decode_all()
+{
+	unsigned int track,side;
+
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<NSIDES;side++)
+		(void)flux_decode(track,side);
 }
 
-static inline unsigned int
-fm_deld(uint8_t *buf, unsigned int i)
+// write track files into one .f8 file
+static inline int
+disk_pack(const char *path, char **files, const int nfiles)
 {
-	uint8_t	sector_data[MAX_SSIZE];
-	unsigned int consumed = fm_valid_deld(&buf[i],Last_size,sector_data);
+	f8file_info_t info;
+	f8file_t *d;
+	floppy8_capture_t cap;
+	unsigned int n,track,side,packed = 0;
+	int i,ret = 0;
+
+	memset(&info,0,sizeof(info));
+	info.clock = Clock;
+	info.shift = Shift;
+	if( Drive )
+		snprintf(info.drive,sizeof(info.drive),"%s",Drive);
+	d = f8file_create(path,&info);
+	if( d==NULL ){
+		printf("# ERROR: cannot create %s\n",path);
+		return 1;
+		}
+	for(i=0;i<nfiles;i++){
+		track = track_number(files[i],&side);
+		if( track>=NTRACKS ){
+			printf("# ERROR: cannot tell track number of %s\n",files[i]);
+			ret = 1;
+			continue;
+			}
+		n = track_load(files[i],0,Samples,MAX_SAMPLES,&cap);
+		if( cap.bad )
+			printf("# ERROR: %s: %u malformed samples left out\n",files[i],cap.bad);
+		if( f8file_add(d,track,side,Samples,n,&cap)!=FLOPPY8_OK ){
+			printf("# ERROR: cannot write %s\n",path);
+			ret = 1;
+			break;
+			}
+		packed++;
+		}
+	if( f8file_finish(d)!=FLOPPY8_OK ){
+		printf("# ERROR: cannot write %s\n",path);
+		ret = 1;
+		}
+	if(Verbose)
+		printf("# Packed %u tracks into %s\n",packed,path);
+	return ret;
+}
 
-	if( consumed ){
-		if(Verbose)
-			printf("# %06u: DELD ",i);
-		disk_add(Last_track,Last_side,Last_sector,Last_size,sector_data);
-		sector_none();
+// write the tracks of the .f8 file as TrackNN.raw (TrackNN_1.raw for side 1) files in 'dir', as the capture device does
+static inline int
+disk_unpack(const char *dir)
+{
+	floppy8_capture_t cap;
+	const sample_t *samples;
+	unsigned int i,k,n,track,side;
+	char path[FILENAME_MAX];
+	FILE *fp;
+	int ret = 0;
+
+	for(i=0;f8file_entry(Disk,i,&track,&side);i++){
+		samples = f8file_track(Disk,i,Samples,&n,&cap);
+		if( samples==NULL ){
+			printf("# ERROR: %s: Track %u Side %u: bad checksum or unknown encoding\n",Disk_name,track,side);
+			ret = 1;
+			continue;
+			}
+		floppy8_track_name(path,sizeof(path),dir,track,side);
+		fp = fopen(path,"w");
+		if( fp==NULL ){
+			printf("# ERROR: cannot create %s\n",path);
+			ret = 1;
+			continue;
+			}
+		if( cap.clock )
+			fprintf(fp,"# clock %u %u\n",cap.clock,cap.shift);
+		for(k=0;k<cap.nindex;k++)
+			fprintf(fp,"# index %u %u\n",cap.index[k],cap.cycles[k]);
+		for(k=0;k<n;k++)
+			fprintf(fp,"%u\n",samples[k]);
+		if( fclose(fp)!=0 ){
+			printf("# ERROR: cannot write %s\n",path);
+			ret = 1;
+			}
 		}
-	return consumed;
+	return ret;
 }
 
-static inline void
-fm_decode (const sample_t *samples, const unsigned int n, const sample_t split)
+// write the tracks being decoded (the .f8 file, the flux image or the track files) into the .scp or .hfe image 'path'
+static inline int
+disk_export(const char *path, char **files, const int nfiles)
 {
-	unsigned int i;
-	unsigned int consumed;
-	uint8_t	*decode = (uint8_t *)malloc(n+DECODE_PAD);		// decoded stream is the same size as samples
-
-	// Convert sample us to just 0/1
-	for (i = 0; i < n; i++)
-		decode[i] = (samples[i] < split) ? 1 : 0;
-	for(i=0;i<DECODE_PAD;i++)
-		decode[n+i] = 0;
-
-	// Identify index/addr/data areas and extract
-	for (i = 0; i < n; i++) {
-		if( mark_match (&decode[i], FM_indx_mark, sizeof (FM_indx_mark))){
-			(void)fm_indx(decode,i+sizeof(FM_indx_mark));	// just to print
-			consumed = sizeof(FM_indx_mark);
-			mark_used(&decode[i],consumed,'I');
-			}
-		else if( mark_match (&decode[i], FM_addr_mark, sizeof (FM_addr_mark))){
-			consumed = fm_addr(decode,i+sizeof(FM_addr_mark));
-			if( consumed ){
-				consumed += sizeof(FM_addr_mark);
-				mark_used(&decode[i],consumed,'A');
-				}
+	floppy8_capture_t cap;
+	const sample_t *samples;
+	unsigned int n,track,side,exported = 0;
+	flux_t *x;
+	int i,ret = 0;
+
+	if( !flux_file(path) || (x=flux_create(path))==NULL ){
+		printf("# ERROR: cannot create %s (.scp or .hfe)\n",path);
+		return 1;
+		}
+	for(i=0;;i++){
+		if( Disk ){
+			if( !f8file_entry(Disk,i,&track,&side) )
+				break;
+			samples = f8file_track(Disk,i,Samples,&n,&cap);
 			}
-		else if( mark_match (&decode[i], FM_data_mark, sizeof (FM_data_mark))){
-			consumed = fm_data(decode,i+sizeof(FM_data_mark));
-			if( consumed ){
-				consumed += sizeof(FM_data_mark);
-				mark_used(&decode[i],consumed,'D');
-				}
+		else if( Flux ){
+			if( i>=NTRACKS*NSIDES )
+				break;
+			track = i/NSIDES;
+			side  = i%NSIDES;
+			if( !flux_has(Flux,track,side) )
+				continue;
+			samples = flux_track(Flux,track,side,Samples,&n,&cap);
 			}
-		else if( mark_match (&decode[i], FM_deld_mark, sizeof (FM_deld_mark))){
-			consumed = fm_deld(decode,i+sizeof(FM_deld_mark));
-			if( consumed ){
-				consumed += sizeof(FM_deld_mark);
-				mark_used(&decode[i],consumed,'d');
+		else{
+			if( i>=nfiles )
+				break;
+			track = track_number(files[i],&side);
+			if( track>=NTRACKS ){
+				printf("# ERROR: cannot tell track number of %s\n",files[i]);
+				ret = 1;
+				continue;
 				}
+			n = track_load(files[i],0,Samples,MAX_SAMPLES,&cap);
+			samples = Samples;
 			}
-		else
-			consumed = 0;
-		i += consumed;
-	}
-	//track_map(decode,n);	// DEBUG
-	free(decode);
+		if( samples==NULL ){
+			printf("# ERROR: %s: Track %u Side %u: bad checksum or unknown encoding\n",Disk_name,track,side);
+			ret = 1;
+			continue;
+			}
+		if( cap.clock==0 && Clock ){	// --clock for captures without a '# clock' line
+			cap.clock = Clock;
+			cap.shift = Shift;
+			}
+		if( flux_add(x,track,side,samples,n,&cap)!=FLOPPY8_OK ){
+			printf("# ERROR: cannot write %s\n",path);
+			ret = 1;
+			break;
+			}
+		exported++;
+		}
+	if( flux_finish(x)!=FLOPPY8_OK ){
+		printf("# ERROR: cannot write %s\n",path);
+		ret = 1;
+		}
+	if(Verbose)
+		printf("# Exported %u tracks into %s\n",exported,path);
+	return ret;
 }
 
-// Convert pairs of mfm bits to final values: 00->0, 01->1, 10->0, 11->invalid
-static inline uint8_t
-mfm_fetch_bit(uint8_t *buf)
-{
-	unsigned int pair = (buf[0]<<1)+(buf[1]<<0);
+// Disks for --serve and --diff: .f8 files, .scp or .hfe flux images, or directories of TrackNN.raw files
+typedef struct served {
+	const char	*name;
+	f8file_t	*f8;
+	flux_t		*flux;
+} served_t;
 
-	switch(pair){
-	case 0:
-	case 2:
-		return 0;
-	case 1:
-		return 1;
-	}
+served_t	*Served;
+unsigned int	Nserved;
 
-	error("Invalid MFM bit");
-	return 0;	// NOTREACHED
+// decode one track of a served disk.  Runs on the server's client threads, so uses only its arguments
+static bool
+serve_track(void *arg, floppy8_t *f, sample_t *samples, unsigned int disk, unsigned int track, unsigned int side)
+{
+	floppy8_capture_t cap;
+	const sample_t *p;
+	char path[FILENAME_MAX];
+	unsigned int n;
+	int i;
+
+	(void)arg;
+	if( disk>=Nserved )
+		return false;
+	if( Served[disk].f8 ){
+		i = f8file_find(Served[disk].f8,track,side);
+		if( i<0 )
+			return false;
+		p = f8file_track(Served[disk].f8,i,samples,&n,&cap);
+		if( p==NULL )
+			return false;
+		}
+	else if( Served[disk].flux ){
+		p = flux_track(Served[disk].flux,track,side,samples,&n,&cap);
+		if( p==NULL )
+			return false;
+		}
+	else{
+		floppy8_track_name(path,sizeof(path),Served[disk].name,track,side);
+		n = track_load(path,0,samples,MAX_SAMPLES,&cap);
+		p = samples;
+		if( n==0 )
+			return false;
+		}
+	(void)floppy8_revolutions(f,p,n,0,&cap);
+	return true;
 }
 
-// fetch an MFM encoded byte, return value, update buf pointer
-static inline uint8_t
-mfm_fetch_byte (uint8_t ** buf)
+// open the disks given for serve_track()
+static inline bool
+served_open(char **files, const int nfiles)
 {
-	unsigned int i;
-	unsigned int byte = 0;
-	uint8_t *p = *buf;
-
-	for (i = 0; i < 8; i++) {
-		byte <<= 1;
-		byte |= mfm_fetch_bit(p);
-		p += 2;
-	}
-	*buf = p;
-	return byte;
+	int i;
+
+	Served = (served_t *)calloc(nfiles ? nfiles : 1,sizeof(served_t));
+	if( Served==NULL )
+		return false;
+	for(i=0;i<nfiles;i++){
+		Served[i].name = files[i];
+		if( disk_file(files[i]) ){
+			Served[i].f8 = f8file_open(files[i]);
+			if( Served[i].f8==NULL )
+				printf("# ERROR: cannot read disk file %s\n",files[i]);
+			}
+		else if( flux_file(files[i]) ){
+			Served[i].flux = flux_open(files[i]);
+			if( Served[i].flux==NULL )
+				printf("# ERROR: cannot read flux image %s\n",files[i]);
+			}
+		if(Verbose)
+			printf("# Disk %d: %s\n",i,files[i]);
+		}
+	Nserved = nfiles;
+	return true;
 }
 
-static inline uint8_t *
-mfm_fetch_bytes (uint8_t * in, uint8_t *out, unsigned int count)
+// serve sectors of the disks given until killed
+static inline int
+serve(const char *path, floppy8_config_t *cfg, char **files, const int nfiles)
 {
-	unsigned int i;
+	int ret;
 
-	for(i=0;i<count;i++)
-		out[i] = mfm_fetch_byte(&in);
-	return in;
+	if( !served_open(files,nfiles) )
+		return 1;
+	cfg->sector = NULL;
+	cfg->arg    = NULL;
+	ret = serve_run(path,cfg,(size_t)Cache_mb<<20,serve_track,NULL);
+	printf("# ERROR: cannot serve on %s\n",path);
+	return ret!=FLOPPY8_OK;
 }
 
-// Examine an address mark and see if it is valid.  Return number of consumed input bytes
-// and fill in track,sector,side,ssize if true
-static inline unsigned int
-mfm_valid_addr (uint8_t *buf, unsigned int *track, unsigned int *side, unsigned int *sector, unsigned int *size)
+// ask a server for one sector and show it
+static inline int
+ask(const char *path, const unsigned int disk, const unsigned int track, const unsigned int side, const unsigned int sector)
 {
-	uint8_t *bufend;
-	uint8_t addr[4+4+2];	// Address mark, Track, Side, Sector, Size, 2 CRC
+	floppy8_sector_t s;
+	uint8_t buf[FLOPPY8_MAX_SSIZE];
+	int r;
 
-	bufend = mfm_fetch_bytes (buf, addr, sizeof(addr));
-	if ( crc16 (addr, sizeof(addr)) != 0)
-		return 0;
-	if( addr[4] >= NTRACKS )
-		return 0;
-	if( addr[5] >= NSIDES )
-		return 0;
-	if( addr[6] >= NSECTORS )
-		return 0;
-	if (addr[7] >= NSIZES)
-		return 0;	// invalid ssize code
-
-	*track  = addr[4];
-	*side   = addr[5];
-	*sector = addr[6];
-	*size   = 128 << addr[7];
-	return bufend-buf;
+	r = serve_ask(path,disk,track,side,sector,&s,buf);
+	if( r<0 ){
+		printf("# ERROR: no server on %s\n",path);
+		return 1;
+		}
+	if( r==SERVE_NOTRACK )
+		printf("# ERROR: disk %u has no track %u side %u\n",disk,track,side);
+	if(Json_show)
+		json_show(stdout,&s,track,side,sector,side+1);
+	else
+		human_show(stdout,&s,track,side,sector,side+1);
+	return r!=SERVE_OK;
 }
 
-static inline unsigned int
-mfm_valid_data (uint8_t *buf, unsigned int sector_size, uint8_t *sector_data)
+// one of the disks being compared by --diff
+typedef struct diffed {
+	unsigned int	disk;		// in Served
+	floppy8_t	*f;
+	sample_t	*samples;
+	unsigned int	tracks;		// tracks decoded
+} diffed_t;
+
+// decode every track of a disk.  Runs on its own thread, so uses only its argument
+static void *
+diff_decode(void *arg)
 {
-	uint8_t *bufend;
-	uint8_t data[4 + MAX_SSIZE + 2];	// Data mark, data bytes, 2 CRC
+	diffed_t *d = (diffed_t *)arg;
+	unsigned int track,side;
 
-	if(sector_size>MAX_SSIZE)
-		return 0;
-	bufend = mfm_fetch_bytes (buf, data, 4 + sector_size + 2);
-	if (crc16 (data, 4 + sector_size + 2) != 0)
-		return 0;
-	memcpy(sector_data,&data[4],sector_size);
-	return bufend-buf;
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<NSIDES;side++)
+		d->tracks += serve_track(NULL,d->f,d->samples,d->disk,track,side);
+	return NULL;
 }
 
+// Most differing bytes listed for a changed sector
+#define	DIFF_BYTES	8
+
+// Report one sector that differs between the disks.  Return 0 if it is the same on both
 static inline unsigned int
-mfm_valid_deld (uint8_t *buf, unsigned int sector_size, uint8_t *sector_data)
+sector_diff(const sector_t *a, const sector_t *b, unsigned int track, unsigned int side, unsigned int sector,
+	unsigned int sides, unsigned int *counts)
 {
-	uint8_t *bufend;
-	uint8_t data[4 + MAX_SSIZE + 2];	// Data mark, data bytes, 2 CRC
+	unsigned int i,n = 0;
+	bool have_a = a->size && a->data;
+	bool have_b = b->size && b->data;
 
-	if(sector_size>MAX_SSIZE)
+	if( !have_a && !have_b )
 		return 0;
-	bufend = mfm_fetch_bytes (buf, data, 4 + sector_size + 2);
-	if (crc16 (data, 4 + sector_size + 2) != 0)
+	if( have_a && have_b && a->size==b->size && memcmp(a->data,b->data,a->size)==0 ){
+		counts[0]++;
 		return 0;
-	memcpy(sector_data,&data[4],sector_size);
-	return bufend-buf;
+		}
+	printf("# Track:%-2u ",track);
+	if( sides>1 )
+		printf("Side:%u ",side);
+	printf("Sector:%-2u ",sector);
+	if( !have_b ){
+		printf("LOST\n");
+		counts[2]++;
+		return 1;
+		}
+	if( !have_a ){
+		printf("GAINED\n");
+		counts[3]++;
+		return 1;
+		}
+	counts[1]++;
+	if( a->size!=b->size ){
+		printf("CHANGED Size:%u>%u\n",a->size,b->size);
+		return 1;
+		}
+	for(i=0;i<a->size;i++)
+		n += a->data[i]!=b->data[i];
+	printf("CHANGED %u byte%s:",n,(n==1) ? "" : "s");
+	for(i=0,n=0;i<a->size;i++){
+		if( a->data[i]==b->data[i] )
+			continue;
+		if( n++==DIFF_BYTES ){
+			printf(" ...");
+			break;
+			}
+		printf(" 0x%03X=%02X>%02X",i,a->data[i],b->data[i]);
+		}
+	printf("\n");
+	return 1;
 }
 
-static inline unsigned int
-mfm_indx(uint8_t *buf, unsigned int i)
+// decode two captures of a disk side by side, and report the sectors that were lost, gained
+// or changed from the first to the second.  Return 0 if they hold the same sectors
+static inline int
+diff(floppy8_config_t *cfg, char **files, const int nfiles)
 {
-	(void)buf;
-	if(Verbose)
-		printf("# %06u: INDX\n",i);
-	sector_none();
-	return 0;
+	diffed_t d[2];
+	pthread_t thread;
+	unsigned int track,side,sector,sides,differ = 0;
+	unsigned int counts[4] = { 0, 0, 0, 0 };	// same, changed, lost, gained
+	bool threaded;
+	int i;
+
+	if( !served_open(files,nfiles) )
+		return 2;
+	cfg->sector = NULL;
+	cfg->arg    = NULL;
+	if( !Verbose )
+		cfg->diag = NULL;	// decode errors just show up as differences
+	memset(d,0,sizeof(d));
+	for(i=0;i<2;i++){
+		d[i].disk    = i;
+		d[i].f       = floppy8_new(cfg);
+		d[i].samples = (sample_t *)malloc(sizeof(sample_t)*MAX_SAMPLES);
+		if( d[i].f==NULL || d[i].samples==NULL ){
+			printf("# FATAL: out of memory\n");
+			return 2;
+			}
+		}
+	// the second disk on this thread while the first decodes on another
+	threaded = pthread_create(&thread,NULL,diff_decode,&d[0])==0;
+	(void)diff_decode(&d[1]);
+	if( threaded )
+		pthread_join(thread,NULL);
+	else
+		(void)diff_decode(&d[0]);
+	for(i=0;i<2;i++){
+		if( d[i].tracks==0 ){
+			printf("# ERROR: no tracks in %s\n",files[i]);
+			return 2;
+			}
+		if(Verbose)
+			printf("# %s: %u tracks\n",files[i],d[i].tracks);
+		}
+
+	sides = floppy8_sides(d[0].f);
+	if( floppy8_sides(d[1].f)>sides )
+		sides = floppy8_sides(d[1].f);
+	printf("# Diff %s %s\n",files[0],files[1]);
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<sides;side++)
+	for(sector=0;sector<NSECTORS;sector++)
+		differ += sector_diff(floppy8_sector(d[0].f,track,side,sector),floppy8_sector(d[1].f,track,side,sector),
+			track,side,sector,sides,counts);
+	printf("# Same:%u Changed:%u Lost:%u Gained:%u\n",counts[0],counts[1],counts[2],counts[3]);
+	for(i=0;i<2;i++){
+		floppy8_free(d[i].f);
+		free(d[i].samples);
+		}
+	return differ!=0;
 }
 
-static inline unsigned int
-mfm_addr(uint8_t *buf, unsigned int i)
+// decode each disk given (.f8 files, flux images or directories of TrackNN.raw files) into the store 'dir'
+static inline int
+store_all(const char *dir, char **files, const int nfiles)
 {
-	unsigned int consumed = mfm_valid_addr(&buf[i],&Last_track,&Last_side,&Last_sector,&Last_size);
-
-	if( consumed ){
-		if(Verbose)
-			printf("# %06u: ADDR Track:%02u Side:%u Sector:%02u Size:%u\n",i,Last_track,Last_side,Last_sector,Last_size);
+	static char paths[NTRACKS*NSIDES][FILENAME_MAX];
+	char *tracks[NTRACKS*NSIDES];
+	store_stats_t stats,total;
+	unsigned int track,side;
+	store_t *st;
+	int i,n,ret = 0;
+
+	st = store_open(dir);
+	if( st==NULL ){
+		printf("# FATAL: cannot create store %s\n",dir);
+		return 1;
 		}
-	else
-		sector_none();
-	return consumed;
+	memset(&total,0,sizeof(total));
+	for(i=0;i<nfiles;i++){
+		floppy8_reset(Floppy);
+		if( disk_file(files[i]) ){
+			Disk_name = files[i];
+			Disk = f8file_open(Disk_name);
+			if( Disk==NULL ){
+				printf("# ERROR: cannot read disk file %s\n",Disk_name);
+				ret = 1;
+				continue;
+				}
+			for(n=0;n<(int)f8file_info(Disk)->ntracks;n++)
+				(void)disk_track(n);
+			f8file_close(Disk);
+			Disk = NULL;
+			}
+		else if( flux_file(files[i]) ){
+			Disk_name = files[i];
+			Flux = flux_open(Disk_name);
+			if( Flux==NULL ){
+				printf("# ERROR: cannot read flux image %s\n",Disk_name);
+				ret = 1;
+				continue;
+				}
+			flux_decode_all();
+			flux_close(Flux);
+			Flux = NULL;
+			}
+		else{
+			for(n=0,track=0;track<NTRACKS;track++)
+			for(side=0;side<NSIDES;side++){
+				floppy8_track_name(paths[n],sizeof(paths[n]),files[i],track,side);
+				if( access(paths[n],R_OK)==0 ){
+					tracks[n] = paths[n];
+					n++;
+					}
+				}
+			if( n==0 ){
+				printf("# ERROR: no track files in %s\n",files[i]);
+				ret = 1;
+				continue;
+				}
+			process_all(tracks,n,Read_ahead);
+			}
+		if( store_disk(st,files[i],Floppy,&stats)!=FLOPPY8_OK ){
+			printf("# ERROR: cannot store %s in %s\n",files[i],dir);
+			ret = 1;
+			continue;
+			}
+		printf("# Stored %s: %lu sectors, %lu missing, %lu new (%lu of %lu bytes)\n",files[i],
+			stats.sectors,stats.missing,stats.objects,stats.new_bytes,stats.bytes);
+		total.sectors   += stats.sectors;
+		total.bytes     += stats.bytes;
+		total.objects   += stats.objects;
+		total.new_bytes += stats.new_bytes;
+		}
+	if( store_close(st)!=FLOPPY8_OK ){
+		printf("# ERROR: cannot write the index of %s\n",dir);
+		ret = 1;
+		}
+	printf("# Total: %lu sectors, %lu new, %lu bytes written for %lu bytes of sectors\n",
+		total.sectors,total.objects,total.new_bytes,total.bytes);
+	return ret;
 }
 
-static inline unsigned int
-mfm_data(uint8_t *buf, unsigned int i)
+static void
+where_show(void *arg, const char *hash, char kind, const char *disk, unsigned int track, unsigned int side,
+	unsigned int sector)
 {
-	uint8_t	sector_data[MAX_SSIZE];
-	unsigned int consumed = mfm_valid_data(&buf[i],Last_size,sector_data);
+	char at[24] = "";
 
-	if( consumed ){
-		if(Verbose)
-			printf("# %06u: DATA ",i);
-		disk_add(Last_track,Last_side,Last_sector,Last_size,sector_data);
-		sector_none();
-		}
-	return consumed;
+	(void)arg;
+	if( side )
+		snprintf(at,sizeof(at)," Side:%u",side);
+	if( kind=='T' )
+		printf("# %s Disk:%s Track:%u%s\n",hash,disk,track,at);
+	else
+		printf("# %s Disk:%s Track:%u%s Sector:%u\n",hash,disk,track,at,sector);
 }
 
-static inline unsigned int
-mfm_deld(uint8_t *buf, unsigned int i)
+// show the disks in the store 'dir' that hold a sector or track
+static inline int
+where(const char *dir, const char *key)
 {
-	uint8_t	sector_data[MAX_SSIZE];
-	unsigned int consumed = mfm_valid_data(&buf[i],Last_size,sector_data);
-
-	if( consumed ){
-		if(Verbose)
-			printf("# %06u: DELD ",i);
-		disk_add(Last_track,Last_side,Last_sector,Last_size,sector_data);
-		sector_none();
-		}
-	return consumed;
+	int n;
+
+	n = store_find(dir,key,where_show,NULL);
+	if( n==FLOPPY8_EINVAL )
+		printf("# ERROR: %s is not a hash, a stored DISK:T[_H] or DISK:T:[H:]S, or a sector file\n",key);
+	else if( n<0 )
+		printf("# ERROR: cannot read the index of %s\n",dir);
+	else if( n==0 )
+		printf("# Not found\n");
+	return n<=0;
 }
 
-static inline void
-mfm_decode (const sample_t *samples, const unsigned int n, const sample_t split_lo, const sample_t split_hi)
+// a disk being decoded by --watch, one per directory
+typedef struct watched {
+	floppy8_t	*f;
+	sample_t	*samples;
+	bool		seen[NTRACKS][NSIDES];	// tracks decoded
+} watched_t;
+
+// decode a track file as soon as it is written, and bring the disk's output (DiskNNN.out, as
+// 'make go' writes it) up to date.  Runs on the watcher's worker threads, one per disk at a time
+static void
+watch_track(void *arg, void **state, const char *disk, unsigned int track, unsigned int side, const char *path)
 {
-	unsigned int i;
-	unsigned int consumed;
-	sample_t s;
-	uint8_t *dptr;
-	unsigned int nact;		// actual number of decoded bits, typically about 2.5x of the input
-	uint8_t mark[4];		// for finding index/addr/data marks
-	uint8_t *decode = (uint8_t *)malloc((n*4)+DECODE_PAD);	// worse case, decoded bits are 4x the number of samples
-
-	// convert to RLL format
-	dptr = decode;
-	for(i=0;i<n;i++){
-		s = samples[i];
-		*dptr++ = 1;
-		if( s>=split_hi ){		// 4us
-			*dptr++ = 0;
-			*dptr++ = 0;
-			*dptr++ = 0;
-			}
-		else if( s>=split_lo ){		// 3us
-			*dptr++ = 0;
-			*dptr++ = 0;
-			}
-		else{				// 2us
-			*dptr++ = 0;
-			}
-		}
-	nact = dptr-decode;	// how much expanded data
-	for(i=0;i<DECODE_PAD;i++)
-		*dptr++ = 0;
-	if(Verbose)
-		printf("# MFM decode expanded to %u samples\n",nact);
-
-	// Identify index/addr/data areas and extract
-	for (i = 0; i < nact; i+=consumed) {
-		mfm_fetch_bytes(&decode[i],mark,sizeof(mark));
-		if( mark_match (mark, MFM_indx_mark, sizeof(mark))){
-			(void)mfm_indx(decode,i);
-			consumed = sizeof(mark)*8*2;	// each byte consumes 8 pairs of bits
-			mark_used(&decode[i],consumed,'I');
-			}
-		else if( mark_match (mark, MFM_addr_mark, sizeof(mark))){
-			consumed = mfm_addr(decode,i);
-			if( consumed )
-				mark_used(&decode[i],consumed,'A');
-			else
-				consumed=1;
+	const floppy8_config_t *cfg = (const floppy8_config_t *)arg;
+	watched_t *w = (watched_t *)*state;
+	floppy8_capture_t cap;
+	char name[FILENAME_MAX],tmp[FILENAME_MAX+8];
+	unsigned int i,n,t,h,sides,sector,sector_min = NSECTORS,sector_max = 0;
+	unsigned int found = 0,missing = 0,tracks = 0,disk_missing = 0;
+	size_t len;
+	FILE *fp;
+
+	if( w==NULL ){
+		w = (watched_t *)calloc(1,sizeof(*w));
+		if( w ){
+			w->f = floppy8_new(cfg);
+			w->samples = (sample_t *)malloc(sizeof(sample_t)*MAX_SAMPLES);
 			}
-		else if( mark_match (mark, MFM_data_mark, sizeof(mark))){
-			consumed = mfm_data(decode,i);
-			if(consumed)
-				mark_used(&decode[i],consumed,'D');
-			else
-				consumed=1;
+		if( w==NULL || w->f==NULL || w->samples==NULL ){
+			printf("# ERROR: out of memory for %s\n",disk);
+			if( w ){
+				floppy8_free(w->f);
+				free(w->samples);
+				free(w);
+				}
+			return;
 			}
-		else if( mark_match (mark, MFM_deld_mark, sizeof(mark))){
-			consumed = mfm_deld(decode,i);
-			if(consumed)
-				mark_used(&decode[i],consumed,'d');
-			else
-				consumed=1;
+		*state = w;
+		}
+	n = track_load(path,0,w->samples,MAX_SAMPLES,&cap);
+	for(i=0;i<cap.bad && i<FLOPPY8_MAX_BAD;i++)
+		printf("# ERROR: %s:%u: malformed sample\n",path,cap.bad_line[i]);
+	if( n )
+		(void)floppy8_revolutions(w->f,w->samples,n,0,&cap);
+	w->seen[track][side] = true;
+
+	// missing sectors of this track, and of the disk so far, in the range disk_show() shows
+	sides = floppy8_sides(w->f);
+	for(t=0;t<NTRACKS;t++)
+	for(h=0;h<sides;h++)
+	for(sector=0;sector<NSECTORS;sector++){
+		if( floppy8_sector(w->f,t,h,sector)->size ){
+			if( sector<sector_min )
+				sector_min = sector;
+			if( sector>sector_max )
+				sector_max = sector;
 			}
-		else
-			consumed = 1;	// advance the search
-	}
-	//track_map(decode,nact);	// DEBUG
-	free(decode);
+		}
+	if( sector_min>1 )
+		sector_min = 1;
+	for(t=0;t<NTRACKS;t++)
+	for(h=0;h<NSIDES;h++){
+		if( !w->seen[t][h] )
+			continue;
+		tracks++;
+		for(sector=sector_min;sector<=sector_max;sector++){
+			if( floppy8_sector(w->f,t,h,sector)->size ){
+				found += (t==track && h==side);
+				continue;
+				}
+			disk_missing++;
+			missing += (t==track && h==side);
+			}
+		}
+	printf("# %s%s: %u sectors, %u missing; %u tracks, %u sectors missing\n",(found==0 || missing) ? "ERROR: " : "",
+		path,found,missing,tracks,disk_missing);
+
+	len = strlen(disk);
+	while( len>1 && disk[len-1]=='/' )
+		len--;
+	snprintf(name,sizeof(name),"%.*s.out",(int)len,disk);
+	snprintf(tmp,sizeof(tmp),"%s.tmp",name);
+	fp = fopen(tmp,"w");
+	if( fp==NULL ){
+		printf("# ERROR: cannot create %s\n",tmp);
+		return;
+		}
+	disk_show(fp,w->f);
+	if( fclose(fp)!=0 || rename(tmp,name)!=0 )
+		printf("# ERROR: cannot write %s\n",name);
 }
 
-// load track data from file into sample array, return actual number of samples
-static inline unsigned int
-track_load(const char *s, sample_t *samples, const unsigned int n)
+// decode the captures written into 'dir' as they arrive, until killed
+static inline int
+watch(const char *dir, floppy8_config_t *cfg)
 {
-	FILE *fp = fopen(s,"r");
-	unsigned int i;
-	unsigned int v;
+	long cpus;
 
-	if(fp==NULL)
-		return 0;
-	for(i=0;i<n;i++){
-		if( fscanf(fp,"%u",&v)!=1 )
-			break;
-		samples[i] = v;
+	if( Workers==0 ){
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		Workers = (cpus>0) ? cpus : 1;
 		}
-	fclose(fp);
-	return i;
+	if(Verbose)
+		printf("# Watching %s with %u workers\n",dir,Workers);
+	cfg->sector = NULL;
+	cfg->arg    = NULL;
+	return watch_run(dir,Workers,watch_track,cfg)!=FLOPPY8_OK;
 }
 
-static inline void
-process(char *s)
+// track files by track number and side, for modes that decode tracks on demand.  CP/M
+// file systems are read from side 0
+char		*Track_files[NTRACKS][NSIDES];
+
+static bool
+track_demand(void *arg, unsigned int track)
 {
-	unsigned int	n;		// number of samples loaded
-	sample_t	*samples = (sample_t *)malloc(sizeof(sample_t)*MAX_SAMPLES);
+	int i;
 
-	if(Verbose)
-		printf("# Load %s, ",s);
-	n = track_load(s,samples,MAX_SAMPLES);
-	if(Verbose)
-		printf("%u samples\n",n);
-	if( n==0 ){
-		free(samples);
-		return;
+	(void)arg;
+	if( Disk ){
+		i = f8file_find(Disk,track,0);
+		return i>=0 && disk_track(i);
 		}
-	sector_none();
-	switch (determine_format(samples,n)) {
-	case TT_FM:
-		fm_decode (samples,n,FM_SPLIT);
-		break;
-	case TT_MFM:
-		mfm_decode (samples,n,MFM_SPLIT_LO,MFM_SPLIT_HI);
-		break;
-	default:
-		error("Cannot determine track format");
-		break;
+	if( Flux )
+		return flux_decode(track,0);
+	if( track>=NTRACKS || Track_files[track][0]==NULL )
+		return false;
+	process(Track_files[track][0]);
+	return true;
+}
+
+// a sector address, T:S for side 0 or T:H:S for side H
+static inline bool
+sector_arg(const char *s, unsigned int *track, unsigned int *side, unsigned int *sector)
+{
+	switch(sscanf(s,"%u:%u:%u",track,side,sector)){
+	case 2:
+		*sector = *side;
+		*side   = 0;
+		return true;
+	case 3:
+		return true;
 	}
-	free(samples);
+	return false;
 }
 
+static inline void
+usage()
+{
+	printf("Usage: extract [-v] [-j] [-i] [-c|-cc] [-s] [-q] [--verify] [--spt N] [--clock MHZ:SHIFT] [--threads N] [--read-ahead N] [--sector T:[H:]S] [--files DIR] TrackNN.raw ... | disk.f8|.scp|.hfe\n");
+	printf("       extract [--clock MHZ:SHIFT] [--drive TEXT] --pack disk.f8 TrackNN.raw ...\n");
+	printf("       extract --unpack DIR disk.f8\n");
+	printf("       extract [--clock MHZ:SHIFT] --export IMAGE.scp|IMAGE.hfe TrackNN.raw ... | disk.f8|.scp|.hfe\n");
+	printf("       extract [--cache MB] --serve SOCKET disk.f8|DIR ...\n");
+	printf("       extract --ask SOCKET D:T:[H:]S\n");
+	printf("       extract --store DIR disk.f8|DIR ...\n");
+	printf("       extract --where DIR HASH|DISK:T[_H]|DISK:T:[H:]S|FILE\n");
+	printf("       extract [--workers N] --watch DIR\n");
+	printf("       extract --diff A B\n");
+	printf("  -v            verbose\n");
+	printf("  -j            show sectors in JSON format\n");
+	printf("  -i            write a sidecar index (TrackNN.idx) for each track\n");
+	printf("  -c            correct single bit CRC errors in data fields (flagged CORRECTED)\n");
+	printf("  -cc           also correct 2 bit errors close together (less reliable)\n");
+	printf("  -s            retry bad data fields with their least certain samples reclassified\n");
+	printf("  -q            report the signal quality of each track\n");
+	printf("  --verify      decode and cross-check every revolution, not just until all sectors are read\n");
+	printf("  --spt N       expect sectors 1 to N on every track, rather than learning them\n");
+	printf("  --clock MHZ:SHIFT  samples are cycles of a MHZ clock shifted right by SHIFT (default 600:4)\n");
+	printf("  --threads N   decode each track in up to N pieces in parallel\n");
+	printf("  --read-ahead N load up to N track files ahead of the decoder (default 4, 0 for none)\n");
+	printf("  --sector T:S  decode only track T sector S (T:H:S for side H), using the sidecar indexes\n");
+	printf("  --files DIR   extract the files of a CP/M disk into DIR, decoding only the tracks needed\n");
+	printf("  --pack F      write the track files into one disk file F\n");
+	printf("  --unpack DIR  write the tracks of a disk file into DIR as track files\n");
+	printf("  --export F    write the tracks into the flux image F, SuperCard Pro (.scp) or HxC (.hfe)\n");
+	printf("  --drive TEXT  drive description to keep in a packed disk file\n");
+	printf("  --serve S     answer sector requests for the disks given on the Unix socket S\n");
+	printf("  --cache MB    memory for decoded tracks while serving (default 64)\n");
+	printf("  --ask S D:T:S ask the server on socket S for disk D track T sector S (D:T:H:S for side H)\n");
+	printf("  --store DIR   add the disks given to the content addressed store DIR\n");
+	printf("  --where DIR K list the stored disks holding a sector or track (a hash, a stored\n");
+	printf("                disk's track DISK:T or sector DISK:T:S, DISK:T_H and\n");
+	printf("                DISK:T:H:S for side H, or a file of sector data)\n");
+	printf("  --watch DIR   decode track files as they are written into DIR/DiskNNN, updating DiskNNN.out\n");
+	printf("  --workers N   decoding threads for --watch (default one per CPU)\n");
+	printf("  --diff        decode disks A and B in parallel and list the sectors lost, gained or changed\n");
+	exit(1);
+}
+
+#define	MODE_DISK	0	// decode everything and show the disk
+#define	MODE_SECTOR	1	// show one sector
+#define	MODE_FILES	2	// extract CP/M files
+#define	MODE_PACK	3	// make a .f8 file
+#define	MODE_UNPACK	4	// split a .f8 file into track files
+#define	MODE_SERVE	5	// serve sectors on a socket
+#define	MODE_ASK	6	// ask a server for a sector
+#define	MODE_STORE	7	// add disks to a sector store
+#define	MODE_WHERE	8	// look up a sector or track in a store
+#define	MODE_WATCH	9	// decode captures as they arrive
+#define	MODE_DIFF	10	// compare two captures of a disk
+#define	MODE_EXPORT	11	// write a .scp or .hfe image
+
 int
 main(int argc, char **argv)
 {
 	char *arg;
+	int mode = MODE_DISK;
+	unsigned int disk = 0, track = 0, side = 0, sector = 0, t, h;
+	const char *dir = NULL, *key = NULL;
+	char **files = (char **)malloc(sizeof(char *)*argc);
+	int nfiles = 0;
+	int i,n,ret = 0;
+	floppy8_config_t cfg;
 
 	setbuf(stdout,NULL);
 	while(--argc){
@@ -930,9 +1391,256 @@ main(int argc, char **argv)
 			Verbose=true;
 		else if( strcmp(arg,"-j")==0 )
 			Json_show=true;
+		else if( strcmp(arg,"-i")==0 )
+			Index_write=true;
+		else if( strcmp(arg,"-c")==0 )
+			Correct=1;
+		else if( strcmp(arg,"-cc")==0 )
+			Correct=2;
+		else if( strcmp(arg,"-s")==0 )
+			Soft=true;
+		else if( strcmp(arg,"-q")==0 )
+			Quality=true;
+		else if( strcmp(arg,"--verify")==0 )
+			Verify=true;
+		else if( strcmp(arg,"--threads")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&Threads)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--read-ahead")==0 ){
+			if( argc<2 || sscanf(argv[1],"%d",&Read_ahead)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--spt")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&Spt)!=1 || Spt>=NSECTORS )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--clock")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u:%u",&Clock,&Shift)!=2 || Clock==0 || Shift>=16 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--sector")==0 ){
+			if( argc<2 || !sector_arg(argv[1],&track,&side,&sector) || track>=NTRACKS || side>=NSIDES || sector>=NSECTORS )
+				usage();
+			mode = MODE_SECTOR;
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--pack")==0 || strcmp(arg,"--unpack")==0 ){
+			if( argc<2 )
+				usage();
+			mode = (arg[2]=='p') ? MODE_PACK : MODE_UNPACK;
+			dir = argv[1];
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--export")==0 ){
+			if( argc<2 )
+				usage();
+			mode = MODE_EXPORT;
+			dir = argv[1];
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--serve")==0 ){
+			if( argc<2 )
+				usage();
+			mode = MODE_SERVE;
+			dir = argv[1];
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--cache")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&Cache_mb)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--ask")==0 ){
+			if( argc<3 || sscanf(argv[2],"%u:%n",&disk,&n)!=1 || !sector_arg(&argv[2][n],&track,&side,&sector) )
+				usage();
+			mode = MODE_ASK;
+			dir = argv[1];
+			argc -= 2;
+			argv += 2;
+			}
+		else if( strcmp(arg,"--store")==0 ){
+			if( argc<2 )
+				usage();
+			mode = MODE_STORE;
+			dir = argv[1];
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--where")==0 ){
+			if( argc<3 )
+				usage();
+			mode = MODE_WHERE;
+			dir = argv[1];
+			key = argv[2];
+			argc -= 2;
+			argv += 2;
+			}
+		else if( strcmp(arg,"--watch")==0 ){
+			if( argc<2 )
+				usage();
+			mode = MODE_WATCH;
+			dir = argv[1];
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--diff")==0 )
+			mode = MODE_DIFF;
+		else if( strcmp(arg,"--workers")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&Workers)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--drive")==0 ){
+			if( argc<2 )
+				usage();
+			Drive = argv[1];
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--files")==0 ){
+			if( argc<2 )
+				usage();
+			dir = argv[1];
+			mode = MODE_FILES;
+			argc--;
+			argv++;
+			}
+		else if( arg[0]=='-' )
+			usage();
 		else
-			process(arg);
+			files[nfiles++] = arg;
 		}
-	disk_show();
-	return 0;
+
+	if( nfiles==1 && disk_file(files[0]) && mode!=MODE_PACK && mode!=MODE_SERVE && mode!=MODE_STORE && mode!=MODE_DIFF ){
+		Disk_name = files[0];
+		Disk = f8file_open(Disk_name);
+		if( Disk==NULL ){
+			printf("# FATAL: cannot read disk file %s\n",Disk_name);
+			return 1;
+			}
+		if(Verbose)
+			printf("# Disk %s: %u tracks, clock %u MHz >> %u, %.1f RPM, drive '%s'\n",Disk_name,f8file_info(Disk)->ntracks,
+				f8file_info(Disk)->clock,f8file_info(Disk)->shift,f8file_info(Disk)->rpm,f8file_info(Disk)->drive);
+		if( Clock==0 ){
+			Clock = f8file_info(Disk)->clock;
+			Shift = f8file_info(Disk)->shift;
+			}
+		}
+	else if( nfiles==1 && flux_file(files[0]) && mode!=MODE_PACK && mode!=MODE_SERVE && mode!=MODE_STORE && mode!=MODE_DIFF
+	  && mode!=MODE_UNPACK ){
+		Disk_name = files[0];
+		Flux = flux_open(Disk_name);
+		if( Flux==NULL ){
+			printf("# FATAL: cannot read flux image %s\n",Disk_name);
+			return 1;
+			}
+		}
+	else if( mode==MODE_UNPACK )
+		usage();
+
+	floppy8_config_init(&cfg);
+	cfg.verbose = Verbose;
+	cfg.correct = Correct;
+	cfg.soft    = Soft;
+	cfg.quality = Quality;
+	cfg.verify  = Verify;
+	cfg.spt     = Spt;
+	cfg.threads = Threads;
+	cfg.clock   = Clock;
+	cfg.shift   = Shift;
+	cfg.sector  = sector_found;
+	cfg.diag    = diag_show;
+	cfg.arg     = &Track;
+	Floppy = floppy8_new(&cfg);
+	Samples = (sample_t *)malloc(sizeof(sample_t)*MAX_SAMPLES);
+	if( Floppy==NULL || Samples==NULL ){
+		printf("# FATAL: out of memory\n");
+		return 1;
+		}
+
+	switch(mode){
+	case MODE_SERVE:
+		ret = serve(dir,&cfg,files,nfiles);
+		break;
+	case MODE_ASK:
+		ret = ask(dir,disk,track,side,sector);
+		break;
+	case MODE_STORE:
+		ret = store_all(dir,files,nfiles);
+		break;
+	case MODE_WHERE:
+		ret = where(dir,key);
+		break;
+	case MODE_WATCH:
+		ret = watch(dir,&cfg);
+		break;
+	case MODE_DIFF:
+		if( nfiles!=2 )
+			usage();
+		ret = diff(&cfg,files,nfiles);
+		break;
+	case MODE_PACK:
+		ret = disk_pack(dir,files,nfiles);
+		break;
+	case MODE_UNPACK:
+		ret = disk_unpack(dir);
+		break;
+	case MODE_EXPORT:
+		ret = disk_export(dir,files,nfiles);
+		break;
+	case MODE_SECTOR:
+		if( Disk && (i=f8file_find(Disk,track,side))>=0 )
+			(void)disk_track(i);
+		if( Flux )
+			(void)flux_decode(track,side);
+		for(i=0;i<nfiles && !Disk && !Flux && floppy8_sector(Floppy,track,side,sector)->size==0;i++)
+			(void)sector_query(files[i],track,side,sector);
+		if(Json_show)
+			json_show(stdout,floppy8_sector(Floppy,track,side,sector),track,side,sector,side+1);
+		else
+			human_show(stdout,floppy8_sector(Floppy,track,side,sector),track,side,sector,side+1);
+		break;
+	case MODE_FILES:
+		for(i=0;i<nfiles;i++){
+			if( (t=track_number(files[i],&h))<NTRACKS )
+				Track_files[t][h] = files[i];
+			else
+				printf("# ERROR: cannot tell track number of %s\n",files[i]);
+			}
+		(void)cpm_extract(Floppy,track_demand,NULL,dir);
+		break;
+	default:
+		if( Disk )
+			for(i=0;i<(int)f8file_info(Disk)->ntracks;i++)
+				(void)disk_track(i);
+		else if( Flux )
+			flux_decode_all();
+		else
+			process_all(files,nfiles,Read_ahead);
+		disk_show(stdout,Floppy);
+		break;
+	}
+	f8file_close(Disk);
+	flux_close(Flux);
+	floppy8_free(Floppy);
+	free(Samples);
+	for(i=0;i<Ring_slots;i++)
+		free(Ring[i]);
+	free(files);
+	return ret;
 }
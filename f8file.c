@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "floppy8.h"
+#include "f8file.h"
+#include "arduino/pack.h"
+
+//	f8file --- a whole disk capture in one file
+//
+// Layout, all numbers little endian:
+//	header		HEADER_SIZE bytes: magic, version, track count, directory offset,
+//			clock, shift, RPM * 1000, drive description
+//	samples		each track's samples, starting on an 8 byte boundary: packed as the
+//			capture device holds them (arduino/pack.h), or 16 bits each in older files
+//	directory	ENTRY_SIZE bytes per track: track, side, encoding, CRC-32 of the samples,
+//			sample count, byte count, offset, then the capture's clock, shift and
+//			index pulses
+// The directory goes last so tracks can be written as they are read.
+
+#define	MAGIC		"FLOPPY8\n"
+#define	VERSION		1
+#define	HEADER_SIZE	128
+#define	ENTRY_SIZE	(12*4+8+2*FLOPPY8_MAX_INDEX*4)
+#define	ALIGN		8
+
+#define	ENC_U16		1	// samples as 16 bit numbers
+#define	ENC_PACK	2	// samples packed, mostly a byte each
+
+// header field offsets
+#define	H_MAGIC		0
+#define	H_VERSION	8
+#define	H_NTRACKS	12
+#define	H_DIRECTORY	16
+#define	H_CLOCK		24
+#define	H_SHIFT		28
+#define	H_RPM		32
+#define	H_DRIVE		40
+
+// directory entry field offsets
+#define	E_TRACK		0
+#define	E_SIDE		4
+#define	E_ENCODING	8
+#define	E_CRC		12
+#define	E_SAMPLES	16
+#define	E_BYTES		20
+#define	E_OFFSET	24
+#define	E_CLOCK		32
+#define	E_SHIFT		36
+#define	E_NINDEX	40
+#define	E_INDEX		56
+#define	E_CYCLES	(E_INDEX+4*FLOPPY8_MAX_INDEX)
+
+struct f8file {
+	f8file_info_t	info;
+
+	// reading
+	const uint8_t	*map;
+	size_t		size;
+	const uint8_t	*dir;
+	int		slot[FLOPPY8_NTRACKS][FLOPPY8_NSIDES];	// directory entry of each track, -1 if none
+
+	// writing
+	FILE		*fp;
+	uint8_t		*entries;
+	unsigned int	max_entries;
+	uint64_t	offset;		// where the next track goes
+	double		rpm_sum;
+	unsigned int	rpm_tracks;
+	bool		failed;
+};
+
+static uint32_t Crc_table[256];
+
+static inline void
+crc32_init(void)
+{
+	uint32_t c;
+	unsigned int i,j;
+
+	if( Crc_table[1] )
+		return;
+	for(i=0;i<256;i++){
+		c = i;
+		for(j=0;j<8;j++)
+			c = (c & 1) ? (c>>1) ^ 0xEDB88320 : c>>1;
+		Crc_table[i] = c;
+		}
+}
+
+static inline uint32_t
+crc32(const uint8_t *buf, size_t len)
+{
+	uint32_t c = 0xFFFFFFFF;
+
+	while( len-- )
+		c = Crc_table[(c ^ *buf++) & 0xFF] ^ (c>>8);
+	return c ^ 0xFFFFFFFF;
+}
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static inline uint64_t
+get64(const uint8_t *p)
+{
+	return get32(p) | ((uint64_t)get32(p+4)<<32);
+}
+
+static inline void
+put32(uint8_t *p, const uint32_t v)
+{
+	p[0] = v;
+	p[1] = v>>8;
+	p[2] = v>>16;
+	p[3] = v>>24;
+}
+
+static inline void
+put64(uint8_t *p, const uint64_t v)
+{
+	put32(p,v);
+	put32(p+4,v>>32);
+}
+
+// Open a .f8 file for reading, NULL if it cannot be read or is not one
+f8file_t *
+f8file_open(const char *path)
+{
+	f8file_t *d;
+	struct stat st;
+	const uint8_t *e;
+	unsigned int i,track,side;
+	uint64_t dir,end;
+	int fd;
+
+	crc32_init();
+	fd = open(path,O_RDONLY);
+	if( fd<0 )
+		return NULL;
+	d = (f8file_t *)calloc(1,sizeof(*d));
+	if( d==NULL || fstat(fd,&st)!=0 || st.st_size<HEADER_SIZE ){
+		close(fd);
+		free(d);
+		return NULL;
+		}
+	d->size = st.st_size;
+	d->map  = (const uint8_t *)mmap(NULL,d->size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if( d->map==MAP_FAILED ){
+		free(d);
+		return NULL;
+		}
+	// the whole disk is usually decoded in order
+	(void)madvise((void *)d->map,d->size,MADV_WILLNEED);
+
+	d->info.ntracks = get32(d->map+H_NTRACKS);
+	dir = get64(d->map+H_DIRECTORY);
+	if( memcmp(d->map+H_MAGIC,MAGIC,8)!=0 || get32(d->map+H_VERSION)!=VERSION
+	 || dir>d->size || d->info.ntracks>(d->size-dir)/ENTRY_SIZE ){
+		f8file_close(d);
+		return NULL;
+		}
+	d->dir        = d->map+dir;
+	d->info.clock = get32(d->map+H_CLOCK);
+	d->info.shift = get32(d->map+H_SHIFT);
+	d->info.rpm   = get32(d->map+H_RPM)/1000.0;
+	memcpy(d->info.drive,d->map+H_DRIVE,F8FILE_DRIVE);
+	d->info.drive[F8FILE_DRIVE-1] = '\0';
+
+	memset(d->slot,-1,sizeof(d->slot));
+	for(i=0;i<d->info.ntracks;i++){
+		e = d->dir+i*ENTRY_SIZE;
+		track = get32(e+E_TRACK);
+		side  = get32(e+E_SIDE);
+		end   = get64(e+E_OFFSET)+get32(e+E_BYTES);
+		if( track>=FLOPPY8_NTRACKS || side>=FLOPPY8_NSIDES || end>dir || end<get32(e+E_BYTES) ){
+			f8file_close(d);
+			return NULL;
+			}
+		d->slot[track][side] = i;
+		}
+	return d;
+}
+
+void
+f8file_close(f8file_t *d)
+{
+	if( d==NULL )
+		return;
+	if( d->map )
+		munmap((void *)d->map,d->size);
+	if( d->fp )
+		fclose(d->fp);
+	free(d->entries);
+	free(d);
+}
+
+const f8file_info_t *
+f8file_info(const f8file_t *d)
+{
+	return &d->info;
+}
+
+// directory entry of a track, or -1 if the file does not have it
+int
+f8file_find(const f8file_t *d, const unsigned int track, const unsigned int side)
+{
+	if( track>=FLOPPY8_NTRACKS || side>=FLOPPY8_NSIDES )
+		return -1;
+	return d->slot[track][side];
+}
+
+// track and side of directory entry 'i', false if there is no such entry
+bool
+f8file_entry(const f8file_t *d, const unsigned int i, unsigned int *track, unsigned int *side)
+{
+	if( i>=d->info.ntracks )
+		return false;
+	*track = get32(d->dir+i*ENTRY_SIZE+E_TRACK);
+	*side  = get32(d->dir+i*ENTRY_SIZE+E_SIDE);
+	return true;
+}
+
+// unpack 'count' samples into 'buf', false if they are not all there
+static inline bool
+track_unpack(const uint8_t *p, const uint32_t bytes, sample_t *buf, const unsigned int count)
+{
+	const uint8_t *end = p+bytes;
+	unsigned int k;
+	uint32_t v;
+
+	for(k=0;k<count;k++){
+		p = pack_get(p,end,&v);
+		if( p==NULL )
+			return false;
+		buf[k] = (v<SAMPLE_MAX) ? v : SAMPLE_MAX;
+		}
+	return p==end;
+}
+
+// Samples of directory entry 'i', and their capture details.  Points into the file where
+// it can, otherwise the samples are copied into 'buf' (of FLOPPY8_MAX_SAMPLES).
+// NULL if the entry does not exist, is of an unknown encoding or fails its checksum
+const sample_t *
+f8file_track(const f8file_t *d, const unsigned int i, sample_t *buf, unsigned int *n, floppy8_capture_t *cap)
+{
+	const uint8_t *e,*p;
+	unsigned int k,count,encoding;
+	uint32_t bytes;
+
+	*n = 0;
+	if( cap )
+		memset(cap,0,sizeof(*cap));
+	if( i>=d->info.ntracks )
+		return NULL;
+	e = d->dir+i*ENTRY_SIZE;
+	p = d->map+get64(e+E_OFFSET);
+	count = get32(e+E_SAMPLES);
+	bytes = get32(e+E_BYTES);
+	encoding = get32(e+E_ENCODING);
+	if( count>FLOPPY8_MAX_SAMPLES || crc32(p,bytes)!=get32(e+E_CRC) )
+		return NULL;
+	if( encoding==ENC_PACK ){
+		if( !track_unpack(p,bytes,buf,count) )
+			return NULL;
+		}
+	else if( encoding!=ENC_U16 || bytes!=count*2 )
+		return NULL;
+	if( cap ){
+		cap->clock  = get32(e+E_CLOCK);
+		cap->shift  = get32(e+E_SHIFT);
+		cap->nindex = get32(e+E_NINDEX);
+		if( cap->nindex>FLOPPY8_MAX_INDEX )
+			cap->nindex = FLOPPY8_MAX_INDEX;
+		for(k=0;k<cap->nindex;k++){
+			cap->index[k]  = get32(e+E_INDEX+4*k);
+			cap->cycles[k] = get32(e+E_CYCLES+4*k);
+			}
+		}
+	*n = count;
+	if( encoding==ENC_PACK )
+		return buf;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if( ((uintptr_t)p % sizeof(sample_t))==0 )
+		return (const sample_t *)p;
+#endif
+	for(k=0;k<count;k++)
+		buf[k] = p[2*k] | (p[2*k+1]<<8);
+	return buf;
+}
+
+// Start writing a .f8 file.  The clock and shift in 'info' are the defaults for tracks that
+// do not give their own, the RPM is worked out from the tracks
+f8file_t *
+f8file_create(const char *path, const f8file_info_t *info)
+{
+	f8file_t *d;
+	uint8_t header[HEADER_SIZE];
+
+	crc32_init();
+	d = (f8file_t *)calloc(1,sizeof(*d));
+	if( d==NULL )
+		return NULL;
+	if( info )
+		d->info = *info;
+	d->info.ntracks = 0;
+	d->info.drive[F8FILE_DRIVE-1] = '\0';
+	d->fp = fopen(path,"wb");
+	if( d->fp==NULL ){
+		free(d);
+		return NULL;
+		}
+	// filled in by f8file_finish()
+	memset(header,0,sizeof(header));
+	if( fwrite(header,sizeof(header),1,d->fp)!=1 )
+		d->failed = true;
+	d->offset = HEADER_SIZE;
+	return d;
+}
+
+// write one track's samples
+int
+f8file_add(f8file_t *d, const unsigned int track, const unsigned int side, const sample_t *samples, const unsigned int n, const floppy8_capture_t *cap)
+{
+	uint8_t *e,*p,*q;
+	unsigned int k;
+	static const uint8_t pad[ALIGN];
+	size_t bytes;
+	double rpm;
+
+	if( track>=FLOPPY8_NTRACKS || side>=FLOPPY8_NSIDES || n>FLOPPY8_MAX_SAMPLES )
+		return FLOPPY8_EINVAL;
+	if( d->info.ntracks>=d->max_entries ){
+		k = d->max_entries ? 2*d->max_entries : FLOPPY8_NTRACKS*FLOPPY8_NSIDES;
+		e = (uint8_t *)realloc(d->entries,(size_t)k*ENTRY_SIZE);
+		if( e==NULL )
+			return FLOPPY8_ENOMEM;
+		d->entries = e;
+		d->max_entries = k;
+		}
+	p = (uint8_t *)malloc((size_t)n*PACK_MAX+1);
+	if( p==NULL )
+		return FLOPPY8_ENOMEM;
+	for(q=p,k=0;k<n;k++)
+		q = pack_put(q,samples[k]);
+	bytes = q-p;
+	e = d->entries+d->info.ntracks*ENTRY_SIZE;
+	memset(e,0,ENTRY_SIZE);
+	put32(e+E_TRACK,track);
+	put32(e+E_SIDE,side);
+	put32(e+E_ENCODING,ENC_PACK);
+	put32(e+E_CRC,crc32(p,bytes));
+	put32(e+E_SAMPLES,n);
+	put32(e+E_BYTES,bytes);
+	put64(e+E_OFFSET,d->offset);
+	if( cap ){
+		put32(e+E_CLOCK,cap->clock);
+		put32(e+E_SHIFT,cap->shift);
+		put32(e+E_NINDEX,cap->nindex);
+		for(k=0;k<cap->nindex && k<FLOPPY8_MAX_INDEX;k++){
+			put32(e+E_INDEX+4*k,cap->index[k]);
+			put32(e+E_CYCLES+4*k,cap->cycles[k]);
+			}
+		if( d->info.clock==0 && cap->clock ){
+			d->info.clock = cap->clock;
+			d->info.shift = cap->shift;
+			}
+		rpm = floppy8_rpm(cap,samples,n);
+		if( rpm>0.0 ){
+			d->rpm_sum += rpm;
+			d->rpm_tracks++;
+			}
+		}
+	if( fwrite(p,1,bytes,d->fp)!=bytes )
+		d->failed = true;
+	d->offset += bytes;
+	k = (ALIGN - d->offset%ALIGN) % ALIGN;
+	if( k && fwrite(pad,1,k,d->fp)!=k )
+		d->failed = true;
+	d->offset += k;
+	d->info.ntracks++;
+	free(p);
+	return d->failed ? FLOPPY8_EIO : FLOPPY8_OK;
+}
+
+// write the directory and header, and close the file
+int
+f8file_finish(f8file_t *d)
+{
+	uint8_t header[HEADER_SIZE];
+	int ret;
+
+	if( d->rpm_tracks )
+		d->info.rpm = d->rpm_sum/d->rpm_tracks;
+	memset(header,0,sizeof(header));
+	memcpy(header+H_MAGIC,MAGIC,8);
+	put32(header+H_VERSION,VERSION);
+	put32(header+H_NTRACKS,d->info.ntracks);
+	put64(header+H_DIRECTORY,d->offset);
+	put32(header+H_CLOCK,d->info.clock);
+	put32(header+H_SHIFT,d->info.shift);
+	put32(header+H_RPM,(uint32_t)(d->info.rpm*1000.0+0.5));
+	memcpy(header+H_DRIVE,d->info.drive,F8FILE_DRIVE);
+
+	if( d->info.ntracks && fwrite(d->entries,ENTRY_SIZE,d->info.ntracks,d->fp)!=d->info.ntracks )
+		d->failed = true;
+	if( fseek(d->fp,0,SEEK_SET)!=0 || fwrite(header,sizeof(header),1,d->fp)!=1 )
+		d->failed = true;
+	if( fclose(d->fp)!=0 )
+		d->failed = true;
+	d->fp = NULL;
+	ret = d->failed ? FLOPPY8_EIO : FLOPPY8_OK;
+	f8file_close(d);
+	return ret;
+}
@@ -0,0 +1,39 @@
+#ifndef F8FILE_H
+#define F8FILE_H
+
+#include "floppy8.h"
+
+//	f8file --- a whole disk capture in one file
+//
+// A .f8 file holds the track captures of one disk: a header of capture details, the
+// tracks' samples stored one after another, and a directory giving where each track is
+// and its checksum.  It is read through mmap, so any track can be decoded without
+// reading or parsing the others.
+
+#define	F8FILE_DRIVE	64	// size of the drive description, including the '\0'
+
+// capture details for the whole disk
+typedef struct f8file_info {
+	unsigned int	ntracks;		// tracks in the file
+	unsigned int	clock;			// capture cpu cycles per us, zero if unknown
+	unsigned int	shift;			// samples are cpu cycles shifted right by this much
+	double		rpm;			// mean speed over tracks with index pulses, zero if unknown
+	char		drive[F8FILE_DRIVE];	// drive description, may be empty
+} f8file_info_t;
+
+typedef struct f8file f8file_t;
+
+// reading
+f8file_t		*f8file_open(const char *path);
+void			f8file_close(f8file_t *d);
+const f8file_info_t	*f8file_info(const f8file_t *d);
+int			f8file_find(const f8file_t *d, unsigned int track, unsigned int side);
+bool			f8file_entry(const f8file_t *d, unsigned int i, unsigned int *track, unsigned int *side);
+const sample_t		*f8file_track(const f8file_t *d, unsigned int i, sample_t *buf, unsigned int *n, floppy8_capture_t *cap);
+
+// writing: create, add each track, then close to write the directory
+f8file_t		*f8file_create(const char *path, const f8file_info_t *info);
+int			f8file_add(f8file_t *d, unsigned int track, unsigned int side, const sample_t *samples, unsigned int n, const floppy8_capture_t *cap);
+int			f8file_finish(f8file_t *d);
+
+#endif
@@ -0,0 +1,2565 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "floppy8.h"
+
+//	libfloppy8 --- decode sector data from floppy given timestamp samples for each track
+
+// Data was collected from the floppy as pulses separated by 2-4us, with some variation.
+// FM data pulses are either 2us or 4us.  MFM data pulses arrive with deltas of 2, 3 or 4us,
+// M2FM with deltas of 2, 3, 4 or 5us.
+// On the disk, locations where the recording started or stopped may have very large or
+// very smal deltas.  Drive speed rotation may also affect the samples pulse width values.
+
+// The capture device (Teensy 4.1) runs at 600Mhz and samples are divided by 16 so 1 us equals 37.5 counts
+// That is the default.  Captures that start with a '# clock' line, or a configured clock, get
+// their own timing (see timing_set) and kernels specialised for it, if it is a common one.
+
+#define TWO_US		75
+#define ONE_US		(TWO_US/2)
+#define	THREE_US	(TWO_US+ONE_US)
+#define	FOUR_US		(TWO_US*2)
+#define	FIVE_US		((TWO_US*2)+ONE_US)
+
+#define	HALF_US		(ONE_US/2)
+#define	ONEP5_US	(ONE_US+HALF_US)
+#define	TWOP5_US	(TWO_US+HALF_US)
+#define	THREEP5_US	(THREE_US+HALF_US)
+#define	FOURP5_US	(FOUR_US+HALF_US)
+
+#define	FM_SPLIT	THREE_US	// FM has 2 ranges: 2 and 4 us
+#define	MFM_SPLIT_LO	TWOP5_US	// MFM has 3 ranges: 2, 3 and 4 us
+#define	MFM_SPLIT_HI	THREEP5_US
+
+#define  MAX_US    6		// samples are classified into 1us buckets.   +/- 0.5us
+
+// The same splits for any number of ticks in 2us
+#define	SPLIT_FM(t)	((t)+(t)/2)
+#define	SPLIT_LO(t)	((t)+(t)/4)
+#define	SPLIT_HI(t)	((t)+(t)/2+(t)/4)
+#define	SPLIT_TOP(t)	((t)*2+(t)/4)		// M2FM 4us from 5us
+
+// Decode kernels and the field handlers they call are always inlined, so a kernel
+// specialised with constant splits and diagnostics setting has no runtime checks of either
+#define	KERNEL		static inline __attribute__((always_inline))
+
+// For FM disks, track layout is:
+//
+// Once at beginning of track:
+//      40      FF
+//      6       00
+//      1       FC      Index mark (clock D7)
+//      26      FF
+//
+// For each sector:
+//      6       00
+//      1       FE      Address ID Mark (clock C7)
+//      1       TT      Track (00-4C)
+//      1       SD      Side (00)
+//      1       ST      Sector (01-1A)
+//      1       SS      Sector Size (00=128, 01=256, 02=512, 03=1024)
+//      2       CRC
+//      11      FF
+//      6       00
+//      1       FB      Data Mark (Clock C7) (Or F8 if 'deleted data')
+//      ???     ??      Data
+//      2       CRC
+//      27      FF
+//
+// Once at end of data:
+//      247     FF      count is approximate
+
+// For MFM disks, track layout is:
+//
+// Once at beginning of track:
+//      80      4E
+//      12      00
+//      3       C2
+//      1       FC      Index Mark
+//      50      4E
+//
+// For each sector:
+//      12      00
+//      3       A1
+//      1       FE      Address ID Mark
+//      1       TT      Track (00-4C)
+//      1       SD      Side (00)
+//      1       ST      Sector (01-1A)
+//      1       SS      Sector Size (as above)
+//      2       CRC
+//      22      4E
+//      12      00
+//      3       A1
+//      1       FB      Data Mark (Or F8 if 'deleted data')
+//      ???     ??      Data
+//      2       CRC
+//      54      4E
+//
+// Once at end of data:
+//      598     4E      count is approximate
+
+// M2FM (Intel MDS double density) disks have the FM layout, with 16 cells to a byte as in
+// MFM.  A clock pulse goes between two zero data bits only if the bit before had no clock
+// pulse either, so pulses are 2, 3, 4 or 5us apart.  Marks are single bytes with clock
+// pulses left out, and the CRC covers the mark as in FM:
+//      0C      Index Mark (clock 71)
+//      0E      Address ID Mark (clock 70)
+//      0B      Data Mark (clock 70) (Or 08, clock 72, if 'deleted data')
+// Intel's format has 52 sectors of 128 bytes.
+
+// CRC bytes are 16-bits, polynomial is X**16 + X**12 + X**5 + 1.  CRC is calculated
+// so that Address/Data mark + data + CRC == 0x0000
+
+#define	NTRACKS		FLOPPY8_NTRACKS
+#define	NSIDES		FLOPPY8_NSIDES
+#define NSECTORS	FLOPPY8_NSECTORS
+#define NSIZES		FLOPPY8_NSIZES
+#define MAX_SSIZE	FLOPPY8_MAX_SSIZE
+
+// Raw track data is classified into types before deltas are categorized
+#define TT_FM	FLOPPY8_FM
+#define TT_MFM	FLOPPY8_MFM
+#define TT_M2FM	FLOPPY8_M2FM
+#define	NENGINES	3	// encoding engines, one per format from TT_FM
+#define	DETECT_SAMPLES	16384	// samples looked at to pick the engine for a track
+
+#define MAX_SAMPLES	FLOPPY8_MAX_SAMPLES
+
+// Special FM marks
+static const uint8_t FM_indx_mark[] = { 1,1,1,0,1,1,0,1,1,1,0,0 };	// Data 0xFC,Clock 0xD7
+static const uint8_t FM_addr_mark[] = { 1,1,1,0,0,0,1,1,1,1,1,0 };	// Data 0xFE,Clock 0xC7
+static const uint8_t FM_data_mark[] = { 1,1,1,0,0,0,1,0,1,1,1,1 };	// Data 0xFB,Clock 0xC7
+static const uint8_t FM_deld_mark[] = { 1,1,1,0,0,0,1,0,0,0,1 };	// Data 0xF8,Clock 0xC7
+
+// Special MFM marks
+static const uint8_t MFM_indx_mark[] = { 0xC2, 0xC2, 0xC2, 0xFC };
+static const uint8_t MFM_addr_mark[] = { 0xA1, 0xA1, 0xA1, 0xFE };
+static const uint8_t MFM_data_mark[] = { 0xA1, 0xA1, 0xA1, 0xFB };
+static const uint8_t MFM_deld_mark[] = { 0xA1, 0xA1, 0xA1, 0xF8 };
+
+// Special M2FM marks, as cells: the clock then data cell of each bit.  They all start the same
+#define	M2FM_PREFIX	10
+static const uint8_t M2FM_indx_mark[] = { 0,0,1,0,1,0,1,0,0,1,0,1,0,0,1,0 };	// Data 0x0C,Clock 0x71
+static const uint8_t M2FM_addr_mark[] = { 0,0,1,0,1,0,1,0,0,1,0,1,0,1,0,0 };	// Data 0x0E,Clock 0x70
+static const uint8_t M2FM_data_mark[] = { 0,0,1,0,1,0,1,0,0,1,0,0,0,1,0,1 };	// Data 0x0B,Clock 0x70
+static const uint8_t M2FM_deld_mark[] = { 0,0,1,0,1,0,1,0,0,1,0,0,1,0,0,0 };	// Data 0x08,Clock 0x72
+
+// Pad decode buffers by this much in case the sample buffer ends with a valid 'mark'
+// This MIGHT fail if the padded area happens to have a correct CRC
+#define	DECODE_PAD	(2*8*(MAX_SSIZE))
+
+typedef floppy8_sector_t sector_t;
+
+struct kernels;
+typedef int (*kernel_t)(floppy8_t *f, const sample_t *samples, unsigned int n);
+
+// sample timing of the capture being decoded
+typedef struct timing {
+	sample_t		two_us;		// ticks in 2us
+	sample_t		one_us;
+	sample_t		fm_split;
+	sample_t		mfm_lo;
+	sample_t		mfm_hi;
+	sample_t		m2fm_top;
+	const struct kernels	*kernels;	// specialised for this timing, NULL to use the generic ones
+} timing_t;
+
+// how a field that failed CRC was repaired
+typedef struct fix {
+	unsigned int	corrected;	// bits fixed from the CRC syndrome
+	unsigned int	reclassified;	// samples moved to a neighbouring cell width
+} fix_t;
+
+// Map positions in the decoded cell stream back to the sample that produced them.
+// Marks are found in increasing order, so a forward-only cursor is enough.
+// FM decodes one cell per sample, MFM expands each sample to 2, 3 or 4 cells, M2FM to 2-5.
+typedef struct cellmap {
+	const sample_t	*samples;
+	unsigned int	n;
+	int		format;		// TT_FM, TT_MFM or TT_M2FM
+	sample_t	split_lo;
+	sample_t	split_hi;
+	sample_t	split_top;	// M2FM only
+	unsigned int	sample;		// current sample
+	unsigned int	cell;		// first cell of current sample
+} cellmap_t;
+
+// decoder context
+struct floppy8 {
+	floppy8_config_t	cfg;
+	sector_t		disk[NTRACKS][NSIDES][NSECTORS];
+	unsigned int		last_track;	// last valid address field seen
+	unsigned int		last_side;
+	unsigned int		last_sector;
+	unsigned int		last_size;
+	cellmap_t		cellmap;
+	timing_t		timing;
+	floppy8_quality_t	quality;	// of the last track surveyed
+	unsigned int		sample_base;	// first sample of the revolution being decoded
+	unsigned int		scan_end;	// search for marks in samples before this one
+	unsigned int		mark_at;	// cell of the last data field, for its -v line
+	unsigned int		cell_base;	// cells of the track before the piece a worker decodes, for -v lines
+	bool			worker;		// decodes part of a track for another context, keeps no sectors
+	struct worker		*workers;	// parallel decode contexts, created on first use
+	unsigned int		nworkers;
+	uint8_t			seen[NSECTORS];	// track of each address field seen in this capture, NTRACKS if none
+	uint8_t			seen_side;	// and their side (a capture is of one head)
+	bool			learned;	// a whole revolution has been seen, so 'seen' is complete
+	bool			done;		// every expected sector is held, stop scanning
+	sample_t		*feed;		// samples collected by floppy8_feed()
+	unsigned int		nfeed;
+	uint16_t		*syndrome;	// CRC syndrome to error bit distance, built on first use
+	struct soft		*soft;		// soft decision retry buffers, allocated on first use
+	uint8_t			*decode;	// decoded cells, kept for the next track
+	size_t			decode_size;
+	struct chunk		*arena;		// sector data, reused by the next disk
+	uint8_t			field[4+MAX_SSIZE+2];	// data field being checked
+	uint8_t			sector_data[MAX_SSIZE];
+};
+
+static void *
+default_alloc(void *arg, size_t size)
+{
+	(void)arg;
+	return malloc(size);
+}
+
+static void
+default_release(void *arg, void *ptr)
+{
+	(void)arg;
+	free(ptr);
+}
+
+static inline void *
+f8_alloc(floppy8_t *f, size_t size)
+{
+	return f->cfg.alloc(f->cfg.alloc_arg,size);
+}
+
+static inline void
+f8_release(floppy8_t *f, void *ptr)
+{
+	if(ptr)
+		f->cfg.release(f->cfg.alloc_arg,ptr);
+}
+
+// Sector data comes from an arena of large chunks.  floppy8_reset() rewinds it, so after
+// the first disk no more memory is needed
+#define	CHUNK_SIZE	(64*1024)
+
+struct chunk {
+	struct chunk	*next;
+	size_t		used;
+	uint8_t		data[CHUNK_SIZE];
+};
+
+static inline uint8_t *
+arena_alloc(floppy8_t *f, const size_t size)
+{
+	struct chunk *c;
+
+	for(c=f->arena;c;c=c->next)
+		if( c->used+size <= CHUNK_SIZE )
+			break;
+	if( c==NULL ){
+		c = (struct chunk *)f8_alloc(f,sizeof(struct chunk));
+		if( c==NULL )
+			return NULL;
+		c->used = 0;
+		c->next = f->arena;
+		f->arena = c;
+		}
+	c->used += size;
+	return &c->data[c->used-size];
+}
+
+// grow the decode buffer if this track needs more than any before it
+static inline uint8_t *
+decode_buffer(floppy8_t *f, const size_t size)
+{
+	if( size > f->decode_size ){
+		f8_release(f,f->decode);
+		f->decode = (uint8_t *)f8_alloc(f,size);
+		f->decode_size = f->decode ? size : 0;
+		}
+	return f->decode;
+}
+
+// report a diagnostic message through the callback
+static void
+diag(floppy8_t *f, const int level, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	if( f->cfg.diag==NULL || (level==FLOPPY8_INFO && !f->cfg.verbose) )
+		return;
+	va_start(ap,fmt);
+	vsnprintf(msg,sizeof(msg),fmt,ap);
+	va_end(ap);
+	f->cfg.diag(f->cfg.arg,level,msg);
+}
+
+#define	error(f,...)	diag(f,FLOPPY8_ERROR,__VA_ARGS__)
+#define	info(f,...)	do{ if((f)->cfg.verbose) diag(f,FLOPPY8_INFO,__VA_ARGS__); }while(0)
+#define	info_if(v,f,...) do{ if(v) diag(f,FLOPPY8_INFO,__VA_ARGS__); }while(0)	// 'v' is a kernel constant
+
+// invalidate last known sector info
+static inline void
+sector_none(floppy8_t *f)
+{
+	f->last_track  = NTRACKS;
+	f->last_sector = NSECTORS;
+	f->last_side   = NSIDES;
+	f->last_size   = 0;
+}
+
+// start of a new capture: nothing seen yet
+static inline void
+capture_start(floppy8_t *f)
+{
+	memset(f->seen,NTRACKS,sizeof(f->seen));
+	f->seen_side = 0;
+	f->learned = false;
+	f->done    = false;
+}
+
+// Note the address field just decoded.  Seeing a sector for the second time means a
+// whole revolution has gone by, so the set of sectors on the track is known
+static inline void
+addr_seen(floppy8_t *f)
+{
+	if( f->last_track>=NTRACKS || f->last_side>=NSIDES || f->last_sector>=NSECTORS )
+		return;
+	if( f->seen[f->last_sector]!=NTRACKS )
+		f->learned = true;
+	f->seen[f->last_sector] = f->last_track;
+	f->seen_side = f->last_side;
+}
+
+// Count the sectors of this capture not yet held with a good CRC: those from 1 to
+// config.spt if set, otherwise every one from the lowest to the highest address field seen
+static inline unsigned int
+track_missing(const floppy8_t *f)
+{
+	unsigned int sector,lo = NSECTORS,hi = 0,track = NTRACKS,missing = 0;
+	const sector_t *s;
+
+	for(sector=0;sector<NSECTORS;sector++){
+		if( f->seen[sector]==NTRACKS )
+			continue;
+		if( lo==NSECTORS )
+			lo = sector;
+		hi = sector;
+		track = f->seen[sector];
+		}
+	if( track==NTRACKS )
+		return NSECTORS;	// nothing recognised yet
+	if( f->cfg.spt ){
+		lo = 1;
+		hi = (f->cfg.spt<NSECTORS) ? f->cfg.spt : NSECTORS-1;
+		}
+	for(sector=lo;sector<=hi;sector++){
+		s = &f->disk[track][f->seen_side][sector];
+		if( s->size==0 || s->corrected || s->reclassified )
+			missing++;
+		}
+	return missing;
+}
+
+// after each data field: stop scanning once every expected sector is held
+static inline void
+track_check(floppy8_t *f)
+{
+	if( !f->cfg.verify && (f->learned || f->cfg.spt) && track_missing(f)==0 ){
+		info(f,"All sectors held");
+		f->done = true;
+		}
+}
+
+static inline bool
+valid_size(const unsigned int size)
+{
+	unsigned int i;
+
+	for(i=0;i<NSIZES;i++){
+		if( size == (128u<<i) )
+			return true;
+		}
+	return false;
+}
+
+// add one sectors worth of data to the overall disk image, reporting it on one -v line
+// ("001440: DATA OK") with the cell 'at' its field was found
+// A clean read always replaces an earlier repaired one
+static inline int
+disk_add(floppy8_t *f, const int type, const unsigned int at, const unsigned int track, const unsigned int side, const unsigned int sector, const unsigned int size, const uint8_t *data, const fix_t *fix)
+{
+	const char *mark = (type==FLOPPY8_DATA) ? "DATA" : "DELD";
+	sector_t *s;
+	bool clean = fix->corrected==0 && fix->reclassified==0;
+
+	if( f->worker )
+		return FLOPPY8_GOOD;	// the owning context checks and keeps it
+	if(track>=NTRACKS || side>=NSIDES || sector>=NSECTORS || !valid_size(size) ){
+		info(f,"%06u: %s",at,mark);
+		error(f,"invalid params Track:%u Side:%u Sector:%u Size:%u",track,side,sector,size);
+		return FLOPPY8_BADPARAM;
+		}
+	s = &f->disk[track][side][sector];
+	if( s->size==0 && s->data == NULL ){	// first time seen
+		s->data = arena_alloc(f,size);
+		if( s->data==NULL ){
+			info(f,"%06u: %s",at,mark);
+			error(f,"out of memory");
+			return FLOPPY8_BADPARAM;
+			}
+		memcpy(s->data,data,size);
+		s->size = size;
+		s->corrected = fix->corrected;
+		s->reclassified = fix->reclassified;
+		}
+
+	if( s->size != size ){
+		info(f,"%06u: %s",at,mark);
+		error(f,"Inconsistent sector size");
+		return FLOPPY8_BADSIZE;
+		}
+	if( memcmp(s->data,data,s->size) != 0 ){
+		if( (s->corrected || s->reclassified) && clean ){
+			info(f,"%06u: %s OK, replaced repaired copy",at,mark);
+			memcpy(s->data,data,size);
+			s->corrected = s->reclassified = 0;
+			return FLOPPY8_GOOD;
+			}
+		info(f,"%06u: %s",at,mark);
+		error(f,clean ? "Inconsistent sector data" : "Inconsistent repaired sector data");
+		return FLOPPY8_MISMATCH;
+		}
+	if( clean )
+		s->corrected = s->reclassified = 0;	// confirmed by a clean read
+	if( fix->corrected )
+		info(f,"%06u: %s OK, corrected %u bit%s",at,mark,fix->corrected,(fix->corrected>1) ? "s" : "");
+	else if( fix->reclassified )
+		info(f,"%06u: %s OK, reclassified %u sample%s",at,mark,fix->reclassified,(fix->reclassified>1) ? "s" : "");
+	else
+		info(f,"%06u: %s OK",at,mark);
+	return FLOPPY8_GOOD;
+}
+
+static inline void
+cellmap_init(cellmap_t *m, const sample_t *samples, const unsigned int n, const int format, const sample_t split_lo, const sample_t split_hi,
+	const sample_t split_top)
+{
+	m->samples  = samples;
+	m->n        = n;
+	m->format   = format;
+	m->split_lo = split_lo;
+	m->split_hi = split_hi;
+	m->split_top = split_top;
+	m->sample   = 0;
+	m->cell     = 0;
+}
+
+// how many decoded cells does one sample expand to
+static inline unsigned int
+cellmap_width(const cellmap_t *m, const sample_t s)
+{
+	if( m->format==TT_FM )
+		return 1;
+	if( m->format==TT_M2FM && s>=m->split_top )
+		return 5;
+	if( s>=m->split_hi )
+		return 4;
+	if( s>=m->split_lo )
+		return 3;
+	return 2;
+}
+
+// advance the cursor to the sample containing 'cell', return the sample number
+static inline unsigned int
+cellmap_seek(cellmap_t *m, const unsigned int cell)
+{
+	unsigned int w;
+
+	if( m->format==TT_FM ){
+		m->sample = m->cell = (cell<m->n) ? cell : m->n;
+		return m->sample;
+		}
+	if( cell < m->cell ){	// going back, start over
+		m->sample = 0;
+		m->cell = 0;
+		}
+
+	while( m->sample < m->n ){
+		w = cellmap_width(m,m->samples[m->sample]);
+		if( m->cell+w > cell )
+			break;
+		m->cell += w;
+		m->sample++;
+		}
+	return m->sample;
+}
+
+// pass a decoded field to the sector callback
+static inline void
+report(floppy8_t *f, const int type, const unsigned int cell, const int status, const uint8_t *data, const fix_t *fix)
+{
+	floppy8_record_t r;
+
+	if( f->cfg.sector==NULL )
+		return;
+	r.type   = type;
+	r.status = status;
+	r.format = f->cellmap.format;
+	r.sample = f->sample_base + cellmap_seek(&f->cellmap,cell);
+	r.cell   = (r.format==TT_FM) ? f->timing.two_us : f->timing.one_us;
+	r.track  = f->last_track;
+	r.side   = f->last_side;
+	r.sector = f->last_sector;
+	r.size   = f->last_size;
+	r.data   = data;
+	r.corrected    = fix ? fix->corrected : 0;
+	r.reclassified = fix ? fix->reclassified : 0;
+	f->cfg.sector(f->cfg.arg,&r);
+}
+
+// Does a piece of decoded data match one of the special mark patterns?
+static inline bool
+mark_match (const uint8_t *s, const uint8_t *pat, const unsigned int len)
+{
+	unsigned int i;
+
+	for(i=0;i<len;i++)
+		if (s[i] != pat[i])
+			return false;
+	return true;
+}
+
+static inline unsigned short
+crc16_update (unsigned short crc, const uint8_t *buf, const unsigned int count)
+{
+	unsigned int i;
+	uint8_t x;
+
+	for(i=0; i<count; i++){
+		x = crc >> 8 ^ buf[i];
+		x ^= x >> 4;
+		crc = (crc << 8) ^ ((unsigned short) (x << 12)) ^ ((unsigned short) (x << 5)) ^ ((unsigned short) x);
+	}
+	return crc;
+}
+
+static inline unsigned short
+crc16 (const uint8_t *buf, const unsigned int count)
+{
+	return crc16_update(0xffff,buf,count);
+}
+
+// CRC error correction
+//
+// The CRC is linear, so the CRC of a field with error bits e is CRC(field) ^ CRC0(e), where
+// CRC0 starts from zero instead of 0xFFFF.  A good field has CRC zero, so a bad field's CRC
+// (its syndrome) depends only on the error bits.  For a single bit error, it depends only on
+// the distance from the bad bit to the end of the field, not on the field length, so one
+// table mapping syndrome to distance serves every sector size.  The polynomial has period
+// 32767, longer than any field, so each single bit error has a unique syndrome.
+//
+// Two bit errors are found by trying each first bit and looking up the remainder.  With
+// 65536 syndromes and thousands of bits there are many false pairs, so this is a separate
+// correction level, only pairs within CORRECT_SPAN bits of each other are tried and the
+// answer must be unique.  Even so, a badly damaged field has a fair chance of a wrong
+// match (about one in 8 for a single bit in a 1024 byte sector), so corrected sectors
+// are always flagged.
+
+#define	CRC_POLY	0x1021
+#define	CRC_PERIOD	32767		// x**n mod poly repeats after this many bits
+#define	NO_SYNDROME	0xFFFF		// table entry for syndromes that are not a single bit
+#define	CORRECT_SPAN	8		// max distance between the 2 bits of a double bit error
+
+// shift one zero bit into a CRC register
+static inline uint16_t
+crc_shift(const uint16_t crc)
+{
+	return (crc & 0x8000) ? (uint16_t)((crc<<1) ^ CRC_POLY) : (uint16_t)(crc<<1);
+}
+
+static inline bool
+syndrome_init(floppy8_t *f)
+{
+	unsigned int d;
+	uint16_t crc;
+
+	if( f->syndrome )
+		return true;
+	f->syndrome = (uint16_t *)f8_alloc(f,sizeof(uint16_t)*65536);
+	if( f->syndrome==NULL )
+		return false;
+	for(d=0;d<65536;d++)
+		f->syndrome[d] = NO_SYNDROME;
+	crc = CRC_POLY;		// a 1 bit followed by d zero bits
+	for(d=0;d<CRC_PERIOD;d++){
+		f->syndrome[crc] = d;
+		crc = crc_shift(crc);
+		}
+	return true;
+}
+
+// flip the bit 'd' bits from the end of buf
+static inline void
+bit_flip(uint8_t *buf, const unsigned int len, const unsigned int d)
+{
+	buf[len-1-d/8] ^= 1<<(d%8);
+}
+
+// Try to fix a field that failed CRC.  The first 'fixed' bytes (the mark) are known good.
+// Return the number of bits corrected, or zero if the field could not be fixed.
+static inline unsigned int
+crc_correct(floppy8_t *f, uint8_t *buf, const unsigned int len, const unsigned int fixed)
+{
+	unsigned int nbits = (len-fixed)*8;
+	unsigned int d1,d2,found = 0,fix1 = 0,fix2 = 0;
+	uint16_t syn = crc16(buf,len);
+	uint16_t s1;
+
+	if( f->cfg.correct==0 || syn==0 || !syndrome_init(f) )
+		return 0;
+
+	d1 = f->syndrome[syn];
+	if( d1<nbits ){
+		bit_flip(buf,len,d1);
+		return 1;
+		}
+	if( f->cfg.correct<2 )
+		return 0;
+
+	s1 = CRC_POLY;
+	for(d1=0;d1<nbits;d1++,s1=crc_shift(s1)){
+		d2 = f->syndrome[syn^s1];
+		if( d2>d1 && d2<nbits && d2-d1<=CORRECT_SPAN ){
+			if( ++found>1 )
+				return 0;	// ambiguous
+			fix1 = d1;
+			fix2 = d2;
+			}
+		}
+	if( found!=1 )
+		return 0;
+	bit_flip(buf,len,fix1);
+	bit_flip(buf,len,fix2);
+	return 2;
+}
+
+// Given a sample value in ticks, return which microsecond bucket it falls into
+static inline unsigned int
+sample_to_us (const timing_t *t, sample_t s)
+{
+	unsigned int us = (s + (t->one_us / 2)) / t->one_us;
+
+	return (us < MAX_US) ? us : MAX_US - 1;
+}
+
+// Signal quality.  With config.quality the format histogram pass also sorts samples into
+// fine bins of 1/64 of 2us (about 31ns), and the statistics are worked out from the bins
+// once the format is known.  Bins are counted from zero, so 2us is bin 64
+#define	QBINS_2US	64
+#define	QBINS		(3*QBINS_2US)		// up to 6us
+#define	QBIN_NS		(2000.0/QBINS_2US)
+#define	QBIN_US(x)	((unsigned int)((x)*QBINS_2US/2))
+#define	QAMBIGUOUS	(QBINS_2US/16)		// 1/8us either side of a split
+#define	QDEVS		(QBINS_2US/2)		// most bins from a nominal width, inside 1.5-4.5us
+
+// nominal width (as a QBINS index) of the peak a bin belongs to, or QBINS for an outlier.
+// M2FM is measured as MFM, its 5us pulses counting as outliers
+static inline unsigned int
+quality_peak(const unsigned int b, const int format)
+{
+	if( b<QBIN_US(1.5) || b>=QBIN_US(4.5) )
+		return QBINS;
+	if( format==TT_FM )
+		return (b<QBIN_US(3)) ? QBIN_US(2) : QBIN_US(4);
+	return (b<QBIN_US(2.5)) ? QBIN_US(2) : (b<QBIN_US(3.5)) ? QBIN_US(3) : QBIN_US(4);
+}
+
+// quality.peak_* slot of a nominal width: 2, 3 and 4us are 0, 1 and 2
+static inline unsigned int
+quality_index(const unsigned int nb)
+{
+	return (nb-QBIN_US(2))/(QBINS_2US/2);
+}
+
+// is bin 'b' within 1/8us of the split at bin 'split'?
+static inline bool
+quality_near(const unsigned int b, const unsigned int split)
+{
+	return b+QAMBIGUOUS>=split && b<split+QAMBIGUOUS;
+}
+
+// 'p' percentile of the deviation histogram, in ns
+static inline double
+quality_percentile(const unsigned int *devs, const unsigned int total, const double p)
+{
+	unsigned int d,sum = 0;
+
+	for(d=0;d<QDEVS;d++){
+		sum += devs[d];
+		if( sum>=p*total )
+			break;
+		}
+	return (d+0.5)*QBIN_NS;
+}
+
+// work out the quality of a track from its fine histogram
+static inline void
+quality_set(floppy8_t *f, const unsigned int *bins, const unsigned int n, const unsigned int clamped, const int format)
+{
+	floppy8_quality_t *q = &f->quality;
+	unsigned int devs[QDEVS];
+	unsigned int b,k,nb,total = 0,ambiguous = 0;
+	double c;
+
+	memset(q,0,sizeof(*q));
+	memset(devs,0,sizeof(devs));
+	q->format  = format;
+	q->samples = n;
+	q->clamped = clamped;
+	for(b=0;b<QBINS;b++){
+		if( bins[b]==0 )
+			continue;
+		nb = quality_peak(b,format);
+		if( nb==QBINS ){
+			q->outliers += bins[b];
+			continue;
+			}
+		k = quality_index(nb);
+		q->peak_count[k] += bins[b];
+		q->peak_mean[k]  += bins[b]*(b+0.5)*QBIN_NS;
+		devs[(b>=nb) ? b-nb : nb-b-1] += bins[b];
+		total += bins[b];
+		if( format==TT_FM ? quality_near(b,QBIN_US(3)) : quality_near(b,QBIN_US(2.5)) || quality_near(b,QBIN_US(3.5)) )
+			ambiguous += bins[b];
+		}
+	for(k=0;k<3;k++)
+		if( q->peak_count[k] )
+			q->peak_mean[k] /= q->peak_count[k];
+	for(b=QBIN_US(1.5);b<QBIN_US(4.5);b++){
+		nb = quality_peak(b,format);
+		k = quality_index(nb);
+		c = (b+0.5)*QBIN_NS-q->peak_mean[k];
+		q->peak_sd[k] += bins[b]*c*c;
+		}
+	for(k=0;k<3;k++)
+		if( q->peak_count[k] )
+			q->peak_sd[k] = sqrt(q->peak_sd[k]/q->peak_count[k]);
+	if( total ){
+		q->jitter_p50 = quality_percentile(devs,total,0.50);
+		q->jitter_p95 = quality_percentile(devs,total,0.95);
+		q->jitter_p99 = quality_percentile(devs,total,0.99);
+		}
+	q->ambiguous = n ? (double)ambiguous/n : 0.0;
+}
+
+// Encoding engines, one per format.  A track is looked at once to pick its engine, then only
+// that engine's kernel decodes it.  Each engine knows which pulse widths its encoding writes,
+// which of the others count against it (noise shows at 1, 3 and 5us alike, so FM only counts
+// 3us, as it always has), and may know a run of cells that marks its tracks, such as MFM's A1
+// sync bytes with their missing clock pulse.  M2FM marks are also legal MFM, so its address
+// mark is only looked for once MFM is ruled out.  The engines are in order of the widths they
+// allow, fewest first, and a track is given the first whose sync cells turn up, or that finds
+// few enough foreign samples; M2FM needs its marks.  With none of those, MFM is tried, and an
+// engine that finds no address fields hands the track on to the next (see format_retry()).
+// The kernels here read the splits from the context, see Kernels[] for specialised ones
+static int fm_any(floppy8_t *f, const sample_t *s, unsigned int n);
+static int fm_any_v(floppy8_t *f, const sample_t *s, unsigned int n);
+static int mfm_any(floppy8_t *f, const sample_t *s, unsigned int n);
+static int mfm_any_v(floppy8_t *f, const sample_t *s, unsigned int n);
+static int m2fm_any(floppy8_t *f, const sample_t *s, unsigned int n);
+static int m2fm_any_v(floppy8_t *f, const sample_t *s, unsigned int n);
+
+#define	US(x)	(1u << (x))
+
+typedef struct engine {
+	const char	*name;
+	unsigned int	widths;		// US() of each pulse width written
+	unsigned int	counted;	// US() of the foreign widths counted, 0 if only its sync cells will do
+	unsigned int	foreign;	// most foreign samples, per 1000, in a track of this format
+	uint64_t	sync;		// 1us cells only this encoding writes, ending in a pulse
+	unsigned int	sync_cells;	// 0 if there are none
+	kernel_t	k[2];		// [verbose]
+} engine_t;
+
+static const engine_t Engines[NENGINES] = {		// by format-1
+	{ "FM",   US(2)|US(4),             US(3),       50, 0,                 0,  { fm_any, fm_any_v } },	// 3us only in noise
+	{ "MFM",  US(2)|US(3)|US(4),       ~0u<<5,      1,  0x448944894489ull, 48, { mfm_any, mfm_any_v } },	// A1 A1 A1
+	{ "M2FM", US(2)|US(3)|US(4)|US(5), 0,           0,  0x0A95ull,         14, { m2fm_any, m2fm_any_v } },	// address mark
+};
+
+// Histogram the samples, deciding the format if it is not given (zero).  Returns the format.
+// Only the first DETECT_SAMPLES are needed to decide, and they are looked at once, for every
+// engine together.  The rest are only counted for the -v histogram
+static inline int
+track_survey (floppy8_t *f, const sample_t *samples, const unsigned int n, int format)
+{
+	unsigned int i,e,us;
+	unsigned int histogram[MAX_US];
+	unsigned int syncs[NENGINES];
+	unsigned int bins[QBINS];
+	unsigned int b,clamped = 0;
+	unsigned int foreign,m = (n<DETECT_SAMPLES) ? n : DETECT_SAMPLES;
+	const unsigned int two_us = f->timing.two_us;
+	uint64_t cells = 0;	// the last 64 cells, a pulse every 'us'
+
+	if( n==0 )
+		return FLOPPY8_EFORMAT;
+	if( f->cfg.quality ){
+		memset(bins,0,sizeof(bins));
+		for (i = 0; i < n; i++){
+			b = ((unsigned int)samples[i]*QBINS_2US)/two_us;
+			bins[(b<QBINS) ? b : QBINS-1]++;
+			clamped += (samples[i]==SAMPLE_MAX);
+			}
+		}
+	if( format==0 ){
+		memset(histogram,0,sizeof(histogram));
+		memset(syncs,0,sizeof(syncs));
+		for (i = 0; i < m; i++){
+			us = sample_to_us(&f->timing,samples[i]);
+			histogram[us]++;
+			cells = (cells << us) | 1;
+			for(e=0;e<NENGINES;e++)
+				if( Engines[e].sync_cells )
+					syncs[e] += ((cells ^ Engines[e].sync) & (~0ull >> (64-Engines[e].sync_cells)))==0;
+			}
+
+		for(e=0;e<NENGINES;e++){
+			foreign = 0;
+			for(us=0;us<MAX_US;us++)
+				if( Engines[e].counted & US(us) )
+					foreign += histogram[us];
+			if( syncs[e] || (Engines[e].counted && (foreign * 1000) / m <= Engines[e].foreign) )
+				break;
+			}
+		format = (e<NENGINES) ? TT_FM+e : TT_MFM;
+
+		if( f->cfg.verbose ){	// but -v shows the whole track
+			for (i = m; i < n; i++)
+				histogram[sample_to_us(&f->timing,samples[i])]++;
+			}
+		info(f,"Histogram:");
+		for(i=0;i<MAX_US;i++)
+			info(f,"%2u: %u",i,histogram[i]);
+		info(f,"Track Format: %s", Engines[format-TT_FM].name);
+		}
+	if( f->cfg.quality )
+		quality_set(f,bins,n,clamped,format);
+	return format;
+}
+
+// Look at samples and decide how they are encoded
+// FM has 2 peaks at 2us and 4us.  MFM has peaks at 2, 3 and 4us, M2FM also at 5us.
+// If there are more than about 5% of the samples at 3us, its not FM.  If there are MFM
+// sync marks, or hardly any samples at 5us, its MFM.  If there are M2FM address marks, its
+// M2FM, otherwise MFM is the best guess.
+int
+floppy8_format (floppy8_t *f, const sample_t *samples, const unsigned int n)
+{
+	return track_survey(f,samples,n,0);
+}
+
+// name of a track format, as FLOPPY8_FM etc.
+const char *
+floppy8_format_name (const int format)
+{
+	if( format<TT_FM || format>=TT_FM+NENGINES )
+		return "unknown";
+	return Engines[format-TT_FM].name;
+}
+
+static inline void
+mark_used(uint8_t *buf, unsigned int count, char tag)
+{
+	unsigned int i;
+
+	for(i=0;i<count;i++)
+		buf[i] = tag;
+}
+
+// The track layouts above put fields a known distance apart, so most gap cells need not be
+// searched for marks.  After an address field the data mark is one gap 2 later, after a data
+// field the next address mark is at least a short gap 3 later.  The scan jumps over most of
+// the gap, and if no mark turns up within a window after that, goes back and searches it all.
+typedef struct gap {
+	unsigned int	from;		// end of the last field, where a missed search restarts
+	unsigned int	limit;		// a mark should have been found before here, 0 if not skipping
+} gap_t;
+
+// FM gap FF bytes are 16 cells, 00 bytes 8 cells
+#define	FM_GAP2_SKIP	(8*16)		// of 11 FF + 6 00
+#define	FM_GAP2_WINDOW	(10*16)
+#define	FM_GAP3_SKIP	(8*16)		// gap 3 is at least 14 FF + 6 00
+#define	FM_GAP3_WINDOW	(160*16)
+
+// MFM bytes are always 16 cells
+#define	MFM_GAP2_SKIP	(16*16)		// of 22 4E + 12 00
+#define	MFM_GAP2_WINDOW	(32*16)
+#define	MFM_GAP3_SKIP	(16*16)		// gap 3 is at least 24 4E + 12 00
+#define	MFM_GAP3_WINDOW	(160*16)
+
+// M2FM bytes are 16 cells, in FM sized gaps
+#define	M2FM_GAP2_SKIP	(8*16)		// of 11 4E + 6 00
+#define	M2FM_GAP2_WINDOW	(10*16)
+#define	M2FM_GAP3_SKIP	(8*16)		// gap 3 is at least 14 4E + 6 00
+#define	M2FM_GAP3_WINDOW	(160*16)
+
+// a field ended at 'end', return how many cells to jump over
+static inline unsigned int
+gap_skip(gap_t *g, const unsigned int end, const unsigned int skip, const unsigned int window)
+{
+	g->from  = end;
+	g->limit = end+skip+window;
+	return skip;
+}
+
+// Return the cell to search next: 'i', or the start of the gap if the layout prediction missed
+static inline unsigned int
+gap_check(gap_t *g, const unsigned int i)
+{
+	if( g->limit==0 || i<g->limit )
+		return i;
+	g->limit = 0;
+	return g->from;
+}
+
+// fetch an FM encoded byte, return value, update buf pointer
+static inline uint8_t
+fm_fetch_byte (uint8_t ** buf)
+{
+	unsigned int i;
+	unsigned int byte = 0;
+	uint8_t *p = *buf;
+
+	for (i = 0; i < 8; i++) {
+		byte <<= 1;
+		byte |= *p;
+		if( p[0]==1 && p[1]==1 )
+			p += 2;
+		else
+			p += 1;
+	}
+	*buf = p;
+	return byte;
+}
+
+// fetch bytes from in, save to out, return updated in ptr
+static inline uint8_t *
+fm_fetch_bytes (uint8_t * in, uint8_t *out, unsigned int count)
+{
+	unsigned int i;
+
+	for(i=0;i<count;i++)
+		out[i] = fm_fetch_byte(&in);
+	return in;
+}
+
+// Convert pairs of mfm bits to final values: 00->0, 01->1, 10->0, 11->invalid
+// The RLL expansion always follows a 1 with at least one 0, so 11 cannot happen
+static inline uint8_t
+mfm_fetch_bit(uint8_t *buf)
+{
+	unsigned int pair = (buf[0]<<1)+(buf[1]<<0);
+
+	return pair==1;
+}
+
+// fetch an MFM encoded byte, return value, update buf pointer
+static inline uint8_t
+mfm_fetch_byte (uint8_t ** buf)
+{
+	unsigned int i;
+	unsigned int byte = 0;
+	uint8_t *p = *buf;
+
+	for (i = 0; i < 8; i++) {
+		byte <<= 1;
+		byte |= mfm_fetch_bit(p);
+		p += 2;
+	}
+	*buf = p;
+	return byte;
+}
+
+static inline uint8_t *
+mfm_fetch_bytes (uint8_t * in, uint8_t *out, unsigned int count)
+{
+	unsigned int i;
+
+	for(i=0;i<count;i++)
+		out[i] = mfm_fetch_byte(&in);
+	return in;
+}
+
+// The FM field handlers below also serve M2FM, which has the same single byte marks and
+// fields, with bytes in MFM's clock and data cells
+static inline uint8_t *
+fm_fetch_field (const int format, uint8_t * in, uint8_t *out, unsigned int count)
+{
+	return (format==TT_M2FM) ? mfm_fetch_bytes(in,out,count) : fm_fetch_bytes(in,out,count);
+}
+
+// cells in a mark
+static inline unsigned int
+fm_mark_cells (const int format)
+{
+	return (format==TT_M2FM) ? sizeof(M2FM_addr_mark) : sizeof(FM_addr_mark);
+}
+
+// Examine an address mark and see if it is valid.  Return the number of input bytes consumed
+// and fill in track,sector,side,ssize if true
+static inline unsigned int
+fm_valid_addr (const int format, uint8_t *buf, unsigned int *track, unsigned int *side, unsigned int *sector, unsigned int *size)
+{
+	uint8_t *bufend;
+	uint8_t addr[1+4+2];	// Address mark, Track, Side, Sector, Size, 2 CRC
+
+	addr[0] = (format==TT_M2FM) ? 0x0E : 0xFE;
+	bufend = fm_fetch_field (format, buf, &addr[1], 6);
+	if (crc16 (addr, sizeof (addr)) != 0)
+		return 0;
+	if( addr[1] >= NTRACKS )
+		return 0;
+	if( addr[2] >= NSIDES )
+		return 0;
+	if( addr[3] >= NSECTORS )
+		return 0;
+	if (addr[4] >= NSIZES)
+		return 0;	// invalid ssize code
+
+	*track  = addr[1];
+	*side   = addr[2]; // always 0 for SA-800
+	*sector = addr[3];
+	*size   = 128 << addr[4];
+	return bufend-buf;
+}
+
+static unsigned int soft_retry(floppy8_t *f, const unsigned int cell, uint8_t *data, const unsigned int nfixed, const unsigned int nfetch);
+
+// Examine the data field starting at buf[i] and see if its CRC is valid (or can be made valid).
+// Return the number of input bytes consumed and fill in the sector data and any repair made
+static inline unsigned int
+fm_valid_data (floppy8_t *f, const int format, uint8_t *buf, const unsigned int i, const uint8_t mark, unsigned int sector_size, uint8_t *sector_data, fix_t *fix)
+{
+	uint8_t *bufend;
+	uint8_t *data = f->field;	// Data mark, data bytes, 2 CRC
+
+	if(sector_size>MAX_SSIZE)
+		return 0;
+	data[0] = mark;
+
+	bufend = fm_fetch_field (format, &buf[i], &data[1], sector_size+2);
+	fix->corrected = fix->reclassified = 0;
+	if (crc16 (data, 1 + sector_size + 2) != 0){
+		if( !valid_size(sector_size) )
+			return 0;
+		fix->corrected = crc_correct(f,data,1 + sector_size + 2,1);
+		if( fix->corrected==0 )
+			fix->reclassified = soft_retry(f,i,data,1,sector_size+2);
+		if( fix->corrected==0 && fix->reclassified==0 )
+			return 0;
+		}
+	memcpy(sector_data,&data[1],sector_size);
+	return bufend-&buf[i];
+}
+
+KERNEL unsigned int
+fm_indx(floppy8_t *f, const int format, uint8_t *buf, unsigned int i, const bool verbose)
+{
+	(void)buf;
+	info_if(verbose,f,"%06u: INDX",f->cell_base+i);
+	sector_none(f);
+	report(f,FLOPPY8_INDX,i-fm_mark_cells(format),FLOPPY8_GOOD,NULL,NULL);
+	return 0;
+}
+
+KERNEL unsigned int
+fm_addr(floppy8_t *f, const int format, uint8_t *buf, unsigned int i, const bool verbose)
+{
+	unsigned int consumed = fm_valid_addr(format,&buf[i],&f->last_track,&f->last_side,&f->last_sector,&f->last_size);
+
+	if( consumed ){
+		info_if(verbose,f,"%06u: ADDR Track:%02u Side:%u Sector:%02u Size:%u",f->cell_base+i,f->last_track,f->last_side,f->last_sector,f->last_size);
+		addr_seen(f);
+		report(f,FLOPPY8_ADDR,i-fm_mark_cells(format),FLOPPY8_GOOD,NULL,NULL);
+		}
+	else
+		sector_none(f);
+	return consumed;
+}
+
+// DATA and DELD fields only differ in their mark, which the CRC covers
+KERNEL unsigned int
+fm_data(floppy8_t *f, const int format, uint8_t *buf, unsigned int i, const int type)
+{
+	uint8_t	*sector_data = f->sector_data;
+	const uint8_t mark = (format==TT_M2FM) ? ((type==FLOPPY8_DATA) ? 0x0B : 0x08) : ((type==FLOPPY8_DATA) ? 0xFB : 0xF8);
+	fix_t fix;
+	unsigned int consumed = fm_valid_data(f,format,buf,i,mark,f->last_size,sector_data,&fix);
+	int status;
+
+	if( consumed ){
+		f->mark_at = f->cell_base+i;
+		status = disk_add(f,type,f->mark_at,f->last_track,f->last_side,f->last_sector,f->last_size,sector_data,&fix);
+		report(f,type,i-fm_mark_cells(format),status,sector_data,&fix);
+		track_check(f);
+		sector_none(f);
+		}
+	return consumed;
+}
+
+KERNEL int
+fm_kernel (floppy8_t *f, const sample_t *samples, const unsigned int n, const sample_t split, const bool verbose)
+{
+	unsigned int i;
+	unsigned int consumed,skip;
+	unsigned int scan;		// marks start before this cell
+	gap_t gap;
+	uint8_t	*decode = decode_buffer(f,n+DECODE_PAD);		// decoded stream is the same size as samples
+
+	if( decode==NULL )
+		return FLOPPY8_ENOMEM;
+	cellmap_init(&f->cellmap,samples,n,TT_FM,split,split,split);
+
+	// Convert sample us to just 0/1
+	for (i = 0; i < n; i++)
+		decode[i] = (samples[i] < split) ? 1 : 0;
+	for(i=0;i<DECODE_PAD;i++)
+		decode[n+i] = 0;
+	scan = (f->scan_end<n) ? f->scan_end : n;
+
+	// Identify index/addr/data areas and extract
+	gap.limit = 0;
+	for (i = 0; i < scan && !f->done; i++) {
+		i = gap_check(&gap,i);
+		skip = 0;
+		if( mark_match (&decode[i], FM_indx_mark, sizeof (FM_indx_mark))){
+			(void)fm_indx(f,TT_FM,decode,i+sizeof(FM_indx_mark),verbose);	// just to print
+			consumed = sizeof(FM_indx_mark);
+			mark_used(&decode[i],consumed,'I');
+			}
+		else if( mark_match (&decode[i], FM_addr_mark, sizeof (FM_addr_mark))){
+			consumed = fm_addr(f,TT_FM,decode,i+sizeof(FM_addr_mark),verbose);
+			if( consumed ){
+				consumed += sizeof(FM_addr_mark);
+				mark_used(&decode[i],consumed,'A');
+				skip = gap_skip(&gap,i+consumed,FM_GAP2_SKIP,FM_GAP2_WINDOW);
+				}
+			}
+		else if( mark_match (&decode[i], FM_data_mark, sizeof (FM_data_mark))){
+			consumed = fm_data(f,TT_FM,decode,i+sizeof(FM_data_mark),FLOPPY8_DATA);
+			if( consumed ){
+				consumed += sizeof(FM_data_mark);
+				mark_used(&decode[i],consumed,'D');
+				skip = gap_skip(&gap,i+consumed,FM_GAP3_SKIP,FM_GAP3_WINDOW);
+				}
+			}
+		else if( mark_match (&decode[i], FM_deld_mark, sizeof (FM_deld_mark))){
+			consumed = fm_data(f,TT_FM,decode,i+sizeof(FM_deld_mark),FLOPPY8_DELD);
+			if( consumed ){
+				consumed += sizeof(FM_deld_mark);
+				mark_used(&decode[i],consumed,'d');
+				skip = gap_skip(&gap,i+consumed,FM_GAP3_SKIP,FM_GAP3_WINDOW);
+				}
+			}
+		else
+			consumed = 0;
+		if( consumed && skip==0 )
+			gap.limit = 0;		// found what was expected
+		i += consumed+skip;
+	}
+	return FLOPPY8_OK;
+}
+
+// Soft decision retry
+//
+// Each sample is classified once by comparing it to the split(s) between the nominal
+// pulse widths.  A sample close to a split could easily be the other width, and one wrong
+// call ruins the field.  When a data field fails CRC, the samples of that field closest to
+// a split are found, and the field is decoded again with each of them (then each pair)
+// moved to the other side of its split, up to SOFT_BUDGET attempts.  Only the cells from
+// the first changed sample onward are expanded again, and the CRC carries on from the
+// value saved at the first byte those cells affect.
+
+#define	SOFT_CANDIDATES	12	// least certain samples to try
+#define	SOFT_BUDGET	78	// most attempts per field (12 singles + 66 pairs)
+#define	SOFT_BYTES	(4+MAX_SSIZE+2)	// longest field
+#define	SOFT_CELLS	(SOFT_BYTES*16+64)	// a byte is at most 16 cells, plus slack
+
+struct soft {
+	uint8_t		cells[SOFT_CELLS+DECODE_PAD];
+	unsigned int	cstart[SOFT_CELLS];	// first cell of each sample
+	uint8_t		flip[SOFT_CELLS];	// sample is reclassified
+	unsigned int	bstart[SOFT_BYTES+1];	// first cell of each byte
+	unsigned short	crc[SOFT_BYTES+1];	// CRC before each byte
+	uint8_t		base[SOFT_BYTES];	// field bytes as first decoded
+	unsigned int	nsamples;		// samples expanded
+	unsigned int	ncells;
+	unsigned int	end;			// expand until at least this many cells
+};
+
+// how far is a sample from the nearest split
+static inline unsigned int
+soft_distance(const cellmap_t *m, const sample_t s)
+{
+	unsigned int lo = (s>m->split_lo) ? s-m->split_lo : m->split_lo-s;
+	unsigned int hi = (s>m->split_hi) ? s-m->split_hi : m->split_hi-s;
+	unsigned int top = (s>m->split_top) ? s-m->split_top : m->split_top-s;
+
+	if( m->format==TT_M2FM && top<lo && top<hi )
+		return top;
+	return (lo<hi) ? lo : hi;
+}
+
+// cells for one sample, reclassified to the other side of its nearest split if flip is set
+static inline unsigned int
+soft_width(const cellmap_t *m, const sample_t s, const bool flip)
+{
+	unsigned int w = cellmap_width(m,s);
+
+	if( !flip )
+		return w;
+	if( m->format==TT_FM )
+		return 1;
+	if( w==3 )
+		return (s-m->split_lo < m->split_hi-s) ? 2 : 4;
+	if( w==4 && m->format==TT_M2FM )
+		return (s-m->split_hi < m->split_top-s) ? 3 : 5;
+	return (w==5) ? 4 : 3;
+}
+
+// expand samples from k0+j onward into cells, starting at cstart[j]
+static inline void
+soft_expand(const cellmap_t *m, struct soft *sp, const unsigned int k0, unsigned int j)
+{
+	unsigned int c = sp->cstart[j];
+	unsigned int w;
+	sample_t s;
+
+	for(;c<sp->end && k0+j<m->n && j<SOFT_CELLS-1;j++){
+		s = m->samples[k0+j];
+		sp->cstart[j] = c;
+		if( m->format==TT_FM ){
+			sp->cells[c++] = (s < m->split_lo) ^ sp->flip[j];
+			continue;
+			}
+		w = soft_width(m,s,sp->flip[j]);
+		sp->cells[c++] = 1;
+		while( --w )
+			sp->cells[c++] = 0;
+		}
+	sp->cstart[j] = c;
+	sp->nsamples = j;
+	sp->ncells = c;
+	memset(&sp->cells[c],0,SOFT_CELLS+DECODE_PAD-c);
+}
+
+// fetch bytes b.. of a field, return the final CRC
+static inline unsigned short
+soft_fetch(const cellmap_t *m, struct soft *sp, unsigned int b, uint8_t *data, const unsigned int nfetch, const bool save)
+{
+	uint8_t *p = &sp->cells[sp->bstart[b]];
+	unsigned short crc = sp->crc[b];
+
+	for(;b<nfetch;b++){
+		if(save){
+			sp->bstart[b] = p-sp->cells;
+			sp->crc[b] = crc;
+			}
+		data[b] = (m->format==TT_FM) ? fm_fetch_byte(&p) : mfm_fetch_byte(&p);
+		crc = crc16_update(crc,&data[b],1);
+		}
+	if(save)
+		sp->bstart[b] = p-sp->cells;
+	return crc;
+}
+
+// Reclassify samples j1 and j2 (may be the same), fetch the changed bytes and check the CRC.
+// Leave the data in place if it is good, otherwise put the samples back
+static inline bool
+soft_try(floppy8_t *f, struct soft *sp, const unsigned int k0, const unsigned int j1, const unsigned int j2, uint8_t *fetched, const unsigned int nfetch)
+{
+	const cellmap_t *m = &f->cellmap;
+	unsigned int first = (j1<j2) ? j1 : j2;
+	unsigned int b0;
+
+	sp->flip[j1] = sp->flip[j2] = 1;
+	soft_expand(m,sp,k0,first);
+
+	// bytes entirely before the first changed cell are unchanged (FM looks one cell ahead)
+	for(b0=0;b0<nfetch && sp->bstart[b0+1]+1<sp->cstart[first];b0++)
+		;
+	if( soft_fetch(m,sp,b0,fetched,nfetch,false)==0 ){
+		memcpy(fetched,sp->base,b0);	// earlier tries may have left other bytes here
+		info(f,"Soft retry reclassified sample %u%s",k0+j1,(j1==j2) ? "" : " and another");
+		return true;
+		}
+	sp->flip[j1] = sp->flip[j2] = 0;
+	soft_expand(m,sp,k0,first);
+	return false;
+}
+
+// Decode a field again with some samples reclassified.  data[0..nfixed) holds known bytes
+// (the FM mark), the other nfetch bytes start at 'cell' in the decode buffer.
+// Return the number of samples reclassified to get a good CRC, or zero
+static unsigned int
+soft_retry(floppy8_t *f, const unsigned int cell, uint8_t *data, const unsigned int nfixed, const unsigned int nfetch)
+{
+	cellmap_t *m = &f->cellmap;
+	struct soft *sp = f->soft;
+	unsigned int cand[SOFT_CANDIDATES];
+	unsigned int dist[SOFT_CANDIDATES];
+	unsigned int ncand = 0;
+	unsigned int k0,j,a,b,tries = 0;
+	uint8_t *fetched = &data[nfixed];
+	unsigned int d;
+
+	if( !f->cfg.soft || nfetch>SOFT_BYTES )
+		return 0;
+	if( sp==NULL ){
+		sp = f->soft = (struct soft *)f8_alloc(f,sizeof(struct soft));
+		if( sp==NULL )
+			return 0;
+		}
+
+	// expand the field the same way as the full decode did
+	k0 = cellmap_seek(m,cell);
+	memset(sp->flip,0,sizeof(sp->flip));
+	sp->cstart[0] = 0;
+	sp->end = (cell-m->cell) + nfetch*16 + 16;	// reclassifying may shorten the field a little
+	soft_expand(m,sp,k0,0);
+	sp->bstart[0] = cell-m->cell;
+	sp->crc[0] = crc16_update(0xffff,data,nfixed);
+	if( soft_fetch(m,sp,0,fetched,nfetch,true)==0 )
+		return 0;	// nothing to do?
+	memcpy(sp->base,fetched,nfetch);
+
+	// find the least certain samples of the field
+	for(j=0;j<sp->nsamples && sp->cstart[j]<sp->bstart[nfetch];j++){
+		d = soft_distance(m,m->samples[k0+j]);
+		for(a=ncand;a>0 && dist[a-1]>d;a--){
+			if( a<SOFT_CANDIDATES ){
+				cand[a] = cand[a-1];
+				dist[a] = dist[a-1];
+				}
+			}
+		if( a<SOFT_CANDIDATES ){
+			cand[a] = j;
+			dist[a] = d;
+			if( ncand<SOFT_CANDIDATES )
+				ncand++;
+			}
+		}
+
+	// single samples, then pairs, most likely first
+	for(a=0;a<ncand && tries<SOFT_BUDGET;a++,tries++)
+		if( soft_try(f,sp,k0,cand[a],cand[a],fetched,nfetch) )
+			return 1;
+	for(a=0;a<ncand;a++)
+	for(b=a+1;b<ncand && tries<SOFT_BUDGET;b++,tries++)
+		if( soft_try(f,sp,k0,cand[a],cand[b],fetched,nfetch) )
+			return 2;
+	return 0;
+}
+
+// Examine an address mark and see if it is valid.  Return number of consumed input bytes
+// and fill in track,sector,side,ssize if true
+static inline unsigned int
+mfm_valid_addr (uint8_t *buf, unsigned int *track, unsigned int *side, unsigned int *sector, unsigned int *size)
+{
+	uint8_t *bufend;
+	uint8_t addr[4+4+2];	// Address mark, Track, Side, Sector, Size, 2 CRC
+
+	bufend = mfm_fetch_bytes (buf, addr, sizeof(addr));
+	if ( crc16 (addr, sizeof(addr)) != 0)
+		return 0;
+	if( addr[4] >= NTRACKS )
+		return 0;
+	if( addr[5] >= NSIDES )
+		return 0;
+	if( addr[6] >= NSECTORS )
+		return 0;
+	if (addr[7] >= NSIZES)
+		return 0;	// invalid ssize code
+
+	*track  = addr[4];
+	*side   = addr[5];
+	*sector = addr[6];
+	*size   = 128 << addr[7];
+	return bufend-buf;
+}
+
+static inline unsigned int
+mfm_valid_data (floppy8_t *f, uint8_t *buf, const unsigned int i, unsigned int sector_size, uint8_t *sector_data, fix_t *fix)
+{
+	uint8_t *bufend;
+	uint8_t *data = f->field;	// Data mark, data bytes, 2 CRC
+
+	if(sector_size>MAX_SSIZE)
+		return 0;
+	bufend = mfm_fetch_bytes (&buf[i], data, 4 + sector_size + 2);
+	fix->corrected = fix->reclassified = 0;
+	if (crc16 (data, 4 + sector_size + 2) != 0){
+		if( !valid_size(sector_size) )
+			return 0;
+		fix->corrected = crc_correct(f,data,4 + sector_size + 2,4);
+		if( fix->corrected==0 )
+			fix->reclassified = soft_retry(f,i,data,0,4 + sector_size + 2);
+		if( fix->corrected==0 && fix->reclassified==0 )
+			return 0;
+		}
+	memcpy(sector_data,&data[4],sector_size);
+	return bufend-&buf[i];
+}
+
+KERNEL unsigned int
+mfm_indx(floppy8_t *f, uint8_t *buf, unsigned int i, const bool verbose)
+{
+	(void)buf;
+	info_if(verbose,f,"%06u: INDX",f->cell_base+i);
+	sector_none(f);
+	report(f,FLOPPY8_INDX,i,FLOPPY8_GOOD,NULL,NULL);
+	return 0;
+}
+
+KERNEL unsigned int
+mfm_addr(floppy8_t *f, uint8_t *buf, unsigned int i, const bool verbose)
+{
+	unsigned int consumed = mfm_valid_addr(&buf[i],&f->last_track,&f->last_side,&f->last_sector,&f->last_size);
+
+	if( consumed ){
+		info_if(verbose,f,"%06u: ADDR Track:%02u Side:%u Sector:%02u Size:%u",f->cell_base+i,f->last_track,f->last_side,f->last_sector,f->last_size);
+		addr_seen(f);
+		report(f,FLOPPY8_ADDR,i,FLOPPY8_GOOD,NULL,NULL);
+		}
+	else
+		sector_none(f);
+	return consumed;
+}
+
+// DATA and DELD fields only differ in their mark, which the CRC covers
+KERNEL unsigned int
+mfm_data(floppy8_t *f, uint8_t *buf, unsigned int i, const int type)
+{
+	uint8_t	*sector_data = f->sector_data;
+	fix_t fix;
+	unsigned int consumed = mfm_valid_data(f,buf,i,f->last_size,sector_data,&fix);
+	int status;
+
+	if( consumed ){
+		f->mark_at = f->cell_base+i;
+		status = disk_add(f,type,f->mark_at,f->last_track,f->last_side,f->last_sector,f->last_size,sector_data,&fix);
+		report(f,type,i,status,sector_data,&fix);
+		track_check(f);
+		sector_none(f);
+		}
+	return consumed;
+}
+
+KERNEL int
+mfm_kernel (floppy8_t *f, const sample_t *samples, const unsigned int n, const sample_t split_lo, const sample_t split_hi, const bool verbose)
+{
+	unsigned int i;
+	unsigned int consumed;
+	sample_t s;
+	uint8_t *dptr;
+	unsigned int nact;		// actual number of decoded bits, typically about 2.5x of the input
+	uint8_t mark[4];		// for finding index/addr/data marks
+	unsigned int scan;		// marks start before this cell
+	uint8_t *decode = decode_buffer(f,(n*4)+DECODE_PAD);	// worse case, decoded bits are 4x the number of samples
+	gap_t gap;
+
+	if( decode==NULL )
+		return FLOPPY8_ENOMEM;
+	cellmap_init(&f->cellmap,samples,n,TT_MFM,split_lo,split_hi,split_hi);
+
+	// convert to RLL format
+	dptr = decode;
+	scan = 0;
+	for(i=0;i<n;i++){
+		if( i==f->scan_end )
+			scan = dptr-decode;
+		s = samples[i];
+		*dptr++ = 1;
+		if( s>=split_hi ){		// 4us
+			*dptr++ = 0;
+			*dptr++ = 0;
+			*dptr++ = 0;
+			}
+		else if( s>=split_lo ){		// 3us
+			*dptr++ = 0;
+			*dptr++ = 0;
+			}
+		else{				// 2us
+			*dptr++ = 0;
+			}
+		}
+	nact = dptr-decode;	// how much expanded data
+	if( f->scan_end>=n )
+		scan = nact;
+	for(i=0;i<DECODE_PAD;i++)
+		*dptr++ = 0;
+	info_if(verbose,f,"MFM decode expanded to %u samples",nact);
+
+	// Identify index/addr/data areas and extract
+	gap.limit = 0;
+	for (i = 0; i < scan && !f->done; i+=consumed) {
+		i = gap_check(&gap,i);
+		mfm_fetch_bytes(&decode[i],mark,sizeof(mark));
+		if( mark_match (mark, MFM_indx_mark, sizeof(mark))){
+			(void)mfm_indx(f,decode,i,verbose);
+			consumed = sizeof(mark)*8*2;	// each byte consumes 8 pairs of bits
+			mark_used(&decode[i],consumed,'I');
+			gap.limit = 0;
+			}
+		else if( mark_match (mark, MFM_addr_mark, sizeof(mark))){
+			consumed = mfm_addr(f,decode,i,verbose);
+			if( consumed ){
+				mark_used(&decode[i],consumed,'A');
+				consumed += gap_skip(&gap,i+consumed,MFM_GAP2_SKIP,MFM_GAP2_WINDOW);
+				}
+			else
+				consumed=1;
+			}
+		else if( mark_match (mark, MFM_data_mark, sizeof(mark))){
+			consumed = mfm_data(f,decode,i,FLOPPY8_DATA);
+			if(consumed){
+				mark_used(&decode[i],consumed,'D');
+				consumed += gap_skip(&gap,i+consumed,MFM_GAP3_SKIP,MFM_GAP3_WINDOW);
+				}
+			else
+				consumed=1;
+			}
+		else if( mark_match (mark, MFM_deld_mark, sizeof(mark))){
+			consumed = mfm_data(f,decode,i,FLOPPY8_DELD);
+			if(consumed){
+				mark_used(&decode[i],consumed,'d');
+				consumed += gap_skip(&gap,i+consumed,MFM_GAP3_SKIP,MFM_GAP3_WINDOW);
+				}
+			else
+				consumed=1;
+			}
+		else
+			consumed = 1;	// advance the search
+	}
+	return FLOPPY8_OK;
+}
+
+KERNEL int
+m2fm_kernel (floppy8_t *f, const sample_t *samples, const unsigned int n, const sample_t split_lo, const sample_t split_hi, const sample_t split_top,
+	const bool verbose)
+{
+	unsigned int i;
+	unsigned int consumed,skip;
+	sample_t s;
+	uint8_t *dptr;
+	unsigned int nact;		// actual number of decoded bits
+	unsigned int scan;		// marks start before this cell
+	uint8_t *decode = decode_buffer(f,(n*5)+DECODE_PAD);	// worse case, decoded bits are 5x the number of samples
+	gap_t gap;
+
+	if( decode==NULL )
+		return FLOPPY8_ENOMEM;
+	cellmap_init(&f->cellmap,samples,n,TT_M2FM,split_lo,split_hi,split_top);
+
+	// convert to RLL format, as MFM with one more width
+	dptr = decode;
+	scan = 0;
+	for(i=0;i<n;i++){
+		if( i==f->scan_end )
+			scan = dptr-decode;
+		s = samples[i];
+		*dptr++ = 1;
+		*dptr++ = 0;			// 2us
+		if( s>=split_lo )		// 3us
+			*dptr++ = 0;
+		if( s>=split_hi )		// 4us
+			*dptr++ = 0;
+		if( s>=split_top )		// 5us
+			*dptr++ = 0;
+		}
+	nact = dptr-decode;	// how much expanded data
+	if( f->scan_end>=n )
+		scan = nact;
+	for(i=0;i<DECODE_PAD;i++)
+		*dptr++ = 0;
+	info_if(verbose,f,"M2FM decode expanded to %u samples",nact);
+
+	// Identify index/addr/data areas and extract
+	gap.limit = 0;
+	for (i = 0; i < scan && !f->done; i++) {
+		i = gap_check(&gap,i);
+		skip = 0;
+		if( !mark_match (&decode[i], M2FM_addr_mark, M2FM_PREFIX))
+			consumed = 0;		// cannot be any of the marks
+		else if( mark_match (&decode[i], M2FM_indx_mark, sizeof (M2FM_indx_mark))){
+			(void)fm_indx(f,TT_M2FM,decode,i+sizeof(M2FM_indx_mark),verbose);	// just to print
+			consumed = sizeof(M2FM_indx_mark);
+			mark_used(&decode[i],consumed,'I');
+			}
+		else if( mark_match (&decode[i], M2FM_addr_mark, sizeof (M2FM_addr_mark))){
+			consumed = fm_addr(f,TT_M2FM,decode,i+sizeof(M2FM_addr_mark),verbose);
+			if( consumed ){
+				consumed += sizeof(M2FM_addr_mark);
+				mark_used(&decode[i],consumed,'A');
+				skip = gap_skip(&gap,i+consumed,M2FM_GAP2_SKIP,M2FM_GAP2_WINDOW);
+				}
+			}
+		else if( mark_match (&decode[i], M2FM_data_mark, sizeof (M2FM_data_mark))){
+			consumed = fm_data(f,TT_M2FM,decode,i+sizeof(M2FM_data_mark),FLOPPY8_DATA);
+			if( consumed ){
+				consumed += sizeof(M2FM_data_mark);
+				mark_used(&decode[i],consumed,'D');
+				skip = gap_skip(&gap,i+consumed,M2FM_GAP3_SKIP,M2FM_GAP3_WINDOW);
+				}
+			}
+		else if( mark_match (&decode[i], M2FM_deld_mark, sizeof (M2FM_deld_mark))){
+			consumed = fm_data(f,TT_M2FM,decode,i+sizeof(M2FM_deld_mark),FLOPPY8_DELD);
+			if( consumed ){
+				consumed += sizeof(M2FM_deld_mark);
+				mark_used(&decode[i],consumed,'d');
+				skip = gap_skip(&gap,i+consumed,M2FM_GAP3_SKIP,M2FM_GAP3_WINDOW);
+				}
+			}
+		else
+			consumed = 0;
+		if( consumed && skip==0 )
+			gap.limit = 0;		// found what was expected
+		i += consumed+skip;
+	}
+	return FLOPPY8_OK;
+}
+
+// Kernels specialised for common capture settings, by ticks in 2us (2 * cpu clock in MHz >> shift).
+// Other settings use the generic kernels, which read the splits from the context
+#define	SPECIALISED(X)				\
+	X(75)	/* 600MHz >> 4, as in data_dir */	\
+	X(1200)	/* 600MHz, no shift */		\
+	X(66)	/* 528MHz >> 4 */		\
+	X(1056)	/* 528MHz */			\
+	X(90)	/* 720MHz >> 4 */		\
+	X(1440)	/* 720MHz */			\
+	X(80)	/* 40MHz, SCP and HFE images */
+
+#define	SPECIALISE(t)									\
+static int fm_##t(floppy8_t *f, const sample_t *s, unsigned int n)			\
+	{ return fm_kernel(f,s,n,SPLIT_FM(t),false); }					\
+static int fm_##t##_v(floppy8_t *f, const sample_t *s, unsigned int n)			\
+	{ return fm_kernel(f,s,n,SPLIT_FM(t),true); }					\
+static int mfm_##t(floppy8_t *f, const sample_t *s, unsigned int n)			\
+	{ return mfm_kernel(f,s,n,SPLIT_LO(t),SPLIT_HI(t),false); }			\
+static int mfm_##t##_v(floppy8_t *f, const sample_t *s, unsigned int n)			\
+	{ return mfm_kernel(f,s,n,SPLIT_LO(t),SPLIT_HI(t),true); }			\
+static int m2fm_##t(floppy8_t *f, const sample_t *s, unsigned int n)			\
+	{ return m2fm_kernel(f,s,n,SPLIT_LO(t),SPLIT_HI(t),SPLIT_TOP(t),false); }	\
+static int m2fm_##t##_v(floppy8_t *f, const sample_t *s, unsigned int n)		\
+	{ return m2fm_kernel(f,s,n,SPLIT_LO(t),SPLIT_HI(t),SPLIT_TOP(t),true); }
+
+SPECIALISED(SPECIALISE)
+
+static int fm_any(floppy8_t *f, const sample_t *s, unsigned int n)
+	{ return fm_kernel(f,s,n,f->timing.fm_split,false); }
+static int fm_any_v(floppy8_t *f, const sample_t *s, unsigned int n)
+	{ return fm_kernel(f,s,n,f->timing.fm_split,true); }
+static int mfm_any(floppy8_t *f, const sample_t *s, unsigned int n)
+	{ return mfm_kernel(f,s,n,f->timing.mfm_lo,f->timing.mfm_hi,false); }
+static int mfm_any_v(floppy8_t *f, const sample_t *s, unsigned int n)
+	{ return mfm_kernel(f,s,n,f->timing.mfm_lo,f->timing.mfm_hi,true); }
+static int m2fm_any(floppy8_t *f, const sample_t *s, unsigned int n)
+	{ return m2fm_kernel(f,s,n,f->timing.mfm_lo,f->timing.mfm_hi,f->timing.m2fm_top,false); }
+static int m2fm_any_v(floppy8_t *f, const sample_t *s, unsigned int n)
+	{ return m2fm_kernel(f,s,n,f->timing.mfm_lo,f->timing.mfm_hi,f->timing.m2fm_top,true); }
+
+typedef struct kernels {
+	unsigned int	two_us;
+	kernel_t	k[NENGINES][2];	// [format-1][verbose]
+} kernels_t;
+
+#define	KERNELS(t)	{ t, { { fm_##t, fm_##t##_v }, { mfm_##t, mfm_##t##_v }, { m2fm_##t, m2fm_##t##_v } } },
+
+static const kernels_t Kernels[] = {
+	SPECIALISED(KERNELS)
+};
+
+// Set the timing for samples taken with a cpu clock of 'clock' cycles per us, shifted right by
+// 'shift'.  A zero clock means the default
+static inline void
+timing_set(floppy8_t *f, const unsigned int clock, const unsigned int shift)
+{
+	timing_t *t = &f->timing;
+	unsigned long two_us = (clock && shift<16) ? (2ul*clock) >> shift : TWO_US;
+	unsigned int i;
+
+	if( two_us<8 || SPLIT_TOP(two_us)>=SAMPLE_MAX ){
+		error(f,"Cannot decode samples of %u MHz >> %u, using the default",clock,shift);
+		two_us = TWO_US;
+		}
+	t->two_us   = two_us;
+	t->one_us   = two_us/2;
+	t->fm_split = SPLIT_FM(two_us);
+	t->mfm_lo   = SPLIT_LO(two_us);
+	t->mfm_hi   = SPLIT_HI(two_us);
+	t->m2fm_top = SPLIT_TOP(two_us);
+	t->kernels  = NULL;
+	for(i=0;i<sizeof(Kernels)/sizeof(Kernels[0]);i++)
+		if( Kernels[i].two_us==two_us )
+			t->kernels = &Kernels[i];
+}
+
+// decode part of a track in a known format, searching for marks in the first 'scan' samples
+static inline int
+segment_decode(floppy8_t *f, const sample_t *samples, const unsigned int n, const unsigned int scan, const int format)
+{
+	const timing_t *t = &f->timing;
+
+	sector_none(f);
+	f->scan_end = scan;
+	if( format<TT_FM || format>=TT_FM+NENGINES ){
+		error(f,"Cannot determine track format");
+		return FLOPPY8_EFORMAT;
+		}
+	if( t->kernels )
+		return t->kernels->k[format-TT_FM][f->cfg.verbose](f,samples,n);
+	return Engines[format-TT_FM].k[f->cfg.verbose](f,samples,n);
+}
+
+// Parallel decode of long tracks.  A quick pre-scan finds the 00 preamble of an address
+// mark near each of config.threads equal divisions of the track, so every piece starts with
+// an address field and no data field is separated from its address.  Each piece is decoded
+// in its own thread by a private worker context, which records what it finds rather than
+// reporting it.  The records are then replayed here in stream order, so sector checks,
+// callbacks and early termination behave exactly as they do with one thread.
+
+#define	MAX_THREADS	64
+#define	PARALLEL_MIN	8192			// fewest samples worth a thread
+#define	PARALLEL_TAIL	((4+MAX_SSIZE+2)*16)	// samples past its end a piece may need to finish a field
+#define	FM_PREAMBLE	32			// of the 48 4us samples of 6 00 bytes
+#define	MFM_PREAMBLE	48			// of the 96 2us samples of 12 00 bytes
+#define	SYNC_SAMPLES	48			// samples searched for a mark after a preamble
+
+#define	EVENT_RECORD	0
+#define	EVENT_DIAG	1
+
+// something a worker found, to be replayed by its owner
+typedef struct event {
+	int			kind;		// EVENT_RECORD or EVENT_DIAG
+	int			level;		// of a diagnostic
+	floppy8_record_t	r;
+	size_t			text;		// record data or diagnostic message, in the worker's text buffer
+	unsigned int		at;		// cell of a data field, for its -v line
+} event_t;
+
+typedef struct worker {
+	floppy8_t	*f;		// private context
+	pthread_t	thread;
+	bool		threaded;	// thread was started, so join it
+	const sample_t	*samples;	// piece of the track to decode
+	unsigned int	n;
+	unsigned int	scan;		// marks from here on belong to the next piece
+	int		format;
+	int		ret;
+	event_t		*events;
+	unsigned int	nevents;
+	size_t		events_size;	// bytes
+	uint8_t		*text;
+	size_t		used;
+	size_t		size;
+	bool		failed;		// ran out of memory recording
+} worker_t;
+
+// make room for 'need' more bytes after 'used' in a buffer, doubling it as needed
+static inline bool
+worker_grow(floppy8_t *f, void **buf, size_t *size, const size_t used, const size_t need)
+{
+	size_t n = *size ? *size : 4096;
+	void *p;
+
+	if( used+need <= *size )
+		return true;
+	while( n < used+need )
+		n *= 2;
+	p = f8_alloc(f,n);
+	if( p==NULL )
+		return false;
+	if( *buf ){
+		memcpy(p,*buf,used);
+		f8_release(f,*buf);
+		}
+	*buf  = p;
+	*size = n;
+	return true;
+}
+
+static inline event_t *
+worker_event(worker_t *w, const int kind, const void *text, const size_t len)
+{
+	event_t *e;
+
+	if( w->failed
+	 || !worker_grow(w->f,(void **)&w->events,&w->events_size,w->nevents*sizeof(event_t),sizeof(event_t))
+	 || !worker_grow(w->f,(void **)&w->text,&w->size,w->used,len) ){
+		w->failed = true;
+		return NULL;
+		}
+	e = &w->events[w->nevents++];
+	e->kind  = kind;
+	e->level = 0;
+	e->text  = w->used;
+	if( len )
+		memcpy(&w->text[w->used],text,len);
+	w->used += len;
+	return e;
+}
+
+static void
+worker_sector(void *arg, const floppy8_record_t *r)
+{
+	worker_t *w = (worker_t *)arg;
+	event_t *e = worker_event(w,EVENT_RECORD,r->data,r->data ? r->size : 0);
+
+	if( e ){
+		e->r  = *r;
+		e->at = w->f->mark_at;
+		}
+}
+
+static void
+worker_diag(void *arg, int level, const char *msg)
+{
+	worker_t *w = (worker_t *)arg;
+	event_t *e = worker_event(w,EVENT_DIAG,msg,strlen(msg)+1);
+
+	if( e )
+		e->level = level;
+}
+
+static void *
+worker_run(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+
+	capture_start(w->f);
+	w->ret = segment_decode(w->f,w->samples,w->n,w->scan,w->format);
+	return NULL;
+}
+
+static void
+workers_free(floppy8_t *f)
+{
+	unsigned int t;
+
+	for(t=0;t<f->nworkers;t++){
+		f8_release(f,f->workers[t].events);
+		f8_release(f,f->workers[t].text);
+		floppy8_free(f->workers[t].f);
+		}
+	f8_release(f,f->workers);
+	f->workers  = NULL;
+	f->nworkers = 0;
+}
+
+// create the worker contexts.  They share the configuration, but never stop early
+static inline bool
+workers_new(floppy8_t *f, const unsigned int threads)
+{
+	floppy8_config_t cfg;
+	unsigned int t;
+
+	if( f->nworkers>=threads )
+		return true;
+	workers_free(f);
+	f->workers = (worker_t *)f8_alloc(f,sizeof(worker_t)*threads);
+	if( f->workers==NULL )
+		return false;
+	memset(f->workers,0,sizeof(worker_t)*threads);
+	for(t=0;t<threads;t++){
+		cfg = f->cfg;
+		cfg.sector  = worker_sector;
+		cfg.diag    = worker_diag;
+		cfg.arg     = &f->workers[t];
+		cfg.verify  = true;
+		cfg.spt     = 0;
+		cfg.threads = 0;
+		f->workers[t].f = floppy8_new(&cfg);
+		if( f->workers[t].f==NULL ){
+			workers_free(f);
+			return false;
+			}
+		f->workers[t].f->worker = true;
+		f->nworkers++;
+		}
+	return true;
+}
+
+// samples that could be the 00 bytes ahead of a mark
+static inline bool
+preamble(const timing_t *t, const sample_t s, const int format)
+{
+	return (format==TT_FM) ? s>=t->fm_split : s<t->mfm_lo;
+}
+
+// Is there an address mark just after sample 'i'?  Decodes only those few samples
+static inline bool
+sync_addr(const timing_t *t, const sample_t *samples, const unsigned int n, unsigned int i, const int format)
+{
+	uint8_t cells[4*SYNC_SAMPLES+64];
+	uint8_t mark[4];
+	unsigned int j,end,ncells = 0;
+
+	memset(cells,0,sizeof(cells));
+	i = (i>4) ? i-4 : 0;
+	end = (i+SYNC_SAMPLES<n) ? i+SYNC_SAMPLES : n;
+	for(j=i;j<end;j++){
+		if( format==TT_FM )
+			cells[ncells++] = (samples[j] < t->fm_split) ? 1 : 0;
+		else{
+			cells[ncells++] = 1;
+			ncells += (samples[j]>=t->mfm_hi) ? 3 : (samples[j]>=t->mfm_lo) ? 2 : 1;
+			}
+		}
+	for(j=0;j<ncells;j++){
+		if( format==TT_FM ){
+			if( mark_match(&cells[j],FM_addr_mark,sizeof(FM_addr_mark)) )
+				return true;
+			}
+		else if( j+sizeof(mark)*8*2 <= sizeof(cells) ){
+			mfm_fetch_bytes(&cells[j],mark,sizeof(mark));
+			if( mark_match(mark,MFM_addr_mark,sizeof(mark)) )
+				return true;
+			}
+		}
+	return false;
+}
+
+// first sample at or after 'i' that starts the preamble of an address mark, or n if none
+static inline unsigned int
+sync_find(const timing_t *t, const sample_t *samples, const unsigned int n, unsigned int i, const int format)
+{
+	unsigned int start,need = (format==TT_FM) ? FM_PREAMBLE : MFM_PREAMBLE;
+
+	while( i<n ){
+		while( i<n && !preamble(t,samples[i],format) )
+			i++;
+		start = i;
+		while( i<n && preamble(t,samples[i],format) )
+			i++;
+		if( i-start>=need && sync_addr(t,samples,n,i,format) )
+			return start;
+		}
+	return n;
+}
+
+// replay what a worker found as if it had been found here
+static inline void
+worker_merge(floppy8_t *f, const worker_t *w)
+{
+	const event_t *e;
+	floppy8_record_t r;
+	fix_t fix;
+	unsigned int k;
+
+	for(k=0;k<w->nevents && !f->done;k++){
+		e = &w->events[k];
+		if( e->kind==EVENT_DIAG ){
+			if( f->cfg.diag )
+				f->cfg.diag(f->cfg.arg,e->level,(const char *)&w->text[e->text]);
+			continue;
+			}
+		r = e->r;
+		if( r.type==FLOPPY8_ADDR ){
+			f->last_track  = r.track;
+			f->last_side   = r.side;
+			f->last_sector = r.sector;
+			f->last_size   = r.size;
+			addr_seen(f);
+			}
+		else if( r.type==FLOPPY8_DATA || r.type==FLOPPY8_DELD ){
+			r.data = &w->text[e->text];
+			fix.corrected    = r.corrected;
+			fix.reclassified = r.reclassified;
+			r.status = disk_add(f,r.type,e->at,r.track,r.side,r.sector,r.size,r.data,&fix);
+			}
+		if( f->cfg.sector )
+			f->cfg.sector(f->cfg.arg,&r);
+		if( r.type==FLOPPY8_DATA || r.type==FLOPPY8_DELD ){
+			track_check(f);
+			sector_none(f);
+			}
+		}
+}
+
+// cells the first 'n' samples decode to, so a worker's -v lines give the same positions as one thread's
+static inline unsigned int
+cells_before(const timing_t *t, const sample_t *samples, const unsigned int n, const int format)
+{
+	cellmap_t m;
+	unsigned int i,cells = 0;
+
+	if( format==TT_FM )
+		return n;
+	cellmap_init(&m,samples,n,format,t->mfm_lo,t->mfm_hi,t->m2fm_top);
+	for(i=0;i<n;i++)
+		cells += cellmap_width(&m,samples[i]);
+	return cells;
+}
+
+// Decode a track in pieces on several threads.  Return false (having reported nothing) if
+// it is too short to be worth splitting or there is not enough memory
+static inline bool
+track_parallel(floppy8_t *f, const sample_t *samples, const unsigned int n, const int format, int *ret)
+{
+	unsigned int split[MAX_THREADS+1];
+	unsigned int k,t,pieces,threads = (f->cfg.threads<MAX_THREADS) ? f->cfg.threads : MAX_THREADS;
+	worker_t *w;
+
+	if( n<2*PARALLEL_MIN || (format!=TT_FM && format!=TT_MFM) || !workers_new(f,threads) )
+		return false;
+	split[0] = 0;
+	for(pieces=0;pieces<threads && split[pieces]<n;pieces++){
+		t = (pieces+1)*(n/threads);
+		if( t < split[pieces]+PARALLEL_MIN )
+			t = split[pieces]+PARALLEL_MIN;
+		split[pieces+1] = (pieces+1<threads && t<n) ? sync_find(&f->timing,samples,n,t,format) : n;
+		}
+	if( pieces<2 )
+		return false;
+
+	for(k=0;k<pieces;k++){
+		w = &f->workers[k];
+		w->samples  = &samples[split[k]];
+		w->scan     = split[k+1]-split[k];
+		w->n        = (n-split[k] < w->scan+PARALLEL_TAIL) ? n-split[k] : w->scan+PARALLEL_TAIL;
+		w->format   = format;
+		w->nevents  = 0;
+		w->used     = 0;
+		w->failed   = false;
+		w->f->sample_base  = f->sample_base+split[k];
+		w->f->cell_base    = f->cfg.verbose ? cells_before(&f->timing,samples,split[k],format) : 0;
+		w->f->cfg.verbose  = f->cfg.verbose;
+		w->f->timing       = f->timing;
+		w->threaded = pthread_create(&w->thread,NULL,worker_run,w)==0;
+		}
+	for(k=0;k<pieces;k++){
+		w = &f->workers[k];
+		if( w->threaded )
+			pthread_join(w->thread,NULL);
+		else
+			worker_run(w);
+		}
+	for(k=0;k<pieces;k++)
+		if( f->workers[k].failed )
+			return false;
+
+	info(f,"Decoded in %u pieces",pieces);
+	*ret = FLOPPY8_OK;
+	for(k=0;k<pieces;k++){
+		worker_merge(f,&f->workers[k]);
+		if( f->workers[k].ret<0 )
+			*ret = f->workers[k].ret;
+		}
+	return true;
+}
+
+// decode a track (or one revolution of it) in a known format
+static inline int
+track_decode(floppy8_t *f, const sample_t *samples, const unsigned int n, const int format)
+{
+	int ret;
+
+	if( f->cfg.threads>1 && track_parallel(f,samples,n,format,&ret) )
+		return ret;
+	return segment_decode(f,samples,n,n,format);
+}
+
+void
+floppy8_config_init(floppy8_config_t *cfg)
+{
+	memset(cfg,0,sizeof(*cfg));
+	cfg->alloc   = default_alloc;
+	cfg->release = default_release;
+}
+
+floppy8_t *
+floppy8_new(const floppy8_config_t *cfg)
+{
+	floppy8_config_t def;
+	floppy8_t *f;
+
+	if( cfg==NULL ){
+		floppy8_config_init(&def);
+		cfg = &def;
+		}
+	if( cfg->alloc==NULL || cfg->release==NULL )
+		return NULL;
+	f = (floppy8_t *)cfg->alloc(cfg->alloc_arg,sizeof(*f));
+	if( f==NULL )
+		return NULL;
+	memset(f,0,sizeof(*f));
+	f->cfg = *cfg;
+	timing_set(f,cfg->clock,cfg->shift);
+	sector_none(f);
+	return f;
+}
+
+// forget all decoded sectors, ready for the next disk
+void
+floppy8_reset(floppy8_t *f)
+{
+	unsigned int track,side,sector;
+
+	struct chunk *c;
+
+	for(c=f->arena;c;c=c->next)
+		c->used = 0;
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<NSIDES;side++)
+	for(sector=0;sector<NSECTORS;sector++){
+		f->disk[track][side][sector].data = NULL;
+		f->disk[track][side][sector].size = 0;
+		f->disk[track][side][sector].corrected = 0;
+		f->disk[track][side][sector].reclassified = 0;
+		}
+	f->nfeed = 0;
+	sector_none(f);
+}
+
+void
+floppy8_free(floppy8_t *f)
+{
+	struct chunk *c;
+
+	if( f==NULL )
+		return;
+	floppy8_reset(f);
+	workers_free(f);
+	f8_release(f,f->feed);
+	f8_release(f,f->syndrome);
+	f8_release(f,f->soft);
+	f8_release(f,f->decode);
+	while( f->arena ){
+		c = f->arena->next;
+		f8_release(f,f->arena);
+		f->arena = c;
+		}
+	f->cfg.release(f->cfg.alloc_arg,f);
+}
+
+void
+floppy8_verbose(floppy8_t *f, const bool verbose)
+{
+	f->cfg.verbose = verbose;
+}
+
+// Time from index pulse 'from' to index pulse 'to', in us, zero if unknown.
+// Uses the device's cycle counts if it gave its clock, otherwise adds up the samples
+static inline double
+index_us(const floppy8_capture_t *cap, const sample_t *samples, const unsigned int n,
+	const unsigned int from, const unsigned int to, const unsigned int two_us)
+{
+	unsigned int i,first,last;
+	double us = 0.0;
+
+	first = cap->index[from];
+	last  = cap->index[to];
+	if( cap->clock )
+		us = (double)(cap->cycles[to]-cap->cycles[from]) / cap->clock;
+	else if( last<=n ){
+		for(i=first;i<last;i++)
+			us += samples[i];
+		us = 2.0*us/two_us;
+		}
+	return us;
+}
+
+// Measured rotation speed from the index pulses of a capture, zero if unknown
+double
+floppy8_rpm(const floppy8_capture_t *cap, const sample_t *samples, const unsigned int n)
+{
+	double us;
+
+	if( cap==NULL || cap->nindex<2 )
+		return 0.0;
+	us = index_us(cap,samples,n,0,cap->nindex-1,TWO_US);
+	return (us>0.0) ? 60e6*(cap->nindex-1)/us : 0.0;
+}
+
+// speed of each revolution, for the quality survey
+static inline void
+quality_rpm(floppy8_t *f, const floppy8_capture_t *cap, const sample_t *samples, const unsigned int n)
+{
+	floppy8_quality_t *q = &f->quality;
+	unsigned int r;
+	double us,rpm;
+
+	for(r=0;r+1<cap->nindex;r++){
+		us = index_us(cap,samples,n,r,r+1,f->timing.two_us);
+		if( us<=0.0 )
+			continue;
+		rpm = 60e6/us;
+		if( q->rpm_min==0.0 || rpm<q->rpm_min )
+			q->rpm_min = rpm;
+		if( rpm>q->rpm_max )
+			q->rpm_max = rpm;
+		}
+	us = index_us(cap,samples,n,0,cap->nindex-1,f->timing.two_us);
+	q->rpm = (us>0.0) ? 60e6*(cap->nindex-1)/us : 0.0;
+}
+
+// signal quality of the last track decoded (all zero unless config.quality)
+const floppy8_quality_t *
+floppy8_quality(const floppy8_t *f)
+{
+	return &f->quality;
+}
+
+// A track decoded in the format it was detected as ('detected', zero if the format was given)
+// that found no address fields goes to the next engine, and the capture starts again.
+// False once one has found some, or all have been tried
+static inline bool
+format_retry(floppy8_t *f, int *format, const int detected)
+{
+	unsigned int sector;
+	int next;
+
+	if( detected==0 )
+		return false;
+	for(sector=0;sector<NSECTORS;sector++)
+		if( f->seen[sector]!=NTRACKS )
+			return false;
+	next = TT_FM + (*format-TT_FM+1) % NENGINES;
+	if( next==detected )
+		return false;
+	info(f,"No address fields as %s, trying %s",Engines[*format-TT_FM].name,Engines[next-TT_FM].name);
+	*format = next;
+	capture_start(f);
+	return true;
+}
+
+// decode one track worth of samples.  format is FLOPPY8_FM, FLOPPY8_MFM, FLOPPY8_M2FM or 0 to determine it
+int
+floppy8_track(floppy8_t *f, const sample_t *samples, const unsigned int n, int format)
+{
+	int ret,detected = 0;
+
+	if( n==0 )
+		return FLOPPY8_OK;
+	if( format==0 )
+		format = detected = track_survey(f,samples,n,format);
+	else if( f->cfg.quality )
+		format = track_survey(f,samples,n,format);
+	f->sample_base = 0;
+	capture_start(f);
+	do
+		ret = track_decode(f,samples,n,format);
+	while( ret>=0 && format_retry(f,&format,detected) );
+	return ret;
+}
+
+// Decode a capture one revolution at a time, split at the index pulses the device noted.
+// Revolution one is always decoded, later ones only while sectors are missing or repaired,
+// or the sectors on the track are not known yet (or always, with config.verify).  A capture started between index pulses has its piece
+// before the first one decoded last; with the piece after the last it makes up one more revolution.
+// Without index pulses the whole capture is decoded as by floppy8_track().
+// A capture that gives its clock is decoded with its own timing rather than config.clock
+int
+floppy8_revolutions(floppy8_t *f, const sample_t *samples, const unsigned int n, int format, const floppy8_capture_t *cap)
+{
+	unsigned int r,first,last,missing;
+	int ret = FLOPPY8_OK,detected = 0;
+
+	if( n==0 )
+		return FLOPPY8_OK;
+	if( cap && cap->clock )
+		timing_set(f,cap->clock,cap->shift);
+	if( cap==NULL || cap->nindex<2 ){
+		ret = floppy8_track(f,samples,n,format);
+		timing_set(f,f->cfg.clock,f->cfg.shift);
+		return ret;
+		}
+	if( format==0 )
+		format = detected = track_survey(f,samples,n,format);
+	else if( f->cfg.quality )
+		format = track_survey(f,samples,n,format);
+	if( f->cfg.quality )
+		quality_rpm(f,cap,samples,n);
+	capture_start(f);
+	for(r=0;r<=cap->nindex && !f->done;r++){
+		first = (r<cap->nindex) ? cap->index[r] : 0;
+		if( r<cap->nindex )
+			last = (r+1<cap->nindex && cap->index[r+1]<n) ? cap->index[r+1] : n;
+		else
+			last = (cap->index[0]<n) ? cap->index[0] : n;
+		if( first>=last )
+			continue;
+		f->sample_base = first;
+		do
+			ret = track_decode(f,&samples[first],last-first,format);
+		while( ret>=0 && format_retry(f,&format,detected) );
+		if( ret<0 )
+			break;
+		missing = track_missing(f);
+		info(f,"Revolution %u: samples %u-%u, %u sector%s missing",r+1,first,last-1,missing,(missing==1) ? "" : "s");
+		if( missing==0 && !f->cfg.verify && (f->learned || f->cfg.spt) )
+			break;	// as track_check(), the sector set is only known once a revolution has gone by
+		}
+	f->sample_base = 0;
+	timing_set(f,f->cfg.clock,f->cfg.shift);
+	return ret;
+}
+
+// collect samples for a track piece by piece, decoded by floppy8_end()
+int
+floppy8_feed(floppy8_t *f, const sample_t *samples, const unsigned int n)
+{
+	if( f->feed==NULL ){
+		f->feed = (sample_t *)f8_alloc(f,sizeof(sample_t)*MAX_SAMPLES);
+		if( f->feed==NULL )
+			return FLOPPY8_ENOMEM;
+		}
+	if( n > MAX_SAMPLES-f->nfeed )
+		return FLOPPY8_EINVAL;
+	memcpy(&f->feed[f->nfeed],samples,n*sizeof(sample_t));
+	f->nfeed += n;
+	return FLOPPY8_OK;
+}
+
+int
+floppy8_end(floppy8_t *f, const int format)
+{
+	int r = floppy8_track(f,f->feed,f->nfeed,format);
+
+	f->nfeed = 0;
+	return r;
+}
+
+// parse one '#' line of capture details
+static inline void
+capture_line(floppy8_capture_t *cap, const char *line)
+{
+	unsigned int a,b;
+
+	if( sscanf(line,"# clock %u %u",&a,&b)==2 ){
+		cap->clock = a;
+		cap->shift = b;
+		}
+	else if( sscanf(line,"# index %u %u",&a,&b)==2 && cap->nindex<FLOPPY8_MAX_INDEX ){
+		cap->index[cap->nindex]  = a;
+		cap->cycles[cap->nindex] = b;
+		cap->nindex++;
+		}
+}
+
+// The loader reads blocks and works on 8 bytes at a time: the first newline of a word is
+// found with the usual zero byte test, and up to 8 digits are converted with 3 multiplies
+// (the byte order of the word is fixed, so this is portable)
+#define	LOAD_BLOCK	(64*1024)
+
+static inline uint64_t
+load64(const uint8_t *p)
+{
+	return (uint64_t)p[0]       | (uint64_t)p[1]<<8  | (uint64_t)p[2]<<16 | (uint64_t)p[3]<<24
+	     | (uint64_t)p[4]<<32   | (uint64_t)p[5]<<40 | (uint64_t)p[6]<<48 | (uint64_t)p[7]<<56;
+}
+
+// position of the first newline in a word, or 8 if none
+static inline unsigned int
+swar_newline(const uint64_t x)
+{
+	uint64_t v = x ^ 0x0A0A0A0A0A0A0A0AULL;
+	uint64_t t = (v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL;
+
+	return t ? __builtin_ctzll(t)/8 : 8;
+}
+
+// value of the 1 to 8 digits at the start of a word, false if they are not all digits
+static inline bool
+swar_digits(uint64_t x, const unsigned int len, uint32_t *value)
+{
+	if( len<8 )
+		x = (x << 8*(8-len)) | (0x3030303030303030ULL >> 8*len);	// pad with leading '0'
+	if( (x & 0xF0F0F0F0F0F0F0F0ULL)!=0x3030303030303030ULL
+	 || ((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL)!=0x3030303030303030ULL )
+		return false;
+	x = ((x & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+	x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	*value = (uint32_t)(((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32);
+	return true;
+}
+
+static inline void
+capture_bad(floppy8_capture_t *cap, const unsigned int line)
+{
+	if( cap==NULL )
+		return;
+	if( cap->bad<FLOPPY8_MAX_BAD )
+		cap->bad_line[cap->bad] = line;
+	cap->bad++;
+}
+
+// Load newline separated decimal samples from a stream, return actual number of samples
+// '#' lines hold capture details, parsed into 'cap' if it is not NULL.  Malformed lines
+// are skipped, and counted in 'cap' with their line numbers
+unsigned int
+floppy8_load(FILE *fp, sample_t *samples, const unsigned int n, floppy8_capture_t *cap)
+{
+	uint8_t buf[LOAD_BLOCK+8];
+	char text[128];
+	size_t len = 0,pos,end,k;
+	unsigned int i = 0,line = 0;
+	unsigned long skipped = 0;	// bytes ahead of the current line
+	bool eof = false,longline = false;
+	const uint8_t *p,*nl;
+	uint32_t v;
+
+	if( cap )
+		memset(cap,0,sizeof(*cap));
+	while( i<n ){
+		if( !eof ){
+			len += fread(&buf[len],1,LOAD_BLOCK-len,fp);
+			eof = feof(fp) || ferror(fp);
+			}
+		if( eof && len>0 && buf[len-1]!='\n' && len<LOAD_BLOCK )
+			buf[len++] = '\n';	// last line has no newline
+		if( len==0 )
+			break;
+		memset(&buf[len],0,8);
+		for(pos=0;i<n && pos<len;pos+=end+1){
+			p = &buf[pos];
+			end = swar_newline(load64(p));
+			if( end==8 ){
+				nl = (const uint8_t *)memchr(p,'\n',len-pos);
+				if( nl==NULL )
+					break;		// rest of the line is in the next block
+				end = nl-p;
+				}
+			if( longline ){		// end of a line too long for a block
+				longline = false;
+				skipped += end+1;
+				continue;
+				}
+			line++;
+			k = (end>0 && p[end-1]=='\r') ? end-1 : end;
+			if( k>0 && k<=8 && swar_digits(load64(p),k,&v) ){
+				if( i==0 && cap )
+					cap->header = skipped;
+				samples[i++] = (v < SAMPLE_MAX) ? v : SAMPLE_MAX;
+				}
+			else if( k>0 && p[0]=='#' ){
+				if( cap ){
+					if( k>=sizeof(text) )
+						k = sizeof(text)-1;
+					memcpy(text,p,k);
+					text[k] = '\0';
+					capture_line(cap,text);
+					}
+				}
+			else if( k>0 )
+				capture_bad(cap,line);
+			skipped += end+1;
+			}
+		if( pos==0 && len==LOAD_BLOCK ){	// no newline in a whole block
+			capture_bad(cap,++line);
+			longline = true;
+			skipped += len;
+			pos = len;
+			}
+		if( i==n && pos<len )		// leave the stream just after the last sample, if possible
+			(void)fseek(fp,-(long)(len-pos),SEEK_CUR);
+		memmove(buf,&buf[pos],len-pos);
+		len -= pos;
+		if( eof && pos==0 )
+			break;
+		}
+	return i;
+}
+
+// read up to 'max' decimal samples from a stream and decode them as one track, by revolution if possible
+int
+floppy8_read(floppy8_t *f, FILE *fp, unsigned int max, const int format)
+{
+	floppy8_capture_t cap;
+	unsigned int i,n;
+	int r;
+
+	if( max==0 || max>MAX_SAMPLES )
+		max = MAX_SAMPLES;
+	if( f->feed==NULL ){
+		f->feed = (sample_t *)f8_alloc(f,sizeof(sample_t)*MAX_SAMPLES);
+		if( f->feed==NULL )
+			return FLOPPY8_ENOMEM;
+		}
+	n = floppy8_load(fp,f->feed,max,&cap);
+	info(f,"%u samples",n);
+	for(i=0;i<cap.bad && i<FLOPPY8_MAX_BAD;i++)
+		error(f,"line %u: malformed sample",cap.bad_line[i]);
+	if( cap.bad>FLOPPY8_MAX_BAD )
+		error(f,"%u more malformed samples",cap.bad-FLOPPY8_MAX_BAD);
+	if( n==0 && ferror(fp) )
+		return FLOPPY8_EIO;
+	r = floppy8_revolutions(f,f->feed,n,format,&cap);
+	f->nfeed = 0;
+	return r;
+}
+
+const floppy8_sector_t *
+floppy8_sector(const floppy8_t *f, const unsigned int track, const unsigned int side, const unsigned int sector)
+{
+	if( track>=NTRACKS || side>=NSIDES || sector>=NSECTORS )
+		return NULL;
+	return &f->disk[track][side][sector];
+}
+
+// Sides of the disk with any sector decoded: 2 if side 1 has any, otherwise 1
+unsigned int
+floppy8_sides(const floppy8_t *f)
+{
+	unsigned int track,side,sector;
+
+	for(side=NSIDES-1;side>0;side--)
+	for(track=0;track<NTRACKS;track++)
+	for(sector=0;sector<NSECTORS;sector++)
+		if( f->disk[track][side][sector].size )
+			return side+1;
+	return 1;
+}
+
+// Name of the capture file of a track: TrackNN.raw for side 0, which is all a single sided
+// drive writes, and TrackNN_S.raw for side S
+void
+floppy8_track_name(char *name, const size_t size, const char *dir, const unsigned int track, const unsigned int side)
+{
+	if( side )
+		snprintf(name,size,"%s%sTrack%02u_%u.raw",dir ? dir : "",dir ? "/" : "",track,side);
+	else
+		snprintf(name,size,"%s%sTrack%02u.raw",dir ? dir : "",dir ? "/" : "",track);
+}
+
+// Track and side from a capture file name (.../TrackNN.raw or .../TrackNN_S.raw), false if it has none
+bool
+floppy8_track_of(const char *name, unsigned int *track, unsigned int *side)
+{
+	const char *base = strrchr(name,'/');
+	int n = 0;
+
+	base = base ? base+1 : name;
+	if( sscanf(base,"Track%u%n",track,&n)!=1 || *track>=NTRACKS )
+		return false;
+	*side = 0;
+	if( base[n]=='_' && (sscanf(&base[n],"_%u",side)!=1 || *side>=NSIDES) )
+		return false;
+	return true;
+}
@@ -0,0 +1,190 @@
+#ifndef FLOPPY8_H
+#define FLOPPY8_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+//	libfloppy8 --- decode sector data from 8" floppy pulse captures
+//
+//	All decoder state lives in a floppy8_t context, so any number of contexts may be used
+//	concurrently (one per thread).  Decoded fields and diagnostics are reported through
+//	callbacks, and all memory comes from the caller's allocator (malloc/free by default).
+//
+//	Typical use:
+//		floppy8_config_t cfg;
+//		floppy8_config_init(&cfg);
+//		cfg.sector = my_sector_callback;
+//		f = floppy8_new(&cfg);
+//		for each track: floppy8_track(f,samples,n,0) or floppy8_read(f,fp)
+//		    (or floppy8_revolutions() to decode later revolutions only when needed)
+//		s = floppy8_sector(f,track,side,sector) ...
+//		floppy8_free(f);
+
+#define	FLOPPY8_NTRACKS		77
+#define	FLOPPY8_NSIDES		2
+#define	FLOPPY8_NSECTORS	53	// sectors range from 0 to NSECTORS-1
+#define	FLOPPY8_NSIZES		4	// sector size is 128 << size
+#define	FLOPPY8_MAX_SSIZE	1024	// sector size can be 128/256/512/1024
+#define	FLOPPY8_MAX_SAMPLES	400000	// most samples in one track capture (the capture device packs up to 400000)
+#define	FLOPPY8_MAX_INDEX	8	// most index pulses noted in one track capture
+#define	FLOPPY8_MAX_BAD		8	// malformed capture lines remembered
+
+// Track encodings
+#define	FLOPPY8_FM	1
+#define	FLOPPY8_MFM	2
+#define	FLOPPY8_M2FM	3	// Intel MDS double density
+
+// Return values.  Errors are negative
+#define	FLOPPY8_OK		0
+#define	FLOPPY8_ENOMEM		(-1)	// allocator failed
+#define	FLOPPY8_EFORMAT		(-2)	// cannot determine track format
+#define	FLOPPY8_EINVAL		(-3)	// bad parameter
+#define	FLOPPY8_EIO		(-4)	// read error
+
+// Record types passed to the sector callback
+#define	FLOPPY8_INDX	1	// index mark
+#define	FLOPPY8_ADDR	2	// valid address field
+#define	FLOPPY8_DATA	3	// valid data field
+#define	FLOPPY8_DELD	4	// valid deleted data field
+
+// Record status
+#define	FLOPPY8_GOOD		0	// new, or matches what was already decoded
+#define	FLOPPY8_MISMATCH	1	// differs from an earlier decode of the same sector
+#define	FLOPPY8_BADSIZE		2	// differs in size from an earlier decode
+#define	FLOPPY8_BADPARAM	3	// track/side/sector/size out of range
+
+// Diagnostic levels
+#define	FLOPPY8_ERROR	0
+#define	FLOPPY8_INFO	1	// only reported if config.verbose
+
+typedef uint16_t sample_t;	// a sample is the capture clock count between 2 data pulses
+#define	SAMPLE_MAX	0xFFFF		// longer gaps are clamped to this as a capture is loaded
+
+typedef struct floppy8 floppy8_t;
+
+// Capture details the device writes as '#' lines ahead of the samples.  Older captures have none
+typedef struct floppy8_capture {
+	unsigned long	header;		// bytes of '#' lines before the first sample
+	unsigned int	clock;		// capture cpu cycles per us, zero if unknown
+	unsigned int	shift;		// samples are cpu cycles shifted right by this much
+	unsigned int	nindex;		// number of index pulses noted
+	unsigned int	index[FLOPPY8_MAX_INDEX];	// sample number following each index pulse
+	uint32_t	cycles[FLOPPY8_MAX_INDEX];	// cpu cycles from the start of capture to each index pulse
+	unsigned int	bad;		// malformed lines skipped
+	unsigned int	bad_line[FLOPPY8_MAX_BAD];	// line numbers of the first of them
+} floppy8_capture_t;
+
+// one decoded field, as reported to the sector callback
+typedef struct floppy8_record {
+	int		type;		// FLOPPY8_INDX/ADDR/DATA/DELD
+	int		status;		// FLOPPY8_GOOD, etc. (DATA/DELD only)
+	int		format;		// FLOPPY8_FM, FLOPPY8_MFM or FLOPPY8_M2FM
+	unsigned int	sample;		// sample number where the mark starts
+	unsigned int	cell;		// nominal cell period, in sample ticks
+	unsigned int	track;		// from the address field (not valid for INDX)
+	unsigned int	side;
+	unsigned int	sector;
+	unsigned int	size;
+	const uint8_t	*data;		// sector data (DATA/DELD only)
+	unsigned int	corrected;	// number of bits fixed by CRC error correction
+	unsigned int	reclassified;	// number of samples reclassified by soft decision retry
+} floppy8_record_t;
+
+// one sector of the disk image
+typedef struct floppy8_sector {
+	unsigned int	size;		// zero if never decoded
+	uint8_t		*data;
+	unsigned int	corrected;	// bits fixed by CRC error correction, zero if read cleanly
+	unsigned int	reclassified;	// samples reclassified by soft decision retry, zero if read cleanly
+} floppy8_sector_t;
+
+// Signal quality of the last track decoded, if config.quality.  Times are in ns
+typedef struct floppy8_quality {
+	int		format;		// FLOPPY8_FM, FLOPPY8_MFM or FLOPPY8_M2FM, 0 if no track surveyed
+	unsigned int	samples;
+	unsigned int	peak_count[3];	// samples nearest 2, 3 and 4us (FM has no 3us peak)
+	double		peak_mean[3];	// their mean width
+	double		peak_sd[3];	// and its standard deviation
+	double		jitter_p50;	// distance of samples from the nearest nominal width: median,
+	double		jitter_p95;	// 95th
+	double		jitter_p99;	// and 99th percentile
+	double		ambiguous;	// fraction of samples within 1/8us of a split between widths
+	unsigned int	outliers;	// samples shorter than 1.5us or longer than 4.5us
+	unsigned int	clamped;	// samples at SAMPLE_MAX (a lost pulse, or no disk)
+	double		rpm;		// mean speed from the index pulses, zero if unknown
+	double		rpm_min;	// slowest revolution
+	double		rpm_max;	// fastest revolution
+} floppy8_quality_t;
+
+// Settings for floppy8_synth(), which makes samples of a track from its sectors
+typedef struct floppy8_synth {
+	int		format;		// FLOPPY8_FM, FLOPPY8_MFM or FLOPPY8_M2FM
+	unsigned int	track;
+	unsigned int	side;
+	unsigned int	spt;		// sectors 1 to spt
+	unsigned int	size;		// sector size code, 128 << size
+	unsigned int	interleave;	// physical sector spacing, 0 or 1 for 1,2,3...
+	unsigned int	clock;		// capture cpu cycles per us, 0 for 600 (with shift 4)
+	unsigned int	shift;		// samples are cpu cycles shifted right by this much
+	double		cell;		// bit cell in ns, 0 for 4000 (FM) or 2000 (MFM, M2FM)
+	double		rpm;		// nominal speed, 0 for 360
+	double		speed;		// drive speed error, +0.01 is 1% fast
+	double		drift;		// peak speed change within a revolution, 0.01 is +/- 1%
+	double		jitter;		// pulse timing noise, ns rms
+	unsigned int	revolutions;	// 0 for 3
+	unsigned int	errors;		// data bits flipped per revolution
+	uint64_t	seed;		// for jitter and errors
+	// called for each bit flipped, may be NULL
+	void		(*flip)(void *arg, unsigned int revolution, unsigned int sector, unsigned int bit);
+	void		*arg;
+} floppy8_synth_t;
+
+typedef struct floppy8_config {
+	bool	verbose;		// report FLOPPY8_INFO diagnostics
+	int	correct;		// fix data fields that fail CRC: 0=no, 1=single bit, 2=also 2 nearby bits
+	bool	soft;			// retry data fields that fail CRC with their least certain samples reclassified
+	bool	quality;		// survey the signal quality of each track, see floppy8_quality()
+	bool	verify;			// decode every revolution and cross-check, rather than stop once all sectors are held
+	unsigned int spt;		// sectors per track (numbered from 1), or 0 to learn them from the first revolution
+	unsigned int threads;		// decode long tracks in up to this many pieces at once, 0 or 1 for one thread
+	unsigned int clock;		// capture cpu cycles per us, 0 for the Teensy's 600.  A capture's '# clock' line overrides it
+	unsigned int shift;		// samples are cpu cycles shifted right by this much (with clock)
+
+	// memory, defaults to malloc/free.  Must be thread safe if config.threads > 1
+	void	*(*alloc)(void *arg, size_t size);
+	void	(*release)(void *arg, void *ptr);
+	void	*alloc_arg;
+
+	// callbacks, may be NULL
+	void	(*sector)(void *arg, const floppy8_record_t *r);
+	void	(*diag)(void *arg, int level, const char *msg);
+	void	*arg;
+} floppy8_config_t;
+
+void			floppy8_config_init(floppy8_config_t *cfg);
+floppy8_t		*floppy8_new(const floppy8_config_t *cfg);
+void			floppy8_free(floppy8_t *f);
+void			floppy8_reset(floppy8_t *f);
+void			floppy8_verbose(floppy8_t *f, bool verbose);
+
+int			floppy8_track(floppy8_t *f, const sample_t *samples, unsigned int n, int format);
+int			floppy8_revolutions(floppy8_t *f, const sample_t *samples, unsigned int n, int format, const floppy8_capture_t *cap);
+int			floppy8_feed(floppy8_t *f, const sample_t *samples, unsigned int n);
+int			floppy8_end(floppy8_t *f, int format);
+int			floppy8_read(floppy8_t *f, FILE *fp, unsigned int max, int format);
+
+int			floppy8_format(floppy8_t *f, const sample_t *samples, unsigned int n);
+const char		*floppy8_format_name(int format);
+const floppy8_sector_t	*floppy8_sector(const floppy8_t *f, unsigned int track, unsigned int side, unsigned int sector);
+unsigned int		floppy8_sides(const floppy8_t *f);
+unsigned int		floppy8_load(FILE *fp, sample_t *samples, unsigned int n, floppy8_capture_t *cap);
+double			floppy8_rpm(const floppy8_capture_t *cap, const sample_t *samples, unsigned int n);
+void			floppy8_track_name(char *name, size_t size, const char *dir, unsigned int track, unsigned int side);
+bool			floppy8_track_of(const char *name, unsigned int *track, unsigned int *side);
+const floppy8_quality_t	*floppy8_quality(const floppy8_t *f);
+
+unsigned int		floppy8_synth(const floppy8_synth_t *s, const uint8_t *data, sample_t *samples, unsigned int max, floppy8_capture_t *cap);
+
+#endif
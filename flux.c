@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "floppy8.h"
+#include "flux.h"
+
+//	flux --- flux images of other capture tools
+//
+// SCP layout, all numbers little endian unless noted:
+//	header		16 bytes: "SCP", version, disk type, revolutions, first and last
+//			track, flags, bit cell width (0 for 16 bits), heads, resolution
+//			(25ns * (1+n)), then a 32 bit sum of every byte after the header
+//	track table	SCP_TRACKS offsets of track headers, zero for none
+//	track header	"TRK", track number, then per revolution its duration, number of
+//			flux times and where they start from the track header
+//	flux times	16 bits each, big endian.  0 adds 65536 to the next
+//
+// HFE layout (version 1), little endian:
+//	header		512 bytes: "HXCPICFE", revision, tracks, sides, encoding, bit rate
+//			in kbit/s, RPM, interface mode, 1, track list block, then 0xFF
+//	track list	per track the block its data starts at and its length in bytes
+//	track data	blocks of 512 bytes: 256 bytes of side 0's bits then 256 of side
+//			1's.  Bits are cells, a 1 for a flux reversal, first in time in bit 0
+
+#define	NTRACKS		FLOPPY8_NTRACKS
+#define	NSIDES		FLOPPY8_NSIDES
+#define	MAX_INDEX	FLOPPY8_MAX_INDEX
+
+#define	TYPE_SCP	1
+#define	TYPE_HFE	2
+
+#define	SCP_HEADER	16
+#define	SCP_TRACKS	168
+#define	SCP_DATA	(SCP_HEADER+4*SCP_TRACKS)	// where the first track goes
+#define	SCP_TICK	25				// ns in one unit
+#define	SCP_INDEX	0x01				// flags: revolutions start at index pulses
+#define	SCP_360RPM	0x04				// flags: drive turns at 360 RPM
+#define	SCP_VERSION	0x22				// 2.2
+#define	SCP_OTHER	0x80				// disk type: not a known computer
+
+#define	HFE_BLOCK	512
+#define	HFE_LIST	1		// block of the track list, which fits in one
+#define	HFE_BITRATE	500		// kbit/s, for 1us cells
+#define	HFE_CELL	(1000000.0/(2*HFE_BITRATE))	// ns in one cell
+#define	HFE_UNKNOWN	0xFF		// track encoding
+#define	HFE_SHUGART	0x07		// GENERIC_SHUGART_DD interface
+#define	HFE_MAX_CELLS	(2*HFE_BITRATE*1000/5)	// one revolution at 300 RPM or faster
+
+// an HFE track being written, one revolution of cells
+typedef struct hfe_track {
+	uint8_t		*bits;
+	unsigned int	cells;
+} hfe_track_t;
+
+struct flux {
+	int		type;
+
+	// reading
+	const uint8_t	*map;
+	size_t		size;
+	unsigned int	revs;			// SCP revolutions per track
+	unsigned int	res;			// SCP units of 25ns
+	unsigned int	bitrate;		// HFE
+	uint32_t	offset[NTRACKS][NSIDES];	// SCP track header, HFE track data, 0 if none
+	uint32_t	length[NTRACKS][NSIDES];	// HFE track data bytes, both sides
+
+	// writing
+	FILE		*fp;
+	uint32_t	table[SCP_TRACKS];	// SCP track header offsets
+	uint32_t	sum;			// SCP checksum so far
+	uint32_t	next;			// SCP offset of the next track header
+	hfe_track_t	hfe[NTRACKS][NSIDES];
+	bool		failed;
+};
+
+static inline uint32_t
+get16(const uint8_t *p)
+{
+	return p[0] | (p[1]<<8);
+}
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static inline void
+put16(uint8_t *p, const uint32_t v)
+{
+	p[0] = v;
+	p[1] = v>>8;
+}
+
+static inline void
+put32(uint8_t *p, const uint32_t v)
+{
+	p[0] = v;
+	p[1] = v>>8;
+	p[2] = v>>16;
+	p[3] = v>>24;
+}
+
+static inline int
+type_of(const char *path)
+{
+	size_t len = strlen(path);
+
+	if( len>4 && strcmp(&path[len-4],".scp")==0 )
+		return TYPE_SCP;
+	if( len>4 && strcmp(&path[len-4],".hfe")==0 )
+		return TYPE_HFE;
+	return 0;
+}
+
+// a .scp or .hfe file name
+bool
+flux_file(const char *path)
+{
+	return type_of(path)!=0;
+}
+
+// find the tracks of an SCP image
+static inline bool
+scp_open(flux_t *x)
+{
+	const uint8_t *h = x->map;
+	unsigned int i,first,last;
+	uint32_t off;
+
+	x->revs = h[5];
+	first   = h[6];
+	last    = h[7];
+	x->res  = h[11]+1;
+	if( x->revs==0 || (h[9]!=0 && h[9]!=16) || x->size<SCP_DATA )
+		return false;
+	for(i=first;i<=last && i<SCP_TRACKS && i/2<NTRACKS;i++){
+		off = get32(h+SCP_HEADER+4*i);
+		if( off==0 )
+			continue;
+		if( off>x->size || x->size-off<4+12*x->revs || memcmp(h+off,"TRK",3)!=0 || h[off+3]!=i )
+			return false;
+		x->offset[i/2][i%2] = off;
+		}
+	return true;
+}
+
+// find the tracks of an HFE image
+static inline bool
+hfe_open(flux_t *x)
+{
+	const uint8_t *h = x->map;
+	unsigned int track,side,ntracks,nsides;
+	uint32_t list,off,len;
+
+	ntracks    = h[9];
+	nsides     = h[10];
+	x->bitrate = get16(h+12);
+	list       = get16(h+18)*HFE_BLOCK;
+	if( h[8]!=0 || nsides==0 || nsides>NSIDES || x->bitrate==0 || list>x->size || x->size-list<4*ntracks )
+		return false;
+	for(track=0;track<ntracks && track<NTRACKS;track++){
+		off = get16(h+list+4*track)*HFE_BLOCK;
+		len = get16(h+list+4*track+2);
+		if( len==0 )
+			continue;
+		if( off>x->size || x->size-off<(len+HFE_BLOCK-1)/HFE_BLOCK*HFE_BLOCK )
+			return false;
+		for(side=0;side<nsides;side++){
+			x->offset[track][side] = off;
+			x->length[track][side] = len;
+			}
+		}
+	return true;
+}
+
+// Open a .scp or .hfe image for reading, NULL if it cannot be read or is not one
+flux_t *
+flux_open(const char *path)
+{
+	flux_t *x;
+	struct stat st;
+	bool ok = false;
+	int fd;
+
+	fd = open(path,O_RDONLY);
+	if( fd<0 )
+		return NULL;
+	x = (flux_t *)calloc(1,sizeof(*x));
+	if( x==NULL || fstat(fd,&st)!=0 || st.st_size<HFE_BLOCK ){
+		close(fd);
+		free(x);
+		return NULL;
+		}
+	x->size = st.st_size;
+	x->map  = (const uint8_t *)mmap(NULL,x->size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if( x->map==MAP_FAILED ){
+		free(x);
+		return NULL;
+		}
+	(void)madvise((void *)x->map,x->size,MADV_WILLNEED);
+	if( memcmp(x->map,"SCP",3)==0 ){
+		x->type = TYPE_SCP;
+		ok = scp_open(x);
+		}
+	else if( memcmp(x->map,"HXCPICFE",8)==0 ){
+		x->type = TYPE_HFE;
+		ok = hfe_open(x);
+		}
+	if( !ok ){
+		flux_close(x);
+		return NULL;
+		}
+	return x;
+}
+
+void
+flux_close(flux_t *x)
+{
+	unsigned int track,side;
+
+	if( x==NULL )
+		return;
+	if( x->map )
+		munmap((void *)x->map,x->size);
+	if( x->fp )
+		fclose(x->fp);
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<NSIDES;side++)
+		free(x->hfe[track][side].bits);
+	free(x);
+}
+
+// the image has a track
+bool
+flux_has(const flux_t *x, const unsigned int track, const unsigned int side)
+{
+	return track<NTRACKS && side<NSIDES && x->offset[track][side];
+}
+
+// samples of every revolution of an SCP track, one after another
+static inline unsigned int
+scp_track(const flux_t *x, const uint8_t *t, sample_t *buf, floppy8_capture_t *cap)
+{
+	const uint8_t *e,*p;
+	unsigned int r,k,count,n = 0;
+	uint32_t v,carry,cycles = 0;
+
+	for(r=0;r<x->revs;r++){
+		e = t+4+12*r;
+		count = get32(e+4);
+		if( get32(e+8)>x->size-(t-x->map) || count>(x->size-(t-x->map)-get32(e+8))/2 )
+			break;
+		if( r<MAX_INDEX ){
+			cap->index[r]  = n;
+			cap->cycles[r] = cycles;
+			cap->nindex    = r+1;
+			}
+		p = t+get32(e+8);
+		for(carry=0,k=0;k<count && n<FLOPPY8_MAX_SAMPLES;k++){
+			v = (p[2*k]<<8) | p[2*k+1];
+			if( v==0 ){
+				carry += 0x10000;
+				continue;
+				}
+			v = (carry+v)*x->res;
+			carry = 0;
+			buf[n++] = (v<SAMPLE_MAX) ? v : SAMPLE_MAX;
+			}
+		cycles += get32(e)*x->res;
+		}
+	if( r==x->revs && r<MAX_INDEX ){
+		cap->index[r]  = n;
+		cap->cycles[r] = cycles;
+		cap->nindex    = r+1;
+		}
+	return n;
+}
+
+// samples of an HFE track, read round twice
+static inline unsigned int
+hfe_track(const flux_t *x, const unsigned int track, const unsigned int side, sample_t *buf, floppy8_capture_t *cap)
+{
+	const uint8_t *t = x->map+x->offset[track][side];
+	unsigned int pass,i,n = 0,cells = x->length[track][side]/2*8;
+	double cell = FLUX_CLOCK*1000.0/(2.0*x->bitrate);
+	uint64_t at = 0,last = 0;
+	uint32_t v;
+
+	for(pass=0;pass<2;pass++){
+		cap->index[pass]  = n;
+		cap->cycles[pass] = (uint32_t)(at*cell+0.5);
+		for(i=0;i<cells && n<FLOPPY8_MAX_SAMPLES;i++,at++){
+			if( (t[(i/8/256)*HFE_BLOCK+side*256+(i/8)%256] & (1<<(i%8)))==0 )
+				continue;
+			if( at ){
+				v = (uint32_t)(at*cell+0.5) - (uint32_t)(last*cell+0.5);
+				buf[n++] = (v<SAMPLE_MAX) ? v : SAMPLE_MAX;
+				}
+			last = at;
+			}
+		}
+	cap->index[2]  = n;
+	cap->cycles[2] = (uint32_t)(at*cell+0.5);
+	cap->nindex    = 3;
+	return n;
+}
+
+// Samples of a track of the image, copied into 'buf' (of FLOPPY8_MAX_SAMPLES), and their
+// capture details.  NULL if the image does not have the track
+const sample_t *
+flux_track(const flux_t *x, const unsigned int track, const unsigned int side, sample_t *buf, unsigned int *n, floppy8_capture_t *cap)
+{
+	floppy8_capture_t c;
+
+	*n = 0;
+	if( cap==NULL )
+		cap = &c;
+	memset(cap,0,sizeof(*cap));
+	if( !flux_has(x,track,side) )
+		return NULL;
+	cap->clock = FLUX_CLOCK;
+	cap->shift = 0;
+	if( x->type==TYPE_SCP )
+		*n = scp_track(x,x->map+x->offset[track][side],buf,cap);
+	else
+		*n = hfe_track(x,track,side,buf,cap);
+	return buf;
+}
+
+// Start writing a .scp or .hfe image
+flux_t *
+flux_create(const char *path)
+{
+	uint8_t header[SCP_DATA];
+	flux_t *x;
+
+	x = (flux_t *)calloc(1,sizeof(*x));
+	if( x==NULL )
+		return NULL;
+	x->type = type_of(path);
+	x->fp = x->type ? fopen(path,"wb") : NULL;
+	if( x->fp==NULL ){
+		free(x);
+		return NULL;
+		}
+	// SCP tracks are written as they come, after room for the header and track table
+	if( x->type==TYPE_SCP ){
+		memset(header,0,sizeof(header));
+		if( fwrite(header,sizeof(header),1,x->fp)!=1 )
+			x->failed = true;
+		x->next = SCP_DATA;
+		}
+	return x;
+}
+
+// 'at' samples of a capture in ns.  Captures without a clock are the Teensy's 600 MHz >> 4
+static inline double
+sample_ns(const floppy8_capture_t *cap, const double at)
+{
+	unsigned int clock = (cap && cap->clock) ? cap->clock : 600;
+	unsigned int shift = (cap && cap->clock) ? cap->shift : 4;
+
+	return at*(1u<<shift)*1000.0/clock;
+}
+
+// write bytes of an SCP track, adding them to the checksum
+static inline void
+scp_write(flux_t *x, const uint8_t *p, const size_t len)
+{
+	size_t i;
+
+	for(i=0;i<len;i++)
+		x->sum += p[i];
+	if( fwrite(p,1,len,x->fp)!=len )
+		x->failed = true;
+	x->next += len;
+}
+
+// write one track of an SCP image: each revolution between index pulses, or the whole
+// capture as one revolution if it has none
+static inline int
+scp_add(flux_t *x, const unsigned int i, const sample_t *samples, const unsigned int n, const floppy8_capture_t *cap)
+{
+	unsigned int r,k,nrevs,from,to,words,most;
+	uint8_t head[4+12*255],*data,*p;
+	bool index = cap && cap->nindex>=2;
+	uint64_t total = 0;
+	uint32_t v,ticks;
+	double at;
+
+	nrevs = index ? cap->nindex-1 : 1;
+	if( x->revs==0 )
+		x->revs = nrevs;
+	most = 1 + (uint32_t)(sample_ns(cap,SAMPLE_MAX)/SCP_TICK)/0x10000;	// flux times for one sample
+	data = (uint8_t *)malloc((size_t)n*2*most+2);
+	if( data==NULL )
+		return FLOPPY8_ENOMEM;
+	x->table[i] = x->next;
+	memcpy(head,"TRK",3);
+	head[3] = i;
+
+	// flux times of each revolution, measured from its index pulse
+	for(p=data,r=0;r<nrevs && r<x->revs;r++){
+		from = index ? cap->index[r] : 0;
+		to   = (index && cap->index[r+1]<n) ? cap->index[r+1] : n;
+		for(k=from,at=0.0,ticks=0,words=0;k<to;k++){
+			at += samples[k];
+			v = (uint32_t)(sample_ns(cap,at)/SCP_TICK+0.5) - ticks;
+			ticks += v;
+			while( v>=0x10000 ){
+				*p++ = 0;
+				*p++ = 0;
+				v -= 0x10000;
+				words++;
+				}
+			if( v==0 )
+				v = 1;
+			*p++ = v>>8;
+			*p++ = v;
+			words++;
+			}
+		if( index && cap->clock )
+			ticks = (uint64_t)(cap->cycles[r+1]-cap->cycles[r])*1000/cap->clock/SCP_TICK;
+		put32(head+4+12*r,ticks);
+		put32(head+4+12*r+4,words);
+		put32(head+4+12*r+8,4+12*x->revs+total);
+		total += 2*words;
+		}
+	// fewer revolutions than the image has: repeat the last
+	for(;r<x->revs;r++)
+		memcpy(head+4+12*r,head+4+12*(r-1),12);
+	scp_write(x,head,4+12*x->revs);
+	scp_write(x,data,total);
+	free(data);
+	return x->failed ? FLOPPY8_EIO : FLOPPY8_OK;
+}
+
+// keep the cells of one revolution of an HFE track, to be written by flux_finish()
+static inline int
+hfe_add(flux_t *x, const unsigned int track, const unsigned int side, const sample_t *samples, const unsigned int n, const floppy8_capture_t *cap)
+{
+	hfe_track_t *t = &x->hfe[track][side];
+	unsigned int k,from = 0,to = n,cell = 0,cells;
+	double rev = 0.0;
+
+	if( cap && cap->nindex>=2 ){
+		from = cap->index[0];
+		to   = (cap->index[1]<n) ? cap->index[1] : n;
+		if( cap->clock )
+			rev = (cap->cycles[1]-cap->cycles[0])*1000.0/cap->clock;
+		}
+	free(t->bits);
+	t->bits = (uint8_t *)calloc(HFE_MAX_CELLS/8+1,1);
+	if( t->bits==NULL )
+		return FLOPPY8_ENOMEM;
+	t->cells = 0;
+	for(k=from;k<to;k++){
+		// each gap a whole number of cells, so jitter and speed changes do not pile up
+		// into gaps a cell too long or short
+		cells = (unsigned int)(sample_ns(cap,samples[k])/HFE_CELL+0.5);
+		cell += cells ? cells : 1;
+		if( cell>=HFE_MAX_CELLS )
+			break;
+		t->bits[cell/8] |= 1<<(cell%8);
+		t->cells = cell+1;
+		}
+	if( rev>0.0 && rev/HFE_CELL<HFE_MAX_CELLS && rev/HFE_CELL>t->cells )
+		t->cells = (unsigned int)(rev/HFE_CELL+0.5);
+	return FLOPPY8_OK;
+}
+
+// write one track's samples
+int
+flux_add(flux_t *x, const unsigned int track, const unsigned int side, const sample_t *samples, const unsigned int n, const floppy8_capture_t *cap)
+{
+	if( track>=NTRACKS || side>=NSIDES )
+		return FLOPPY8_EINVAL;
+	if( x->type==TYPE_SCP )
+		return scp_add(x,track*2+side,samples,n,cap);
+	return hfe_add(x,track,side,samples,n,cap);
+}
+
+static inline void
+scp_finish(flux_t *x)
+{
+	uint8_t header[SCP_DATA];
+	unsigned int i,first = SCP_TRACKS,last = 0,sides = 0;
+
+	memset(header,0,sizeof(header));
+	for(i=0;i<SCP_TRACKS;i++){
+		if( x->table[i]==0 )
+			continue;
+		if( i<first )
+			first = i;
+		last = i;
+		sides |= 1<<(i%2);
+		put32(header+SCP_HEADER+4*i,x->table[i]);
+		}
+	for(i=SCP_HEADER;i<SCP_DATA;i++)
+		x->sum += header[i];
+	memcpy(header,"SCP",3);
+	header[3]  = SCP_VERSION;
+	header[4]  = SCP_OTHER;
+	header[5]  = x->revs;
+	header[6]  = (first<SCP_TRACKS) ? first : 0;
+	header[7]  = last;
+	header[8]  = SCP_INDEX | SCP_360RPM;
+	header[9]  = 0;					// 16 bit flux times
+	header[10] = (sides==3) ? 0 : (sides==2) ? 2 : 1;
+	header[11] = 0;					// 25ns
+	put32(header+12,x->sum);
+	if( fseek(x->fp,0,SEEK_SET)!=0 || fwrite(header,sizeof(header),1,x->fp)!=1 )
+		x->failed = true;
+}
+
+static inline void
+hfe_finish(flux_t *x)
+{
+	uint8_t header[HFE_BLOCK],list[HFE_BLOCK],block[HFE_BLOCK];
+	unsigned int track,side,b,blocks,bytes,ntracks = 0,nsides = 1,at;
+	const hfe_track_t *t;
+
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<NSIDES;side++)
+		if( x->hfe[track][side].bits ){
+			ntracks = track+1;
+			if( side )
+				nsides = 2;
+			}
+	memset(header,0xFF,sizeof(header));
+	memcpy(header,"HXCPICFE",8);
+	header[8]  = 0;
+	header[9]  = ntracks;
+	header[10] = nsides;
+	header[11] = HFE_UNKNOWN;
+	put16(header+12,HFE_BITRATE);
+	put16(header+14,360);
+	header[16] = HFE_SHUGART;
+	header[17] = 1;
+	put16(header+18,HFE_LIST);
+	if( fwrite(header,sizeof(header),1,x->fp)!=1 )
+		x->failed = true;
+
+	// track list, then each track's blocks
+	memset(list,0xFF,sizeof(list));
+	at = HFE_LIST+1;
+	for(track=0;track<ntracks;track++){
+		for(bytes=0,side=0;side<nsides;side++)
+			if( (x->hfe[track][side].cells+7)/8>bytes )
+				bytes = (x->hfe[track][side].cells+7)/8;
+		if( bytes==0 )
+			bytes = 1;
+		blocks = (bytes+255)/256;
+		put16(list+4*track,at);
+		put16(list+4*track+2,2*bytes);
+		at += blocks;
+		}
+	if( fwrite(list,sizeof(list),1,x->fp)!=1 )
+		x->failed = true;
+	for(track=0;track<ntracks;track++){
+		blocks = (get16(list+4*track+2)/2+255)/256;
+		for(b=0;b<blocks;b++){
+			memset(block,0,sizeof(block));
+			for(side=0;side<nsides;side++){
+				t = &x->hfe[track][side];
+				bytes = (t->cells+7)/8;
+				if( t->bits && b*256<bytes )
+					memcpy(block+side*256,t->bits+b*256,(bytes-b*256<256) ? bytes-b*256 : 256);
+				}
+			if( fwrite(block,sizeof(block),1,x->fp)!=1 )
+				x->failed = true;
+			}
+		}
+}
+
+// write the header (and for HFE, the tracks), and close the file
+int
+flux_finish(flux_t *x)
+{
+	int ret;
+
+	if( x->type==TYPE_SCP )
+		scp_finish(x);
+	else
+		hfe_finish(x);
+	if( fclose(x->fp)!=0 )
+		x->failed = true;
+	x->fp = NULL;
+	ret = x->failed ? FLOPPY8_EIO : FLOPPY8_OK;
+	flux_close(x);
+	return ret;
+}
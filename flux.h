@@ -0,0 +1,36 @@
+#ifndef FLUX_H
+#define FLUX_H
+
+#include "floppy8.h"
+
+//	flux --- flux images of other capture tools
+//
+// Reads and writes SuperCard Pro (.scp) flux images and HxC (.hfe) bitstream images, so
+// captures can be swapped with other tools.  Images are read through mmap and their
+// timing turned straight into samples of a 40 MHz clock (25ns, SCP's unit), with the index
+// pulses of each revolution in the capture details.
+//
+// SCP tracks are numbered cylinder*2 + side.  All the revolutions of an SCP track are
+// kept; writing uses the first track's count of revolutions for all of them, as the
+// format has one count for the whole image.  An HFE track is one revolution of 1us
+// cells (500 kbit/s) read and written as a loop, so it is read round twice and a sector
+// across the index still decodes.
+
+#define	FLUX_CLOCK	40	// MHz of the samples read, with no shift
+
+typedef struct flux flux_t;
+
+bool		flux_file(const char *path);
+
+// reading
+flux_t		*flux_open(const char *path);
+void		flux_close(flux_t *x);
+bool		flux_has(const flux_t *x, unsigned int track, unsigned int side);
+const sample_t	*flux_track(const flux_t *x, unsigned int track, unsigned int side, sample_t *buf, unsigned int *n, floppy8_capture_t *cap);
+
+// writing: create (the type is from the name), add each track, then finish
+flux_t		*flux_create(const char *path);
+int		flux_add(flux_t *x, unsigned int track, unsigned int side, const sample_t *samples, unsigned int n, const floppy8_capture_t *cap);
+int		flux_finish(flux_t *x);
+
+#endif
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "floppy8.h"
+#include "f8file.h"
+#include "flux.h"
+
+//	fluxgen --- make track captures from a sector image
+//
+//	Front end for floppy8_synth(): encodes every track of a disk image (or E5 filled
+//	sectors) as FM, MFM or M2FM and writes them as TrackNN.raw files (and TrackNN_1.raw for
+//	the second side of a double sided disk), one .f8 file, or a .scp or .hfe flux image, just
+//	as the capture device, extract --pack and extract --export would.  Timing faults and bit errors can be
+//	added, and the bits flipped are listed so decoding can be checked against them.
+
+#define	NTRACKS		FLOPPY8_NTRACKS
+#define	NSIDES		FLOPPY8_NSIDES
+#define MAX_SAMPLES	FLOPPY8_MAX_SAMPLES
+
+bool		Verbose = false;
+bool		Show_flips = false;
+unsigned int	Tracks = NTRACKS;
+unsigned int	Sides = 1;
+unsigned int	Track_now;		// track being made, for show_flip()
+unsigned int	Side_now;
+
+static void
+show_flip(void *arg, unsigned int revolution, unsigned int sector, unsigned int bit)
+{
+	(void)arg;
+	if( Show_flips && Sides>1 )
+		printf("# Flip: track %u side %u revolution %u sector %u bit %u\n",Track_now,Side_now,revolution+1,sector,bit);
+	else if(Show_flips)
+		printf("# Flip: track %u revolution %u sector %u bit %u\n",Track_now,revolution+1,sector,bit);
+}
+
+// write samples as the capture device does, '#' lines then a decimal number per line
+static inline bool
+raw_write(const char *path, const sample_t *samples, const unsigned int n, const floppy8_capture_t *cap)
+{
+	static char buf[MAX_SAMPLES*6+1024];
+	char digits[8];
+	unsigned int i,k,v;
+	size_t len = 0;
+	FILE *fp;
+
+	len += sprintf(&buf[len],"# clock %u %u\n",cap->clock,cap->shift);
+	for(i=0;i<cap->nindex;i++)
+		len += sprintf(&buf[len],"# index %u %u\n",cap->index[i],cap->cycles[i]);
+	for(i=0;i<n;i++){
+		v = samples[i];
+		k = 0;
+		do{
+			digits[k++] = '0' + v%10;
+			v /= 10;
+			}while( v );
+		while( k )
+			buf[len++] = digits[--k];
+		buf[len++] = '\n';
+		}
+	fp = fopen(path,"w");
+	if( fp==NULL )
+		return false;
+	if( fwrite(buf,1,len,fp)!=len ){
+		fclose(fp);
+		return false;
+		}
+	return fclose(fp)==0;
+}
+
+static inline void
+usage()
+{
+	printf("Usage: fluxgen [-v] [-f] [--mfm|--m2fm] [--tracks N] [--sides N] [--spt N] [--size N] [--interleave N] [--cell NS] [--rpm R]\n");
+	printf("               [--speed PCT] [--drift PCT] [--jitter NS] [--errors N] [--revs N] [--seed N] [--clock MHZ:SHIFT]\n");
+	printf("               [--image FILE] OUT\n");
+	printf("  -v            verbose, show tracks per second\n");
+	printf("  -f            list the bits flipped by --errors\n");
+	printf("  --mfm         MFM (default FM), 26 sectors of 256 bytes unless --spt/--size\n");
+	printf("  --m2fm        M2FM, as Intel MDS double density, 52 sectors of 128 bytes unless --spt/--size\n");
+	printf("  --tracks N    tracks 0 to N-1 (default 77)\n");
+	printf("  --sides N     1 or 2 sides (default 1)\n");
+	printf("  --spt N       sectors 1 to N per track (default 26, 52 for M2FM)\n");
+	printf("  --size N      sector size code, 128 << N bytes (default 0 for FM, 1 for MFM)\n");
+	printf("  --interleave N physical sector spacing (default 1)\n");
+	printf("  --cell NS     bit cell (default 4000 FM, 2000 MFM and M2FM)\n");
+	printf("  --rpm R       nominal speed (default 360)\n");
+	printf("  --speed PCT   drive speed error\n");
+	printf("  --drift PCT   peak speed change within a revolution\n");
+	printf("  --jitter NS   pulse timing noise, rms\n");
+	printf("  --errors N    data bits flipped per revolution\n");
+	printf("  --revs N      revolutions per track (default 3)\n");
+	printf("  --seed N      for jitter and errors (default 1)\n");
+	printf("  --clock MHZ:SHIFT  capture clock (default 600:4)\n");
+	printf("  --image FILE  sector data, tracks in order (side 0 then side 1 of each), sector 1 first\n");
+	printf("                (default E5 filled)\n");
+	printf("  OUT           a directory for TrackNN.raw files, a .f8 file, or a .scp or .hfe image\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	floppy8_synth_t s;
+	floppy8_capture_t cap;
+	f8file_info_t info;
+	f8file_t *disk = NULL;
+	flux_t *flux = NULL;
+	sample_t *samples;
+	uint8_t *image = NULL;
+	const char *image_name = NULL, *out = NULL;
+	char path[FILENAME_MAX];
+	unsigned int i,track,side,n,spt = 0,size_code = FLOPPY8_NSIZES;
+	unsigned long image_size = 0, track_size, disk_size;
+	unsigned long seed = 1;
+	double speed = 0.0, drift = 0.0;
+	struct timespec t0,t1;
+	char *arg;
+	FILE *fp;
+	int ret = 0;
+
+	memset(&s,0,sizeof(s));
+	s.format = FLOPPY8_FM;
+	s.flip   = show_flip;
+	while(--argc){
+		arg = *++argv;
+		if( strcmp(arg,"-v")==0 )
+			Verbose = true;
+		else if( strcmp(arg,"-f")==0 )
+			Show_flips = true;
+		else if( strcmp(arg,"--mfm")==0 )
+			s.format = FLOPPY8_MFM;
+		else if( strcmp(arg,"--m2fm")==0 )
+			s.format = FLOPPY8_M2FM;
+		else if( strcmp(arg,"--tracks")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&Tracks)!=1 || Tracks>NTRACKS )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--sides")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&Sides)!=1 || Sides==0 || Sides>NSIDES )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--spt")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&spt)!=1 || spt==0 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--size")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&size_code)!=1 || size_code>=FLOPPY8_NSIZES )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--interleave")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&s.interleave)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--cell")==0 ){
+			if( argc<2 || sscanf(argv[1],"%lf",&s.cell)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--rpm")==0 ){
+			if( argc<2 || sscanf(argv[1],"%lf",&s.rpm)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--speed")==0 ){
+			if( argc<2 || sscanf(argv[1],"%lf",&speed)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--drift")==0 ){
+			if( argc<2 || sscanf(argv[1],"%lf",&drift)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--jitter")==0 ){
+			if( argc<2 || sscanf(argv[1],"%lf",&s.jitter)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--errors")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&s.errors)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--revs")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u",&s.revolutions)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--seed")==0 ){
+			if( argc<2 || sscanf(argv[1],"%lu",&seed)!=1 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--clock")==0 ){
+			if( argc<2 || sscanf(argv[1],"%u:%u",&s.clock,&s.shift)!=2 || s.clock==0 || s.shift>=16 )
+				usage();
+			argc--;
+			argv++;
+			}
+		else if( strcmp(arg,"--image")==0 ){
+			if( argc<2 )
+				usage();
+			image_name = argv[1];
+			argc--;
+			argv++;
+			}
+		else if( arg[0]=='-' || out )
+			usage();
+		else
+			out = arg;
+		}
+	if( out==NULL )
+		usage();
+	s.spt   = spt ? spt : (s.format==FLOPPY8_M2FM) ? 52 : 26;
+	s.size  = (size_code<FLOPPY8_NSIZES) ? size_code : (s.format==FLOPPY8_MFM) ? 1 : 0;
+	s.seed  = seed;
+	s.speed = speed/100.0;
+	s.drift = drift/100.0;
+	track_size = (unsigned long)s.spt*(128 << s.size);
+	disk_size  = Tracks*Sides*track_size;
+
+	if( image_name ){
+		fp = fopen(image_name,"rb");
+		image = (uint8_t *)calloc(Tracks*Sides,track_size);
+		if( fp==NULL || image==NULL ){
+			printf("# FATAL: cannot read %s\n",image_name);
+			return 1;
+			}
+		memset(image,0xE5,disk_size);
+		image_size = fread(image,1,disk_size,fp);
+		fclose(fp);
+		if( image_size<disk_size )
+			printf("# %s is %lu bytes short, filled with E5\n",image_name,disk_size-image_size);
+		}
+	samples = (sample_t *)malloc(sizeof(sample_t)*MAX_SAMPLES);
+	if( samples==NULL ){
+		printf("# FATAL: out of memory\n");
+		return 1;
+		}
+	n = strlen(out);
+	if( n>3 && strcmp(&out[n-3],".f8")==0 ){
+		memset(&info,0,sizeof(info));
+		snprintf(info.drive,sizeof(info.drive),"fluxgen %s seed %lu",floppy8_format_name(s.format),(unsigned long)s.seed);
+		disk = f8file_create(out,&info);
+		if( disk==NULL ){
+			printf("# FATAL: cannot create %s\n",out);
+			return 1;
+			}
+		}
+	else if( flux_file(out) ){
+		flux = flux_create(out);
+		if( flux==NULL ){
+			printf("# FATAL: cannot create %s\n",out);
+			return 1;
+			}
+		}
+	else
+		(void)mkdir(out,0777);	// may already be there
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(i=0;i<Tracks*Sides;i++){	// both sides of a cylinder before the next, as captured
+		track = i/Sides;
+		side  = i%Sides;
+		Track_now = track;
+		Side_now  = side;
+		s.track   = track;
+		s.side    = side;
+		n = floppy8_synth(&s,image ? &image[i*track_size] : NULL,samples,MAX_SAMPLES,&cap);
+		if( n==0 ){
+			printf("# FATAL: %u sectors of %u bytes do not fit on a track\n",s.spt,128 << s.size);
+			ret = 1;
+			break;
+			}
+		if( disk ){
+			if( f8file_add(disk,track,side,samples,n,&cap)!=FLOPPY8_OK ){
+				printf("# ERROR: cannot write %s\n",out);
+				ret = 1;
+				break;
+				}
+			continue;
+			}
+		if( flux ){
+			if( flux_add(flux,track,side,samples,n,&cap)!=FLOPPY8_OK ){
+				printf("# ERROR: cannot write %s\n",out);
+				ret = 1;
+				break;
+				}
+			continue;
+			}
+		floppy8_track_name(path,sizeof(path),out,track,side);
+		if( !raw_write(path,samples,n,&cap) ){
+			printf("# ERROR: cannot write %s\n",path);
+			ret = 1;
+			break;
+			}
+		}
+	if( disk && f8file_finish(disk)!=FLOPPY8_OK ){
+		printf("# ERROR: cannot write %s\n",out);
+		ret = 1;
+		}
+	if( flux && flux_finish(flux)!=FLOPPY8_OK ){
+		printf("# ERROR: cannot write %s\n",out);
+		ret = 1;
+		}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	if(Verbose)
+		printf("# %u tracks in %.3f s, %.0f tracks/s\n",i,(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9,
+			i/((t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9+1e-9));
+	free(samples);
+	free(image);
+	return ret;
+}
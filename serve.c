@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "floppy8.h"
+#include "serve.h"
+
+//	serve --- answer sector requests on a Unix domain socket, decoding tracks on demand
+//
+// Each client connection gets a thread with its own decoder context.  Decoded tracks are
+// kept in a cache shared by all of them, up to a memory limit, and the least recently
+// used are dropped to make room.  A request for a cached track only takes the cache lock
+// for reading and copies the sector out, so any number of them run at once.  The first
+// request for a track marks it as loading and decodes it with no lock held; others asking
+// for the same track wait for that rather than decode it again.
+
+#define	NSECTORS	FLOPPY8_NSECTORS
+#define	BUCKETS		1024		// cache hash table size
+#define	REQUEST		8
+#define	REPLY		8
+
+// one decoded track in the cache
+typedef struct cached {
+	struct cached	*next;		// hash chain
+	unsigned int	disk;
+	unsigned int	track;
+	unsigned int	side;
+	bool		loading;	// being decoded, no sectors yet
+	bool		found;		// the track could be read
+	uint64_t	used;		// when last asked for, for LRU.  Updated without the write lock
+	size_t		bytes;		// memory charged to the cache
+	uint8_t		*data;		// all sectors, one after another
+	unsigned int	offset[NSECTORS];
+	uint16_t	size[NSECTORS];	// zero if missing
+	uint8_t		corrected[NSECTORS];
+	uint8_t		reclassified[NSECTORS];
+} cached_t;
+
+typedef struct server {
+	floppy8_config_t	cfg;
+	serve_load_t		load;
+	void			*arg;
+	size_t			limit;		// cache memory limit
+	size_t			bytes;		// cache memory in use
+	uint64_t		clock;		// LRU time, bumped on every request
+	pthread_rwlock_t	lock;		// cache
+	pthread_mutex_t		wait_lock;	// for waiting on a track being loaded
+	pthread_cond_t		loaded;
+	cached_t		*bucket[BUCKETS];
+} server_t;
+
+typedef struct client {
+	server_t	*s;
+	int		fd;
+	floppy8_t	*f;		// made on the first cache miss
+	sample_t	*samples;
+} client_t;
+
+static inline unsigned int
+bucket_of(const unsigned int disk, const unsigned int track, const unsigned int side)
+{
+	return ((disk*FLOPPY8_NTRACKS + track)*FLOPPY8_NSIDES + side) % BUCKETS;
+}
+
+// find a track in the cache, with the lock held
+static inline cached_t *
+cache_find(server_t *s, const unsigned int disk, const unsigned int track, const unsigned int side)
+{
+	cached_t *c;
+
+	for(c=s->bucket[bucket_of(disk,track,side)];c;c=c->next)
+		if( c->disk==disk && c->track==track && c->side==side )
+			return c;
+	return NULL;
+}
+
+// drop the least recently used tracks until the cache is within its limit, with the write lock held
+static inline void
+cache_trim(server_t *s)
+{
+	cached_t **p,**oldest,*c;
+	unsigned int b;
+
+	while( s->bytes>s->limit ){
+		oldest = NULL;
+		for(b=0;b<BUCKETS;b++)
+		for(p=&s->bucket[b];*p;p=&(*p)->next)
+			if( !(*p)->loading && (oldest==NULL || (*p)->used<(*oldest)->used) )
+				oldest = p;
+		if( oldest==NULL )
+			return;
+		c = *oldest;
+		*oldest = c->next;
+		s->bytes -= c->bytes;
+		free(c->data);
+		free(c);
+		}
+}
+
+// Copy a sector out of a cached track into the reply.  Return false if the track is still loading
+static inline bool
+cache_copy(server_t *s, const cached_t *c, const unsigned int sector, uint8_t *reply, unsigned int *len)
+{
+	if( c->loading )
+		return false;
+	memset(reply,0,REPLY);
+	if( !c->found )
+		reply[0] = SERVE_NOTRACK;
+	else if( c->size[sector]==0 )
+		reply[0] = SERVE_MISSING;
+	else{
+		reply[0] = SERVE_OK;
+		reply[1] = c->corrected[sector];
+		reply[2] = c->reclassified[sector];
+		reply[4] = c->size[sector];
+		reply[5] = c->size[sector]>>8;
+		memcpy(&reply[REPLY],&c->data[c->offset[sector]],c->size[sector]);
+		*len += c->size[sector];
+		}
+	__atomic_store_n((uint64_t *)&c->used,__atomic_add_fetch(&s->clock,1,__ATOMIC_RELAXED),__ATOMIC_RELAXED);
+	return true;
+}
+
+// fill a cache entry from the decoder context
+static inline bool
+cache_fill(cached_t *c, const floppy8_t *f)
+{
+	const floppy8_sector_t *sec;
+	unsigned int i,total = 0;
+
+	for(i=0;i<NSECTORS;i++){
+		sec = floppy8_sector(f,c->track,c->side,i);
+		c->offset[i] = total;
+		c->size[i] = (sec && sec->data) ? sec->size : 0;
+		c->corrected[i] = (sec && sec->corrected<255) ? sec->corrected : 255;
+		c->reclassified[i] = (sec && sec->reclassified<255) ? sec->reclassified : 255;
+		total += c->size[i];
+		}
+	c->data = (uint8_t *)malloc(total ? total : 1);
+	if( c->data==NULL )
+		return false;
+	for(i=0;i<NSECTORS;i++)
+		if( c->size[i] )
+			memcpy(&c->data[c->offset[i]],floppy8_sector(f,c->track,c->side,i)->data,c->size[i]);
+	c->bytes = sizeof(*c)+total;
+	return true;
+}
+
+// Decode a track into a new cache entry, which is already in the table marked as loading,
+// and answer the request from it.  Returns the reply length
+static inline unsigned int
+client_decode(client_t *cl, cached_t *c, const unsigned int sector, uint8_t *reply)
+{
+	server_t *s = cl->s;
+	unsigned int len = REPLY;
+	bool ok = false;
+
+	if( cl->f==NULL ){
+		cl->f = floppy8_new(&s->cfg);
+		cl->samples = (sample_t *)malloc(sizeof(sample_t)*FLOPPY8_MAX_SAMPLES);
+		}
+	if( cl->f && cl->samples ){
+		c->found = s->load(s->arg,cl->f,cl->samples,c->disk,c->track,c->side);
+		ok = cache_fill(c,cl->f);
+		floppy8_reset(cl->f);
+		}
+	if( !ok ){
+		c->found = false;
+		c->bytes = sizeof(*c);
+		}
+
+	pthread_rwlock_wrlock(&s->lock);
+	c->loading = false;
+	s->bytes += c->bytes;
+	(void)cache_copy(s,c,sector,reply,&len);
+	cache_trim(s);
+	pthread_rwlock_unlock(&s->lock);
+
+	pthread_mutex_lock(&s->wait_lock);
+	pthread_cond_broadcast(&s->loaded);
+	pthread_mutex_unlock(&s->wait_lock);
+	return len;
+}
+
+// answer one request.  Returns the reply length
+static inline unsigned int
+client_request(client_t *cl, const uint8_t *req, uint8_t *reply)
+{
+	server_t *s = cl->s;
+	unsigned int disk = req[0] | (req[1]<<8) | (req[2]<<16) | ((unsigned int)req[3]<<24);
+	unsigned int track = req[4], side = req[5], sector = req[6];
+	unsigned int len = REPLY;
+	cached_t *c;
+
+	memset(reply,0,REPLY);
+	if( track>=FLOPPY8_NTRACKS || side>=FLOPPY8_NSIDES || sector>=NSECTORS ){
+		reply[0] = SERVE_BADREQ;
+		return len;
+		}
+	for(;;){
+		// warm path
+		pthread_rwlock_rdlock(&s->lock);
+		c = cache_find(s,disk,track,side);
+		if( c && cache_copy(s,c,sector,reply,&len) ){
+			pthread_rwlock_unlock(&s->lock);
+			return len;
+			}
+		pthread_rwlock_unlock(&s->lock);
+
+		if( c ){
+			// someone else is decoding it
+			pthread_mutex_lock(&s->wait_lock);
+			pthread_rwlock_rdlock(&s->lock);
+			c = cache_find(s,disk,track,side);
+			if( c && c->loading ){
+				pthread_rwlock_unlock(&s->lock);
+				pthread_cond_wait(&s->loaded,&s->wait_lock);
+				}
+			else
+				pthread_rwlock_unlock(&s->lock);
+			pthread_mutex_unlock(&s->wait_lock);
+			continue;
+			}
+
+		// cold path: claim the track and decode it
+		pthread_rwlock_wrlock(&s->lock);
+		if( cache_find(s,disk,track,side) ){
+			pthread_rwlock_unlock(&s->lock);
+			continue;
+			}
+		c = (cached_t *)calloc(1,sizeof(*c));
+		if( c==NULL ){
+			pthread_rwlock_unlock(&s->lock);
+			reply[0] = SERVE_NOTRACK;
+			return len;
+			}
+		c->disk    = disk;
+		c->track   = track;
+		c->side    = side;
+		c->loading = true;
+		c->next    = s->bucket[bucket_of(disk,track,side)];
+		s->bucket[bucket_of(disk,track,side)] = c;
+		pthread_rwlock_unlock(&s->lock);
+		return client_decode(cl,c,sector,reply);
+		}
+}
+
+static inline bool
+io_full(const int fd, uint8_t *buf, const unsigned int len, const bool out)
+{
+	unsigned int done = 0;
+	ssize_t r;
+
+	while( done<len ){
+		r = out ? send(fd,buf+done,len-done,MSG_NOSIGNAL) : recv(fd,buf+done,len-done,0);
+		if( r<=0 )
+			return false;
+		done += r;
+		}
+	return true;
+}
+
+static void *
+client_thread(void *arg)
+{
+	client_t *cl = (client_t *)arg;
+	uint8_t req[REQUEST];
+	uint8_t reply[REPLY+FLOPPY8_MAX_SSIZE];
+	unsigned int len;
+
+	while( io_full(cl->fd,req,REQUEST,false) ){
+		len = client_request(cl,req,reply);
+		if( !io_full(cl->fd,reply,len,true) )
+			break;
+		}
+	close(cl->fd);
+	floppy8_free(cl->f);
+	free(cl->samples);
+	free(cl);
+	return NULL;
+}
+
+static inline bool
+socket_address(const char *path, struct sockaddr_un *a)
+{
+	memset(a,0,sizeof(*a));
+	a->sun_family = AF_UNIX;
+	if( strlen(path)>=sizeof(a->sun_path) )
+		return false;
+	strcpy(a->sun_path,path);
+	return true;
+}
+
+// Serve sectors on the socket 'path' until an error, decoding tracks with 'cfg' (which must
+// have a thread safe allocator and no sector callback).  Cached tracks are kept within 'cache_bytes'
+int
+serve_run(const char *path, const floppy8_config_t *cfg, const size_t cache_bytes, serve_load_t load, void *arg)
+{
+	server_t *s;
+	client_t *cl;
+	struct sockaddr_un a;
+	pthread_t thread;
+	int fd,conn;
+
+	if( !socket_address(path,&a) )
+		return FLOPPY8_EINVAL;
+	s = (server_t *)calloc(1,sizeof(*s));
+	if( s==NULL )
+		return FLOPPY8_ENOMEM;
+	s->cfg   = *cfg;
+	s->load  = load;
+	s->arg   = arg;
+	s->limit = cache_bytes;
+	pthread_rwlock_init(&s->lock,NULL);
+	pthread_mutex_init(&s->wait_lock,NULL);
+	pthread_cond_init(&s->loaded,NULL);
+
+	fd = socket(AF_UNIX,SOCK_STREAM,0);
+	(void)unlink(path);		// left by an earlier server
+	if( fd<0 || bind(fd,(struct sockaddr *)&a,sizeof(a))!=0 || listen(fd,16)!=0 ){
+		if( fd>=0 )
+			close(fd);
+		free(s);
+		return FLOPPY8_EIO;
+		}
+	for(;;){
+		conn = accept(fd,NULL,NULL);
+		if( conn<0 )
+			continue;
+		cl = (client_t *)calloc(1,sizeof(*cl));
+		if( cl==NULL ){
+			close(conn);
+			continue;
+			}
+		cl->s  = s;
+		cl->fd = conn;
+		if( pthread_create(&thread,NULL,client_thread,cl)!=0 ){
+			close(conn);
+			free(cl);
+			continue;
+			}
+		pthread_detach(thread);
+		}
+	return FLOPPY8_OK;
+}
+
+// Ask a server for one sector.  Its data goes into 'buf' (of FLOPPY8_MAX_SSIZE).
+// Returns a SERVE_ status, or a negative error if the server cannot be reached
+int
+serve_ask(const char *path, const unsigned int disk, const unsigned int track, const unsigned int side, const unsigned int sector,
+	floppy8_sector_t *sec, uint8_t *buf)
+{
+	struct sockaddr_un a;
+	uint8_t req[REQUEST],reply[REPLY];
+	unsigned int size;
+	int fd,ret = FLOPPY8_EIO;
+
+	memset(sec,0,sizeof(*sec));
+	if( !socket_address(path,&a) )
+		return FLOPPY8_EINVAL;
+	fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if( fd<0 )
+		return FLOPPY8_EIO;
+	req[0] = disk;
+	req[1] = disk>>8;
+	req[2] = disk>>16;
+	req[3] = disk>>24;
+	req[4] = track;
+	req[5] = side;
+	req[6] = sector;
+	req[7] = 0;
+	if( connect(fd,(struct sockaddr *)&a,sizeof(a))==0 && io_full(fd,req,REQUEST,true) && io_full(fd,reply,REPLY,false) ){
+		size = reply[4] | (reply[5]<<8) | (reply[6]<<16) | ((unsigned int)reply[7]<<24);
+		if( size<=FLOPPY8_MAX_SSIZE && io_full(fd,buf,size,false) ){
+			sec->size = size;
+			sec->data = size ? buf : NULL;
+			sec->corrected = reply[1];
+			sec->reclassified = reply[2];
+			ret = reply[0];
+			}
+		}
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "floppy8.h"
+
+//	serve --- answer sector requests on a Unix domain socket, decoding tracks on demand
+//
+// Protocol, all numbers little endian.  A client sends any number of 8 byte requests
+//	disk (32 bits), track, side, sector, 0
+// and gets for each an 8 byte reply followed by 'size' bytes of sector data
+//	status, corrected, reclassified, 0, size (32 bits)
+// where corrected and reclassified are the sector's counts (see floppy8_sector_t), at most 255.
+// Disks are numbered in the order the server was given them.
+
+#define	SERVE_OK	0	// sector data follows
+#define	SERVE_MISSING	1	// the track decoded, but not this sector
+#define	SERVE_NOTRACK	2	// no such disk or track, or it could not be read
+#define	SERVE_BADREQ	3	// request out of range
+
+// decode one track of a disk into 'f', using 'samples' (of FLOPPY8_MAX_SAMPLES) if it needs to.
+// Return false if the disk or track does not exist.  Called from several threads at once
+typedef bool (*serve_load_t)(void *arg, floppy8_t *f, sample_t *samples, unsigned int disk, unsigned int track, unsigned int side);
+
+int	serve_run(const char *path, const floppy8_config_t *cfg, size_t cache_bytes, serve_load_t load, void *arg);
+int	serve_ask(const char *path, unsigned int disk, unsigned int track, unsigned int side, unsigned int sector,
+		floppy8_sector_t *s, uint8_t *buf);
+
+#endif
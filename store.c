@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "floppy8.h"
+#include "store.h"
+
+//	store --- content addressed archive of decoded disks
+//
+// Each decoded sector is hashed, and written to objects/ only if no disk stored before had
+// the same data.  A disk's manifest lists its sectors and tracks by hash.  The index is
+// rebuilt from all the manifests when the store is closed, sorted so that a lookup is a
+// binary search of the file (as look(1) does) however large the archive grows.
+// Objects and manifests are written under a temporary name and renamed into place, so a
+// store is never left with a partial file.
+
+#define	NTRACKS		FLOPPY8_NTRACKS
+#define	NSIDES		FLOPPY8_NSIDES
+#define	NSECTORS	FLOPPY8_NSECTORS
+#define	NAME_LEN	256	// longest disk name kept
+
+struct store {
+	char		*dir;
+	bool		made[256];	// objects/xx directories known to exist
+};
+
+// SHA-256 (FIPS 180-4)
+typedef struct sha256 {
+	uint32_t	h[8];
+	uint64_t	len;
+	uint8_t		buf[64];
+	unsigned int	n;
+} sha256_t;
+
+static const uint32_t K256[64] = {
+	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+	0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+	0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+	0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+	0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2,
+};
+
+#define	ROR(x,n)	(((x)>>(n)) | ((x)<<(32-(n))))
+
+static inline void
+sha256_block(sha256_t *c, const uint8_t *p)
+{
+	uint32_t w[64],a,b,d,e,f,g,h,cc,t1,t2;
+	unsigned int i;
+
+	for(i=0;i<16;i++)
+		w[i] = (uint32_t)p[4*i]<<24 | (uint32_t)p[4*i+1]<<16 | (uint32_t)p[4*i+2]<<8 | p[4*i+3];
+	for(;i<64;i++)
+		w[i] = w[i-16] + (ROR(w[i-15],7) ^ ROR(w[i-15],18) ^ (w[i-15]>>3))
+			+ w[i-7] + (ROR(w[i-2],17) ^ ROR(w[i-2],19) ^ (w[i-2]>>10));
+	a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+	e = c->h[4]; f = c->h[5]; g = c->h[6]; h = c->h[7];
+	for(i=0;i<64;i++){
+		t1 = h + (ROR(e,6) ^ ROR(e,11) ^ ROR(e,25)) + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+		t2 = (ROR(a,2) ^ ROR(a,13) ^ ROR(a,22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+		h = g; g = f; f = e; e = d + t1;
+		d = cc; cc = b; b = a; a = t1 + t2;
+		}
+	c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+	c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+static inline void
+sha256_init(sha256_t *c)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19,
+	};
+
+	memcpy(c->h,h0,sizeof(h0));
+	c->len = 0;
+	c->n = 0;
+}
+
+static inline void
+sha256_update(sha256_t *c, const uint8_t *p, size_t len)
+{
+	c->len += len;
+	while( len ){
+		if( c->n==0 && len>=64 ){
+			sha256_block(c,p);
+			p += 64;
+			len -= 64;
+			continue;
+			}
+		c->buf[c->n++] = *p++;
+		len--;
+		if( c->n==64 ){
+			sha256_block(c,c->buf);
+			c->n = 0;
+			}
+		}
+}
+
+static inline void
+sha256_final(sha256_t *c, uint8_t *hash)
+{
+	uint64_t bits = c->len*8;
+	uint8_t pad[72];
+	unsigned int i,n;
+
+	n = (c->n<56) ? 56-c->n : 120-c->n;
+	memset(pad,0,sizeof(pad));
+	pad[0] = 0x80;
+	for(i=0;i<8;i++)
+		pad[n+i] = bits >> (56-8*i);
+	sha256_update(c,pad,n+8);
+	for(i=0;i<32;i++)
+		hash[i] = c->h[i/4] >> (24-8*(i%4));
+}
+
+static inline void
+hash_hex(const uint8_t *hash, char *hex)
+{
+	static const char digit[] = "0123456789abcdef";
+	unsigned int i;
+
+	for(i=0;i<STORE_HASH;i++){
+		hex[2*i]   = digit[hash[i]>>4];
+		hex[2*i+1] = digit[hash[i]&15];
+		}
+	hex[2*i] = 0;
+}
+
+static inline bool
+is_hash(const char *s)
+{
+	unsigned int i;
+
+	for(i=0;i<STORE_HEX-1;i++)
+		if( !isxdigit((unsigned char)s[i]) || isupper((unsigned char)s[i]) )
+			return false;
+	return s[i]==0;
+}
+
+// write a whole file under a temporary name, then rename it into place
+static inline bool
+file_write(const char *path, const void *data, const size_t len)
+{
+	char tmp[FILENAME_MAX+16];
+	FILE *fp;
+	bool ok;
+
+	snprintf(tmp,sizeof(tmp),"%s.%d.tmp",path,(int)getpid());
+	fp = fopen(tmp,"w");
+	if( fp==NULL )
+		return false;
+	ok = fwrite(data,1,len,fp)==len;
+	ok = (fclose(fp)==0) && ok;
+	if( ok && rename(tmp,path)==0 )
+		return true;
+	unlink(tmp);
+	return false;
+}
+
+static inline bool
+dir_make(const char *path)
+{
+	return mkdir(path,0777)==0 || errno==EEXIST;
+}
+
+store_t *
+store_open(const char *dir)
+{
+	store_t *st;
+	char path[FILENAME_MAX];
+
+	st = (store_t *)calloc(1,sizeof(*st));
+	if( st==NULL )
+		return NULL;
+	st->dir = strdup(dir);
+	if( st->dir==NULL || !dir_make(dir) ){
+		free(st->dir);
+		free(st);
+		return NULL;
+		}
+	snprintf(path,sizeof(path),"%s/objects",dir);
+	if( dir_make(path) ){
+		snprintf(path,sizeof(path),"%s/disks",dir);
+		if( dir_make(path) )
+			return st;
+		}
+	free(st->dir);
+	free(st);
+	return NULL;
+}
+
+// keep one sector's data, unless the store has it already.  Return 1 if written
+static inline int
+object_put(store_t *st, const char *hex, const uint8_t *data, const unsigned int size)
+{
+	char path[FILENAME_MAX];
+	struct stat sb;
+	unsigned int xx;
+
+	if( sscanf(hex,"%2x",&xx)!=1 )
+		return FLOPPY8_EINVAL;
+	snprintf(path,sizeof(path),"%s/objects/%.2s",st->dir,hex);
+	if( !st->made[xx] ){
+		if( !dir_make(path) )
+			return FLOPPY8_EIO;
+		st->made[xx] = true;
+		}
+	snprintf(path,sizeof(path),"%s/objects/%.2s/%s",st->dir,hex,&hex[2]);
+	if( stat(path,&sb)==0 && sb.st_size==size )
+		return 0;
+	return file_write(path,data,size) ? 1 : FLOPPY8_EIO;
+}
+
+static inline const char *
+sector_status(const floppy8_sector_t *s)
+{
+	unsigned int i;
+
+	if( s->size==0 || s->data==NULL )
+		return "MISSING";
+	for(i=1;i<s->size;i++)
+		if( s->data[i]!=s->data[0] )
+			return "DATA";
+	return s->data[0] ? "FILL" : "ZERO";
+}
+
+// disk names go in index lines, so no spaces or slashes: the last part of the path,
+// less any .f8
+static inline void
+name_clean(const char *name, char *clean, const size_t size)
+{
+	size_t len = strlen(name),start,i;
+
+	while( len>1 && name[len-1]=='/' )	// DiskNNN/ names the directory
+		len--;
+	for(start=len;start>0 && name[start-1]!='/';start--)
+		;
+	for(i=0;i+1<size && start+i<len;i++)
+		clean[i] = isgraph((unsigned char)name[start+i]) ? name[start+i] : '_';
+	clean[i] = 0;
+	if( i>3 && strcmp(&clean[i-3],".f8")==0 )
+		clean[i-3] = 0;
+}
+
+// add the sectors of the disk decoded into 'f' to the store, as disk 'name'
+int
+store_disk(store_t *st, const char *name, const floppy8_t *f, store_stats_t *stats)
+{
+	const floppy8_sector_t *s;
+	unsigned int track,side,sector,sector_min = NSECTORS,sector_max = 0,present;
+	unsigned int sides = floppy8_sides(f);
+	uint8_t hash[STORE_HASH],zero[STORE_HASH];
+	uint8_t head[3];
+	char hex[STORE_HEX],clean[NAME_LEN],path[FILENAME_MAX];
+	char *man,*p;
+	size_t size;
+	sha256_t c,t;
+	int r;
+
+	memset(stats,0,sizeof(*stats));
+	memset(zero,0,sizeof(zero));
+	name_clean(name,clean,sizeof(clean));
+	if( clean[0]==0 )
+		return FLOPPY8_EINVAL;
+
+	// the range of sectors used anywhere on the disk, as disk_show() has it
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<sides;side++)
+	for(sector=0;sector<NSECTORS;sector++){
+		if( floppy8_sector(f,track,side,sector)->size ){
+			if( sector<sector_min )
+				sector_min = sector;
+			if( sector>sector_max )
+				sector_max = sector;
+			}
+		}
+	if( sector_min>1 )
+		sector_min = 1;
+
+	size = 64 + (size_t)NTRACKS*NSIDES*(NSECTORS+1)*(STORE_HEX+48);
+	man = (char *)malloc(size);
+	if( man==NULL )
+		return FLOPPY8_ENOMEM;
+	p = man;
+	p += sprintf(p,"# floppy8 manifest 1\n");
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<sides;side++){	// side 1 only for double sided disks
+		sha256_init(&t);
+		present = 0;
+		for(sector=sector_min;sector<=sector_max;sector++){
+			s = floppy8_sector(f,track,side,sector);
+			head[0] = sector;
+			head[1] = s->size;
+			head[2] = s->size >> 8;
+			sha256_update(&t,head,sizeof(head));
+			if( s->size==0 || s->data==NULL ){
+				stats->missing++;
+				sha256_update(&t,zero,sizeof(zero));
+				p += sprintf(p,"S %u %u %u 0 MISSING 0 0 -\n",track,side,sector);
+				continue;
+				}
+			sha256_init(&c);
+			sha256_update(&c,s->data,s->size);
+			sha256_final(&c,hash);
+			sha256_update(&t,hash,sizeof(hash));
+			hash_hex(hash,hex);
+			r = object_put(st,hex,s->data,s->size);
+			if( r<0 ){
+				free(man);
+				return r;
+				}
+			stats->sectors++;
+			stats->bytes += s->size;
+			stats->objects += r;
+			stats->new_bytes += r*s->size;
+			present++;
+			p += sprintf(p,"S %u %u %u %u %s %u %u %s\n",track,side,sector,s->size,sector_status(s),
+				s->corrected,s->reclassified,hex);
+			}
+		if( present ){
+			sha256_final(&t,hash);
+			hash_hex(hash,hex);
+			p += sprintf(p,"T %u %u %s\n",track,side,hex);
+			}
+		}
+	snprintf(path,sizeof(path),"%s/disks/%s",st->dir,clean);
+	r = file_write(path,man,p-man) ? FLOPPY8_OK : FLOPPY8_EIO;
+	free(man);
+	return r;
+}
+
+static int
+line_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+// rebuild the index from every manifest in the store
+static inline int
+index_build(const char *dir)
+{
+	char path[FILENAME_MAX],line[STORE_HEX+NAME_LEN+64],hex[STORE_HEX],status[16],kind;
+	unsigned int track,side,sector,size,corrected,reclassified;
+	char **lines = NULL,**more,*text,*p;
+	size_t n = 0,max = 0,len = 0,i;
+	struct dirent *de;
+	DIR *d;
+	FILE *fp;
+	int r = FLOPPY8_OK;
+
+	snprintf(path,sizeof(path),"%s/disks",dir);
+	d = opendir(path);
+	if( d==NULL )
+		return FLOPPY8_EIO;
+	while( r==FLOPPY8_OK && (de=readdir(d))!=NULL ){
+		if( de->d_name[0]=='.' || strstr(de->d_name,".tmp") )
+			continue;
+		snprintf(path,sizeof(path),"%s/disks/%s",dir,de->d_name);
+		fp = fopen(path,"r");
+		if( fp==NULL )
+			continue;
+		while( fgets(line,sizeof(line),fp) ){
+			kind = line[0];
+			if( kind=='S' && sscanf(line,"S %u %u %u %u %15s %u %u %64s",&track,&side,&sector,&size,
+					status,&corrected,&reclassified,hex)==8 && is_hash(hex) )
+				snprintf(line,sizeof(line),"%s S %s %u %u %u\n",hex,de->d_name,track,side,sector);
+			else if( kind=='T' && sscanf(line,"T %u %u %64s",&track,&side,hex)==3 && is_hash(hex) )
+				snprintf(line,sizeof(line),"%s T %s %u %u\n",hex,de->d_name,track,side);
+			else
+				continue;
+			if( n==max ){
+				max = max ? 2*max : 4096;
+				more = (char **)realloc(lines,max*sizeof(char *));
+				if( more==NULL ){
+					r = FLOPPY8_ENOMEM;
+					break;
+					}
+				lines = more;
+				}
+			lines[n] = strdup(line);
+			if( lines[n]==NULL ){
+				r = FLOPPY8_ENOMEM;
+				break;
+				}
+			len += strlen(lines[n++]);
+			}
+		fclose(fp);
+		}
+	closedir(d);
+
+	if( r==FLOPPY8_OK ){
+		qsort(lines,n,sizeof(char *),line_compare);
+		text = (char *)malloc(len+1);
+		if( text==NULL )
+			r = FLOPPY8_ENOMEM;
+		else{
+			for(p=text,i=0;i<n;i++)
+				p = stpcpy(p,lines[i]);
+			snprintf(path,sizeof(path),"%s/index",dir);
+			if( !file_write(path,text,len) )
+				r = FLOPPY8_EIO;
+			free(text);
+			}
+		}
+	for(i=0;i<n;i++)
+		free(lines[i]);
+	free(lines);
+	return r;
+}
+
+int
+store_close(store_t *st)
+{
+	int r;
+
+	if( st==NULL )
+		return FLOPPY8_OK;
+	r = index_build(st->dir);
+	free(st->dir);
+	free(st);
+	return r;
+}
+
+// the hash a key stands for: a hash itself, a stored disk's track DISK:T (DISK:T_H for side H)
+// or sector DISK:T:S (DISK:T:H:S for side H), or a file holding one sector's data.
+// A track of side H cannot be DISK:T:H, which is sector H of side 0
+static inline bool
+key_hash(const char *dir, const char *key, char *hex)
+{
+	char path[FILENAME_MAX],line[256],name[NAME_LEN],h[STORE_HEX];
+	unsigned int track,head = 0,sector = 0,t,side,s,fields = 0;
+	uint8_t buf[FLOPPY8_MAX_SSIZE+1],hash[STORE_HASH];
+	const char *colon,*first;
+	bool want_sector,found = false;
+	sha256_t c;
+	size_t len;
+	FILE *fp;
+
+	if( is_hash(key) ){
+		strcpy(hex,key);
+		return true;
+		}
+	colon = strrchr(key,':');
+	if( colon ){
+		// up to 3 numbers after the disk name, which may itself hold colons
+		while( fields<2 ){
+			for(first=colon-1;first>key && isdigit((unsigned char)*first);first--)
+				;
+			if( first==key || *first!=':' || first+1==colon )
+				break;
+			colon = first;
+			fields++;
+			}
+		want_sector = fields>0;
+		switch(fields){
+		case 0:
+			if( sscanf(colon+1,"%u_%u",&track,&head)<1 )
+				return false;
+			break;
+		case 1:
+			if( sscanf(colon+1,"%u:%u",&track,&sector)!=2 )
+				return false;
+			break;
+		default:
+			if( sscanf(colon+1,"%u:%u:%u",&track,&head,&sector)!=3 )
+				return false;
+			break;
+		}
+		if( colon==key )
+			return false;
+		snprintf(path,sizeof(path),"%.*s",(int)(colon-key),key);
+		name_clean(path,name,sizeof(name));
+		snprintf(path,sizeof(path),"%s/disks/%s",dir,name);
+		fp = fopen(path,"r");
+		if( fp==NULL )
+			return false;
+		while( !found && fgets(line,sizeof(line),fp) ){
+			if( want_sector )
+				found = sscanf(line,"S %u %u %u %*u %*s %*u %*u %64s",&t,&side,&s,h)==4
+					&& t==track && side==head && s==sector && is_hash(h);
+			else
+				found = sscanf(line,"T %u %u %64s",&t,&side,h)==3 && t==track && side==head && is_hash(h);
+			}
+		fclose(fp);
+		if( found )
+			strcpy(hex,h);
+		return found;
+		}
+	fp = fopen(key,"rb");
+	if( fp==NULL )
+		return false;
+	len = fread(buf,1,sizeof(buf),fp);
+	fclose(fp);
+	if( len==0 || len>FLOPPY8_MAX_SSIZE )
+		return false;
+	sha256_init(&c);
+	sha256_update(&c,buf,len);
+	sha256_final(&c,hash);
+	hash_hex(hash,hex);
+	return true;
+}
+
+// start of the line holding offset 'i'
+static inline size_t
+line_start(const char *text, size_t i)
+{
+	while( i>0 && text[i-1]!='\n' )
+		i--;
+	return i;
+}
+
+// report everywhere 'key' is found in the store's index.  Return the count, or an error
+int
+store_find(const char *dir, const char *key, store_found_t found, void *arg)
+{
+	char path[FILENAME_MAX],hex[STORE_HEX],disk[NAME_LEN],kind;
+	unsigned int track,side,sector,count = 0;
+	size_t lo,hi,mid,size,i;
+	const char *text,*nl = NULL;
+	struct stat sb;
+	int fd,n;
+
+	if( !key_hash(dir,key,hex) )
+		return FLOPPY8_EINVAL;
+	snprintf(path,sizeof(path),"%s/index",dir);
+	fd = open(path,O_RDONLY);
+	if( fd<0 )
+		return FLOPPY8_EIO;
+	if( fstat(fd,&sb)!=0 ){
+		close(fd);
+		return FLOPPY8_EIO;
+		}
+	size = sb.st_size;
+	if( size==0 ){
+		close(fd);
+		return 0;
+		}
+	text = (const char *)mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if( text==MAP_FAILED )
+		return FLOPPY8_EIO;
+
+	// first line not less than the hash
+	lo = 0;
+	hi = size;
+	while( lo<hi ){
+		mid = line_start(text,lo+(hi-lo)/2);
+		if( mid<lo )
+			mid = lo;
+		nl = (const char *)memchr(&text[mid],'\n',size-mid);
+		if( size-mid>=STORE_HEX-1 && memcmp(&text[mid],hex,STORE_HEX-1)<0 )
+			lo = nl ? (size_t)(nl-text)+1 : size;
+		else if( mid==lo )
+			break;
+		else
+			hi = mid;
+		}
+	for(i=lo;i<size && size-i>=STORE_HEX-1 && memcmp(&text[i],hex,STORE_HEX-1)==0;i=(size_t)(nl-text)+1){
+		nl = (const char *)memchr(&text[i],'\n',size-i);
+		if( nl==NULL )
+			break;
+		sector = 0;
+		n = sscanf(&text[i+STORE_HEX]," %c %255s %u %u %u",&kind,disk,&track,&side,&sector);
+		if( n>=4 ){
+			found(arg,hex,kind,disk,track,side,sector);
+			count++;
+			}
+		}
+	munmap((void *)text,size);
+	return count;
+}
@@ -0,0 +1,44 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include "floppy8.h"
+
+//	store --- content addressed archive of decoded disks
+//
+// A store is a directory holding
+//	objects/xx/yyyy...	the data of every distinct sector, once, named by its SHA-256
+//				in hex (xx is the first 2 digits)
+//	disks/NAME		a manifest for each disk, one line per sector and per track
+//				  S track side sector size status corrected reclassified hash
+//				  T track side hash
+//				status is DATA, ZERO, FILL or MISSING (hash '-').  A track hash
+//				covers its sectors' numbers, sizes and hashes, in order
+//	index			every hash in the manifests with where it is, sorted by hash
+//				  hash S disk track side sector
+//				  hash T disk track side
+// Blank sectors, system tracks and common files shared by many disks are stored once.
+
+#define	STORE_HASH	32			// bytes in a SHA-256
+#define	STORE_HEX	(2*STORE_HASH+1)	// as a hex string
+
+typedef struct store store_t;
+
+// what store_disk() did
+typedef struct store_stats {
+	unsigned long	sectors;	// sectors with data
+	unsigned long	missing;	// sectors in the disk's range with no data
+	unsigned long	bytes;		// data in them
+	unsigned long	objects;	// sectors new to the store
+	unsigned long	new_bytes;	// data in them
+} store_stats_t;
+
+// one place a hash was found.  kind is 'S' for a sector, 'T' for a whole track (sector is 0)
+typedef void (*store_found_t)(void *arg, const char *hash, char kind, const char *disk,
+		unsigned int track, unsigned int side, unsigned int sector);
+
+store_t	*store_open(const char *dir);
+int	store_disk(store_t *st, const char *name, const floppy8_t *f, store_stats_t *stats);
+int	store_close(store_t *st);
+int	store_find(const char *dir, const char *key, store_found_t found, void *arg);
+
+#endif
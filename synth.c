@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "floppy8.h"
+
+//	synth --- encode sectors into samples, as the capture device would record them
+//
+// The track is laid out as the decoder expects (see the FM, MFM and M2FM layouts in floppy8.c),
+// encoded into half bit cells (a clock slot and a data slot per bit) and the gaps between
+// pulses measured in capture clock ticks.  The drive can be made fast or slow, its speed can
+// wobble within a revolution, pulses can be moved by random jitter, and data bits can be
+// flipped, fresh for each revolution, so the decoder's recovery can be measured against
+// known data.  Random numbers come from a seeded generator, so the same settings give the
+// same samples.
+
+#define	FM_CELL		4000.0		// ns, 250 kbit/s
+#define	MFM_CELL	2000.0		// ns, 500 kbit/s, M2FM too
+#define	RPM		360.0
+#define	REVOLUTIONS	3
+#define	FILL_BYTE	0xE5		// sectors with no data given
+
+#define	MAX_TRACK_BYTES	16384		// more than a track at any sensible speed
+#define	MAX_SLOTS	(MAX_TRACK_BYTES*16)
+
+// one byte of the track layout, and how to encode it
+#define	B_NORMAL	0
+#define	B_SYNC		1		// MFM A1/C2 with a missing clock pulse, M2FM mark with its clock
+#define	B_DATA		2		// data field byte, for injected errors
+
+typedef struct layout {
+	uint8_t		byte[MAX_TRACK_BYTES];
+	uint8_t		clock[MAX_TRACK_BYTES];	// FM, or M2FM mark, clock pattern
+	uint8_t		kind[MAX_TRACK_BYTES];
+	uint8_t		sector[MAX_TRACK_BYTES];	// data field bytes: sector number
+	uint16_t	offset[MAX_TRACK_BYTES];	// and byte within the field
+	unsigned int	n;
+	unsigned int	max;
+} layout_t;
+
+typedef struct rng {
+	uint64_t	s;
+} rng_t;
+
+static inline uint64_t
+rng_next(rng_t *r)
+{
+	// xorshift64*
+	r->s ^= r->s >> 12;
+	r->s ^= r->s << 25;
+	r->s ^= r->s >> 27;
+	return r->s * 0x2545F4914F6CDD1DULL;
+}
+
+static inline double
+rng_uniform(rng_t *r)
+{
+	return (rng_next(r) >> 11) * (1.0/9007199254740992.0);
+}
+
+// roughly normal, unit variance: the sum of 4 uniforms is close enough for jitter and cheap
+static inline double
+rng_normal(rng_t *r)
+{
+	return (rng_uniform(r)+rng_uniform(r)+rng_uniform(r)+rng_uniform(r)-2.0)*1.7320508;
+}
+
+static inline unsigned short
+crc16_update (unsigned short crc, const uint8_t *buf, const unsigned int count)
+{
+	unsigned int i;
+	uint8_t x;
+
+	for(i=0; i<count; i++){
+		x = crc >> 8 ^ buf[i];
+		x ^= x >> 4;
+		crc = (crc << 8) ^ ((unsigned short) (x << 12)) ^ ((unsigned short) (x << 5)) ^ ((unsigned short) x);
+	}
+	return crc;
+}
+
+static inline void
+put(layout_t *l, const uint8_t byte, const uint8_t clock, const uint8_t kind)
+{
+	if( l->n>=l->max )
+		return;
+	l->byte[l->n]  = byte;
+	l->clock[l->n] = clock;
+	l->kind[l->n]  = kind;
+	l->n++;
+}
+
+static inline void
+put_n(layout_t *l, const uint8_t byte, unsigned int count)
+{
+	while( count-- )
+		put(l,byte,0xFF,B_NORMAL);
+}
+
+// a mark and the field that follows it, with its CRC.  MFM marks have 3 sync bytes ahead,
+// M2FM has its own marks: 0E (clock 70) for FE, 0B (clock 70) for FB
+static inline void
+put_field(layout_t *l, const int format, uint8_t mark, const uint8_t *data, const unsigned int len, const int sector)
+{
+	uint8_t sync[4] = { 0xA1, 0xA1, 0xA1, mark };
+	unsigned short crc;
+	unsigned int i;
+
+	if( format==FLOPPY8_MFM ){
+		for(i=0;i<3;i++)
+			put(l,0xA1,0xFF,B_SYNC);
+		put(l,mark,0xFF,B_NORMAL);
+		crc = crc16_update(0xFFFF,sync,4);
+		}
+	else if( format==FLOPPY8_M2FM ){
+		mark &= 0x0F;
+		put(l,mark,0x70,B_SYNC);
+		crc = crc16_update(0xFFFF,&mark,1);
+		}
+	else{
+		put(l,mark,0xC7,B_NORMAL);
+		crc = crc16_update(0xFFFF,&mark,1);
+		}
+	crc = crc16_update(crc,data,len);
+	for(i=0;i<len;i++){
+		if( sector>=0 && l->n<l->max ){
+			l->sector[l->n] = sector;
+			l->offset[l->n] = i;
+			}
+		put(l,data[i],0xFF,(sector>=0) ? B_DATA : B_NORMAL);
+		}
+	put(l,crc>>8,0xFF,B_NORMAL);
+	put(l,crc&0xFF,0xFF,B_NORMAL);
+}
+
+// Lay out one track.  Returns false if the sectors do not fit
+static inline bool
+track_layout(layout_t *l, const floppy8_synth_t *s, const uint8_t *data, const unsigned int track_bytes)
+{
+	const bool mfm = (s->format==FLOPPY8_MFM);
+	const uint8_t gap = (s->format==FLOPPY8_FM) ? 0xFF : 0x4E;	// M2FM has FM's layout with 4E gaps
+	const unsigned int zeros = mfm ? 12 : 6;
+	const unsigned int gap2 = mfm ? 22 : 11;
+	const unsigned int min_gap3 = mfm ? 24 : 14;
+	unsigned int ssize = 128 << s->size;
+	unsigned int interleave = s->interleave ? s->interleave : 1;
+	unsigned int lead,per_sector,gap3,i,k,pos,sector;
+	uint8_t order[FLOPPY8_NSECTORS];
+	bool used[FLOPPY8_NSECTORS];
+	uint8_t addr[4];
+	uint8_t fill[FLOPPY8_MAX_SSIZE];
+
+	// gap 4a, sync, index mark, gap 1
+	lead = mfm ? 80+12+4+50 : 40+6+1+26;
+	per_sector = zeros + (mfm ? 4 : 1) + 4 + 2 + gap2 + zeros + (mfm ? 4 : 1) + ssize + 2;
+	if( track_bytes<lead || s->spt==0 || s->spt>=FLOPPY8_NSECTORS )
+		return false;
+	gap3 = (track_bytes-lead)/s->spt;
+	gap3 = (gap3>per_sector) ? gap3-per_sector : 0;
+	if( gap3>(mfm ? 54u : 27u) )
+		gap3 = mfm ? 54 : 27;
+	if( gap3<min_gap3 )
+		return false;
+
+	// physical order of the sectors
+	memset(used,0,sizeof(used));
+	for(i=0,pos=0;i<s->spt;i++){
+		while( used[pos] )
+			pos = (pos+1) % s->spt;
+		order[pos] = i+1;
+		used[pos] = true;
+		pos = (pos+interleave) % s->spt;
+		}
+
+	l->n   = 0;
+	l->max = track_bytes;
+	put_n(l,gap,mfm ? 80 : 40);
+	put_n(l,0x00,zeros);
+	if( mfm ){
+		for(i=0;i<3;i++)
+			put(l,0xC2,0xFF,B_SYNC);
+		put(l,0xFC,0xFF,B_NORMAL);
+		}
+	else if( s->format==FLOPPY8_M2FM )
+		put(l,0x0C,0x71,B_SYNC);
+	else
+		put(l,0xFC,0xD7,B_NORMAL);
+	put_n(l,gap,mfm ? 50 : 26);
+	memset(fill,FILL_BYTE,sizeof(fill));
+	for(k=0;k<s->spt;k++){
+		sector = order[k];
+		addr[0] = s->track;
+		addr[1] = s->side;
+		addr[2] = sector;
+		addr[3] = s->size;
+		put_n(l,0x00,zeros);
+		put_field(l,s->format,0xFE,addr,4,-1);
+		put_n(l,gap,gap2);
+		put_n(l,0x00,zeros);
+		put_field(l,s->format,0xFB,data ? &data[(sector-1)*ssize] : fill,ssize,sector);
+		put_n(l,gap,gap3);
+		}
+	while( l->n<l->max )
+		put(l,gap,0xFF,B_NORMAL);
+	return true;
+}
+
+// Encode the layout into clock and data slots, 1 for a pulse
+static inline unsigned int
+track_slots(const layout_t *l, const int format, uint8_t *slot)
+{
+	unsigned int i,b,n = 0;
+	uint8_t byte,clock,bit,prev = 0,prev_clock = 0;
+	uint16_t word;
+
+	for(i=0;i<l->n;i++){
+		byte = l->byte[i];
+		if( format==FLOPPY8_FM ){
+			clock = l->clock[i];
+			for(b=0;b<8;b++){
+				slot[n++] = (clock>>(7-b)) & 1;
+				slot[n++] = (byte>>(7-b)) & 1;
+				}
+			continue;
+			}
+		if( format==FLOPPY8_M2FM ){
+			// a clock pulse between two zero data bits, unless there was one before
+			for(b=0;b<8;b++){
+				bit = (byte>>(7-b)) & 1;
+				clock = (l->kind[i]==B_SYNC) ? (l->clock[i]>>(7-b)) & 1 : !prev && !bit && !prev_clock;
+				slot[n++] = clock;
+				slot[n++] = bit;
+				prev = bit;
+				prev_clock = clock;
+				}
+			continue;
+			}
+		// MFM: a clock pulse between two zero data bits
+		word = 0;
+		for(b=0;b<8;b++){
+			word = (word<<2) | ((!prev && !((byte>>(7-b)) & 1)) << 1) | ((byte>>(7-b)) & 1);
+			prev = (byte>>(7-b)) & 1;
+			}
+		if( l->kind[i]==B_SYNC )
+			word = (byte==0xA1) ? 0x4489 : 0x5224;	// one clock pulse left out
+		for(b=0;b<16;b++)
+			slot[n++] = (word>>(15-b)) & 1;
+		}
+	return n;
+}
+
+// Encode one track as 'samples' (up to 'max'), repeating it for each revolution.
+// 'data' is the sectors in order, sector 1 first, or NULL to fill them with E5.
+// Fills in 'cap' with the clock and index pulses.  Returns the number of samples,
+// zero if the settings are impossible
+unsigned int
+floppy8_synth(const floppy8_synth_t *s, const uint8_t *data, sample_t *samples, const unsigned int max, floppy8_capture_t *cap)
+{
+	layout_t *l;
+	uint8_t *slot;
+	unsigned int clock = s->clock ? s->clock : 600;
+	unsigned int shift = s->clock ? s->shift : 4;
+	unsigned int revs = s->revolutions ? s->revolutions : REVOLUTIONS;
+	double cell = (s->cell>0.0) ? s->cell : (s->format==FLOPPY8_FM) ? FM_CELL : MFM_CELL;
+	double rpm = (s->rpm>0.0) ? s->rpm : RPM;
+	double ticks_ns = clock/1000.0/(1u<<shift);	// capture ticks per ns
+	double slot_ticks,jitter,t,last,pos,speed,d = 0.0;
+	unsigned int track_bytes,nslots,r,i,e,k,n = 0;
+	rng_t rng;
+	uint32_t flips[64];
+	unsigned int nflips;
+
+	memset(cap,0,sizeof(*cap));
+	if( s->format<FLOPPY8_FM || s->format>FLOPPY8_M2FM || s->size>=FLOPPY8_NSIZES || shift>=16 || clock==0 )
+		return 0;
+	track_bytes = (unsigned int)(60e9/rpm/(cell*8));
+	if( track_bytes>MAX_TRACK_BYTES )
+		return 0;
+	l = (layout_t *)malloc(sizeof(*l));
+	slot = (uint8_t *)malloc(MAX_SLOTS);
+	if( l==NULL || slot==NULL || !track_layout(l,s,data,track_bytes) ){
+		free(l);
+		free(slot);
+		return 0;
+		}
+	nslots = track_slots(l,s->format,slot);
+	slot_ticks = cell/2*ticks_ns;
+	jitter = s->jitter*ticks_ns;
+	rng.s = (s->seed*0x9E3779B97F4A7C15ULL) ^ ((uint64_t)(s->track*2+s->side+1) << 32) ^ 1;
+
+	cap->clock = clock;
+	cap->shift = shift;
+	t = last = 0.0;
+	for(r=0;r<revs && n<max;r++){
+		if( cap->nindex<FLOPPY8_MAX_INDEX ){
+			cap->index[cap->nindex]  = n;
+			cap->cycles[cap->nindex] = (uint32_t)(t*(1u<<shift));
+			cap->nindex++;
+			}
+		// fresh bit errors for this revolution, in data field data bits
+		nflips = 0;
+		for(e=0;e<s->errors && nflips<sizeof(flips)/sizeof(flips[0]);e++){
+			for(k=0;k<64;k++){
+				i = rng_next(&rng) % l->n;
+				if( l->kind[i]==B_DATA )
+					break;
+				}
+			if( k==64 )
+				break;
+			flips[nflips] = i*16 + (rng_next(&rng)%8)*2 + 1;
+			slot[flips[nflips]] ^= 1;
+			if( s->flip )
+				s->flip(s->arg,r,l->sector[i],l->offset[i]*8 + (flips[nflips]-i*16-1)/2);
+			nflips++;
+			}
+		for(i=0;i<nslots && n<max;i++){
+			if( (i&15)==0 ){
+				// speed wobbles once per revolution
+				speed = 1.0 + s->speed + s->drift*sin(2*M_PI*i/nslots);
+				d = slot_ticks/speed;
+				}
+			t += d;
+			if( !slot[i] )
+				continue;
+			pos = t + (jitter>0.0 ? jitter*rng_normal(&rng) : 0.0);
+			if( pos-last>=SAMPLE_MAX )
+				samples[n++] = SAMPLE_MAX;
+			else if( pos>last )
+				samples[n++] = (sample_t)(pos-last+0.5);
+			else
+				samples[n++] = 1;
+			last = pos;
+			}
+		for(e=0;e<nflips;e++)
+			slot[flips[e]] ^= 1;
+		}
+	if( n<max && cap->nindex<FLOPPY8_MAX_INDEX ){
+		cap->index[cap->nindex]  = n;
+		cap->cycles[cap->nindex] = (uint32_t)(t*(1u<<shift));
+		cap->nindex++;
+		}
+	free(l);
+	free(slot);
+	return n;
+}
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "floppy8.h"
+#include "watch.h"
+
+//	watch --- decode track captures as soon as they are written
+//
+// The main thread reads inotify events and queues a job for each finished track file.
+// Worker threads take the oldest job whose disk is not already being decoded, so tracks of
+// one disk are decoded in order by one worker at a time (they share the disk's decoder
+// context), while different disks are decoded in parallel.  A file written again before
+// its job starts is queued only once.
+
+#define	NTRACKS		FLOPPY8_NTRACKS
+#define	NSIDES		FLOPPY8_NSIDES
+#define	EVENTS		(4096 + sizeof(struct inotify_event) + NAME_MAX + 1)
+
+// a watched directory
+typedef struct disk {
+	char		*path;
+	int		wd;		// inotify watch
+	bool		busy;		// a worker has one of its tracks
+	void		*state;		// for the decode callback
+} disk_t;
+
+typedef struct job {
+	struct job	*next;
+	disk_t		*disk;
+	unsigned int	track;
+	unsigned int	side;
+	char		*path;
+} job_t;
+
+typedef struct watcher {
+	watch_track_t	decode;
+	void		*arg;
+	int		fd;		// inotify
+	pthread_mutex_t	lock;		// the queue and busy flags
+	pthread_cond_t	ready;		// a job queued or a disk freed
+	job_t		*head;
+	job_t		**tail;
+	disk_t		**disks;	// disks[0] is the directory being watched
+	unsigned int	ndisks;
+} watcher_t;
+
+// track number and side of a TrackNN.raw or TrackNN_S.raw name
+static inline bool
+track_of(const char *name, unsigned int *track, unsigned int *side)
+{
+	size_t len = strlen(name);
+
+	return len>4 && strcmp(&name[len-4],".raw")==0 && floppy8_track_of(name,track,side);
+}
+
+static inline void
+job_add(watcher_t *w, disk_t *d, const unsigned int track, const unsigned int side)
+{
+	char path[FILENAME_MAX];
+	job_t *j;
+
+	floppy8_track_name(path,sizeof(path),d->path,track,side);
+	pthread_mutex_lock(&w->lock);
+	for(j=w->head;j;j=j->next)
+		if( j->disk==d && j->track==track && j->side==side )
+			break;
+	if( j==NULL ){
+		j = (job_t *)calloc(1,sizeof(*j));
+		if( j )
+			j->path = strdup(path);
+		if( j==NULL || j->path==NULL ){
+			printf("# ERROR: out of memory for %s\n",path);
+			free(j);
+			}
+		else{
+			j->disk  = d;
+			j->track = track;
+			j->side  = side;
+			*w->tail = j;
+			w->tail  = &j->next;
+			pthread_cond_broadcast(&w->ready);
+			}
+		}
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *
+worker(void *arg)
+{
+	watcher_t *w = (watcher_t *)arg;
+	job_t *j,**p;
+
+	for(;;){
+		pthread_mutex_lock(&w->lock);
+		for(;;){
+			for(p=&w->head;*p && (*p)->disk->busy;p=&(*p)->next)
+				;
+			if( *p )
+				break;
+			pthread_cond_wait(&w->ready,&w->lock);
+			}
+		j = *p;
+		*p = j->next;
+		if( w->tail==&j->next )
+			w->tail = p;
+		j->disk->busy = true;
+		pthread_mutex_unlock(&w->lock);
+
+		w->decode(w->arg,&j->disk->state,j->disk->path,j->track,j->side,j->path);
+
+		pthread_mutex_lock(&w->lock);
+		j->disk->busy = false;
+		pthread_cond_broadcast(&w->ready);
+		pthread_mutex_unlock(&w->lock);
+		free(j->path);
+		free(j);
+		}
+	return NULL;
+}
+
+// queue the track files already in a directory
+static inline void
+disk_scan(watcher_t *w, disk_t *d)
+{
+	char path[FILENAME_MAX];
+	unsigned int track,side;
+
+	for(track=0;track<NTRACKS;track++)
+	for(side=0;side<NSIDES;side++){
+		floppy8_track_name(path,sizeof(path),d->path,track,side);
+		if( access(path,R_OK)==0 )
+			job_add(w,d,track,side);
+		}
+}
+
+static inline disk_t *
+disk_of(const watcher_t *w, const int wd)
+{
+	unsigned int i;
+
+	for(i=0;i<w->ndisks;i++)
+		if( w->disks[i]->wd==wd )
+			return w->disks[i];
+	return NULL;
+}
+
+// start watching a directory.  Only the main thread adds disks, so 'disks' needs no lock
+static inline disk_t *
+disk_add(watcher_t *w, const char *path)
+{
+	disk_t *d,**more;
+
+	more = (disk_t **)realloc(w->disks,(w->ndisks+1)*sizeof(disk_t *));
+	if( more==NULL )
+		return NULL;
+	w->disks = more;
+	d = (disk_t *)calloc(1,sizeof(*d));
+	if( d==NULL )
+		return NULL;
+	d->path = strdup(path);
+	d->wd = inotify_add_watch(w->fd,path,IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+	if( d->path==NULL || d->wd<0 || disk_of(w,d->wd) ){
+		if( d->wd<0 )
+			printf("# ERROR: cannot watch %s\n",path);
+		free(d->path);
+		free(d);
+		return NULL;
+		}
+	w->disks[w->ndisks++] = d;
+	disk_scan(w,d);		// files written before the watch was in place
+	return d;
+}
+
+// watch 'dir' and its sub-directories, decoding track files on 'workers' threads, until killed
+int
+watch_run(const char *dir, unsigned int workers, watch_track_t decode, void *arg)
+{
+	char buf[EVENTS] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[FILENAME_MAX];
+	const struct inotify_event *e;
+	struct dirent *de;
+	struct stat sb;
+	pthread_t thread;
+	unsigned int i,track,side,started = 0;
+	watcher_t w;
+	disk_t *d;
+	ssize_t len;
+	char *p;
+	DIR *dp;
+
+	memset(&w,0,sizeof(w));
+	w.decode = decode;
+	w.arg    = arg;
+	w.tail   = &w.head;
+	pthread_mutex_init(&w.lock,NULL);
+	pthread_cond_init(&w.ready,NULL);
+	w.fd = inotify_init1(IN_CLOEXEC);
+	if( w.fd<0 || disk_add(&w,dir)==NULL )
+		return FLOPPY8_EIO;
+	for(i=0;i<workers || started==0;i++){
+		if( pthread_create(&thread,NULL,worker,&w)!=0 )
+			break;
+		pthread_detach(thread);
+		started++;
+		}
+	if( started==0 )
+		return FLOPPY8_ENOMEM;
+
+	dp = opendir(dir);
+	while( dp && (de=readdir(dp))!=NULL ){
+		if( de->d_name[0]=='.' )
+			continue;
+		snprintf(path,sizeof(path),"%s/%s",dir,de->d_name);
+		if( stat(path,&sb)==0 && S_ISDIR(sb.st_mode) )
+			(void)disk_add(&w,path);
+		}
+	if( dp )
+		closedir(dp);
+
+	while( (len=read(w.fd,buf,sizeof(buf)))>0 ){
+		for(p=buf;p<buf+len;p+=sizeof(struct inotify_event)+e->len){
+			e = (const struct inotify_event *)p;
+			if( e->mask & IN_Q_OVERFLOW ){
+				printf("# ERROR: missed file events, looking at every track again\n");
+				for(i=0;i<w.ndisks;i++)
+					disk_scan(&w,w.disks[i]);
+				continue;
+				}
+			d = disk_of(&w,e->wd);
+			if( d==NULL || e->len==0 )
+				continue;
+			if( e->mask & IN_ISDIR ){
+				snprintf(path,sizeof(path),"%s/%s",dir,e->name);
+				if( d==w.disks[0] && (e->mask & (IN_CREATE | IN_MOVED_TO)) )
+					(void)disk_add(&w,path);
+				}
+			else if( (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && track_of(e->name,&track,&side) )
+				job_add(&w,d,track,side);
+			}
+		}
+	printf("# ERROR: cannot read file events for %s\n",dir);
+	return FLOPPY8_EIO;
+}
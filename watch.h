@@ -0,0 +1,21 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "floppy8.h"
+
+//	watch --- decode track captures as soon as they are written
+//
+// Watches a directory of disk directories (DiskNNN/, as the capture device writes them) and
+// the directory itself.  A TrackNN.raw (or TrackNN_1.raw, side 1) file is passed on once it
+// is complete: closed after writing, or renamed into place.  Files already there when
+// watching starts are passed on first.
+
+// decode track 'track' side 'side' of the disk in directory 'disk' from file 'path'.  Called
+// from a pool of worker threads, but never for two tracks of the same disk at once, and in
+// the order the files were written.  '*state' belongs to the disk, NULL until first set
+typedef void (*watch_track_t)(void *arg, void **state, const char *disk, unsigned int track,
+		unsigned int side, const char *path);
+
+int	watch_run(const char *dir, unsigned int workers, watch_track_t decode, void *arg);
+
+#endif